@@ -7,107 +7,1982 @@
  * Distributed under the MIT license, please see LICENSE in the top dir.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <uuid/uuid.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "recontext.h"
+#include "recontext_private.h"
+
+/*
+ * Library contexts are refcounted: recontext_init() holds one reference
+ * for the calling thread and every recontext object holds another, so the
+ * world lives as long as anything still needs it.
+ *
+ * Redland worlds must not be used from several threads at once, so each
+ * thread gets a context of its own. Objects remember their context and
+ * must only be used on the thread that created them, or with that thread
+ * otherwise known to be idle.
+ *
+ * Private contexts belong to no thread. Background jobs enter one while
+ * they build a recontext, which then has the world to itself and may move
+ * between threads. Released private contexts are kept as spares, so their
+ * worlds and pooled parsers are set up once per concurrent job rather
+ * than once per job.
+ *
+ * Nodes must never be shared between worlds: a world may be recycled or
+ * freed while nodes copied out of it live on. Operations that combine
+ * recontexts of different contexts copy the graph over first.
+ */
+static GHashTable *thread_contexts = NULL;
+static GQueue      spare_contexts = G_QUEUE_INIT;
+
+static GPrivate    entered_ctx = G_PRIVATE_INIT(NULL);
+
+G_LOCK_DEFINE_STATIC(thread_contexts);
+
+static void
+recontext_free_parser_queue(gpointer data)
+{
+    GQueue *idle = data;
+    librdf_parser *parser;
+
+    while ((parser = g_queue_pop_head(idle)) != NULL)
+        librdf_free_parser(parser);
+    g_queue_free(idle);
+}
+
+static void
+recontext_free_serializer_queue(gpointer data)
+{
+    GQueue *idle = data;
+    librdf_serializer *serializer;
+
+    while ((serializer = g_queue_pop_head(idle)) != NULL)
+        librdf_free_serializer(serializer);
+    g_queue_free(idle);
+}
+
+static GQueue*
+recontext_pool_queue(GHashTable *pool, const char *name)
+{
+    GQueue *idle;
+
+    idle = g_hash_table_lookup(pool, name);
+    if (idle == NULL) {
+        idle = g_queue_new();
+        g_hash_table_insert(pool, g_strdup(name), idle);
+    }
+
+    return idle;
+}
+
+/* compiled queries kept per context, least recently used go first */
+#define RECONTEXT_QUERY_CACHE_SIZE 64
+
+typedef struct {
+    gchar        *name;
+    librdf_query *query;
+    GList         link;
+} recontext_query_entry;
+
+static void
+recontext_query_entry_free(recontext_query_entry *entry)
+{
+    librdf_free_query(entry->query);
+    g_free(entry->name);
+    g_free(entry);
+}
+
+/*
+ * Parsing into a stream ends quietly on syntax errors, the world only
+ * logs them. Counting them tells a truncated document from a complete
+ * one; the messages still go to the default handler.
+ */
+static int
+recontext_ctx_log(void *user_data, librdf_log_message *message)
+{
+    recontext_ctx *ctx = user_data;
+
+    if (librdf_log_message_level(message) >= LIBRDF_LOG_ERROR)
+        ctx->errors++;
+
+    return 0;
+}
+
+static recontext_ctx*
+recontext_ctx_new(GThread *owner)
+{
+    recontext_ctx *ctx;
+    guint64 start;
+
+    ctx = g_new0(recontext_ctx, 1);
+    ctx->owner = owner;
+
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_WORLD);
+    ctx->world = librdf_new_world();
+    librdf_world_set_logger(ctx->world, ctx, recontext_ctx_log);
+    librdf_world_open(ctx->world);
+    recontext_compact_register(ctx->world);
+    RECONTEXT_OP_END(RECONTEXT_OP_WORLD, start, 0, 0);
+
+    ctx->parsers = g_hash_table_new_full(g_str_hash, g_str_equal,
+        g_free, recontext_free_parser_queue);
+    ctx->serializers = g_hash_table_new_full(g_str_hash, g_str_equal,
+        g_free, recontext_free_serializer_queue);
+    ctx->queries = g_hash_table_new_full(g_str_hash, g_str_equal,
+        NULL, (GDestroyNotify) recontext_query_entry_free);
+
+    return ctx;
+}
+
+static void
+recontext_ctx_free(recontext_ctx *ctx)
+{
+    // pooled objects and queries belong to the world, free them first
+    g_hash_table_destroy(ctx->queries);
+    g_hash_table_destroy(ctx->parsers);
+    g_hash_table_destroy(ctx->serializers);
+    librdf_free_world(ctx->world);
+    g_free(ctx);
+}
+
+/* the context entered by this thread, or else the thread's own */
+recontext_ctx*
+recontext_ctx_ref(void)
+{
+    recontext_ctx *ctx = g_private_get(&entered_ctx);
+    GThread *self = g_thread_self();
+
+    G_LOCK(thread_contexts);
+
+    if (ctx == NULL) {
+        if (thread_contexts == NULL)
+            thread_contexts = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+        ctx = g_hash_table_lookup(thread_contexts, self);
+
+        if (ctx == NULL) {
+            ctx = recontext_ctx_new(self);
+            g_hash_table_insert(thread_contexts, self, ctx);
+        }
+    }
+
+    ctx->refcount++;
+
+    G_UNLOCK(thread_contexts);
+    return ctx;
+}
+
+void
+recontext_ctx_unref(recontext_ctx *ctx)
+{
+    G_LOCK(thread_contexts);
+
+    if (--ctx->refcount > 0) {
+        G_UNLOCK(thread_contexts);
+        return;
+    }
+
+    if (ctx->owner != NULL) {
+        g_hash_table_remove(thread_contexts, ctx->owner);
+    } else if (spare_contexts.length < g_get_num_processors()) {
+        g_queue_push_head(&spare_contexts, ctx);
+        G_UNLOCK(thread_contexts);
+        return;
+    }
+
+    G_UNLOCK(thread_contexts);
+    recontext_ctx_free(ctx);
+}
+
+/* a context of no thread, with one reference for the caller */
+recontext_ctx*
+recontext_ctx_new_private(void)
+{
+    recontext_ctx *ctx;
+
+    G_LOCK(thread_contexts);
+    ctx = g_queue_pop_head(&spare_contexts);
+    G_UNLOCK(thread_contexts);
+
+    if (ctx == NULL)
+        ctx = recontext_ctx_new(NULL);
+
+    ctx->refcount = 1;
+    return ctx;
+}
+
+/* make the calling thread create its objects in ctx, NULL to stop */
+void
+recontext_ctx_enter(recontext_ctx *ctx)
+{
+    g_private_set(&entered_ctx, ctx);
+}
+
+librdf_parser*
+recontext_ctx_acquire_parser(recontext_ctx *ctx, const char *name)
+{
+    librdf_parser *parser;
+
+    parser = g_queue_pop_head(recontext_pool_queue(ctx->parsers, name));
+    if (parser == NULL)
+        parser = librdf_new_parser(ctx->world, name, NULL, NULL);
+
+    return parser;
+}
+
+void
+recontext_ctx_release_parser(recontext_ctx *ctx, const char *name, librdf_parser *parser)
+{
+    if (parser != NULL)
+        g_queue_push_head(recontext_pool_queue(ctx->parsers, name), parser);
+}
+
+static void
+recontext_serializer_set_feature(recontext_ctx *ctx, librdf_serializer *serializer,
+                                 const char *feature, const char *value)
+{
+    librdf_uri *feature_uri;
+    librdf_node *feature_node;
+
+    feature_uri = librdf_new_uri(ctx->world, (const unsigned char *) feature);
+    feature_node = librdf_new_node_from_literal(ctx->world, (const unsigned char *) value, NULL, 0);
+    librdf_serializer_set_feature(serializer, feature_uri, feature_node);
+    librdf_free_uri(feature_uri);
+    librdf_free_node(feature_node);
+}
+
+static void
+recontext_serializer_set_namespace(recontext_ctx *ctx, librdf_serializer *serializer,
+                                   const char *uri_str, const char *prefix)
+{
+    librdf_uri *uri;
+
+    uri = librdf_new_uri(ctx->world, (const unsigned char *) uri_str);
+    librdf_serializer_set_namespace(serializer, uri, prefix);
+    librdf_free_uri(uri);
+}
+
+librdf_serializer*
+recontext_ctx_acquire_serializer(recontext_ctx *ctx, const char *name)
+{
+    librdf_serializer *serializer;
+
+    serializer = g_queue_pop_head(recontext_pool_queue(ctx->serializers, name));
+    if (serializer != NULL)
+        return serializer;
+
+    serializer = librdf_new_serializer(ctx->world, name, NULL, NULL);
+    if (serializer == NULL)
+        return NULL;
+
+    // pooled serializers keep their configuration, so set it up only once;
+    // XMP wants rdf:about="" for the asset itself, the other formats are
+    // read back without knowing the base and keep absolute IRIs
+    if (g_str_has_prefix(name, "rdfxml")) {
+        recontext_serializer_set_feature(ctx, serializer,
+            "http://feature.librdf.org/raptor-relativeURIs", "1");
+        recontext_serializer_set_feature(ctx, serializer,
+            "http://feature.librdf.org/raptor-writeBaseURI", "0");
+    }
+
+    recontext_serializer_set_namespace(ctx, serializer,
+        "http://purl.org/dc/elements/1.1/", "dc");
+    recontext_serializer_set_namespace(ctx, serializer,
+        "http://purl.org/dc/terms/", "dcterms");
+    recontext_serializer_set_namespace(ctx, serializer,
+        "http://creativecommons.org/ns#", "cc");
+    recontext_serializer_set_namespace(ctx, serializer,
+        "http://www.w3.org/1999/xhtml/vocab#", "xhv");
+    recontext_serializer_set_namespace(ctx, serializer,
+        "http://ogp.me/ns#", "og");
+
+    return serializer;
+}
+
+void
+recontext_ctx_release_serializer(recontext_ctx *ctx, const char *name,
+                                 librdf_serializer *serializer)
+{
+    if (serializer != NULL)
+        g_queue_push_head(recontext_pool_queue(ctx->serializers, name), serializer);
+}
+
+/*
+ * Queries are compiled on first use and kept by name, up to
+ * RECONTEXT_QUERY_CACHE_SIZE per context; a compiled query can be executed
+ * any number of times against any model of the same world. Callers look
+ * a query up first and only generate its text on a miss.
+ */
+librdf_query*
+recontext_ctx_lookup_query(recontext_ctx *ctx, const char *name)
+{
+    recontext_query_entry *entry;
+
+    entry = g_hash_table_lookup(ctx->queries, name);
+    if (entry == NULL)
+        return NULL;
+
+    g_queue_unlink(&ctx->query_lru, &entry->link);
+    g_queue_push_head_link(&ctx->query_lru, &entry->link);
+    return entry->query;
+}
+
+librdf_query*
+recontext_ctx_add_query(recontext_ctx *ctx, const char *name, const char *query_string)
+{
+    recontext_query_entry *entry;
+    librdf_query *query;
+
+    query = recontext_ctx_lookup_query(ctx, name);
+    if (query != NULL)
+        return query;
+
+    query = librdf_new_query(ctx->world, "sparql", NULL,
+                             (const unsigned char *) query_string, NULL);
+    if (query == NULL)
+        return NULL;
+
+    if (ctx->query_lru.length >= RECONTEXT_QUERY_CACHE_SIZE) {
+        GList *oldest = g_queue_pop_tail_link(&ctx->query_lru);
+        recontext_query_entry *evicted = oldest->data;
+
+        g_hash_table_remove(ctx->queries, evicted->name);
+    }
+
+    entry = g_new0(recontext_query_entry, 1);
+    entry->name = g_strdup(name);
+    entry->query = query;
+    entry->link.data = entry;
+
+    g_hash_table_replace(ctx->queries, entry->name, entry);
+    g_queue_push_head_link(&ctx->query_lru, &entry->link);
+
+    return query;
+}
+
+void
+recontext_init(void)
+{
+    recontext_ctx *ctx;
+
+    ctx = recontext_ctx_ref();
+
+    G_LOCK(thread_contexts);
+    if (ctx->held) {
+        G_UNLOCK(thread_contexts);
+        recontext_ctx_unref(ctx);
+        return;
+    }
+    ctx->held = 1;
+    G_UNLOCK(thread_contexts);
+}
+
+void
+recontext_cleanup(void)
+{
+    recontext_ctx *ctx;
+
+    G_LOCK(thread_contexts);
+    ctx = thread_contexts ? g_hash_table_lookup(thread_contexts, g_thread_self()) : NULL;
+    if (ctx != NULL && ctx->held)
+        ctx->held = 0;
+    else
+        ctx = NULL;
+    G_UNLOCK(thread_contexts);
+
+    if (ctx != NULL)
+        recontext_ctx_unref(ctx);
+
+    // spares are idle by definition
+    G_LOCK(thread_contexts);
+    while ((ctx = g_queue_pop_head(&spare_contexts)) != NULL) {
+        G_UNLOCK(thread_contexts);
+        recontext_ctx_free(ctx);
+        G_LOCK(thread_contexts);
+    }
+    G_UNLOCK(thread_contexts);
+}
+
+static recontext_storage default_storage = RECONTEXT_STORAGE_MEMORY;
+
+void
+recontext_set_default_storage(recontext_storage storage)
+{
+    G_LOCK(thread_contexts);
+    default_storage = storage == RECONTEXT_STORAGE_DEFAULT ? RECONTEXT_STORAGE_MEMORY : storage;
+    G_UNLOCK(thread_contexts);
+}
+
+/*
+ * Instrumentation. The settings are process-wide and meant to be changed
+ * while no other thread is inside the library; the counters are kept per
+ * thread and need no locking. Work run on worker threads for a batch or
+ * async call is moved over to the thread collecting its result. Trace
+ * hooks run inline and must not call back into the library.
+ */
+int recontext_instrumented = 0;
+
+static int                   stats_enabled = 0;
+static recontext_trace_func  trace_func = NULL;
+static void                 *trace_data = NULL;
+
+static GPrivate              thread_stats = G_PRIVATE_INIT(g_free);
+
+static const char *recontext_op_names[] = {
+    [RECONTEXT_OP_WORLD]        = "world",
+    [RECONTEXT_OP_PARSE]        = "parse",
+    [RECONTEXT_OP_EXTRACT]      = "extract",
+    [RECONTEXT_OP_MERGE]        = "merge",
+    [RECONTEXT_OP_QUERY]        = "query",
+    [RECONTEXT_OP_WRITE_EXIV2]  = "write_exiv2",
+    [RECONTEXT_OP_SERIALIZE]    = "serialize",
+};
+
+static guint64
+recontext_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static recontext_stats*
+recontext_thread_stats(void)
+{
+    recontext_stats *stats = g_private_get(&thread_stats);
+
+    if (stats == NULL) {
+        stats = g_new0(recontext_stats, 1);
+        g_private_set(&thread_stats, stats);
+    }
+
+    return stats;
+}
+
+guint64
+recontext_op_begin(recontext_op op)
+{
+    if (trace_func != NULL)
+        trace_func(op, 1, trace_data);
+
+    // zero means "not measured" to RECONTEXT_OP_END
+    return MAX(recontext_now(), 1);
+}
+
+void
+recontext_op_end(recontext_op op, guint64 start, size_t statements, size_t bytes)
+{
+    if (stats_enabled) {
+        recontext_op_stats *stats = &recontext_thread_stats()->ops[op];
+        guint64 elapsed = recontext_now() - start;
+
+        stats->calls++;
+        stats->total_ns += elapsed;
+        stats->max_ns = MAX(stats->max_ns, elapsed);
+        stats->statements += statements;
+        stats->bytes += bytes;
+    }
+
+    if (trace_func != NULL)
+        trace_func(op, 0, trace_data);
+}
+
+size_t
+recontext_model_size(librdf_model *model)
+{
+    int size = librdf_model_size(model);
+
+    return size > 0 ? (size_t) size : 0;
+}
+
+void
+recontext_set_stats_enabled(int enabled)
+{
+    stats_enabled = enabled;
+    recontext_instrumented = stats_enabled || trace_func != NULL;
+}
+
+void
+recontext_set_trace_func(recontext_trace_func func, void *user_data)
+{
+    trace_func = func;
+    trace_data = user_data;
+    recontext_instrumented = stats_enabled || trace_func != NULL;
+}
+
+void
+recontext_get_stats(recontext_stats *stats)
+{
+    recontext_stats *current = g_private_get(&thread_stats);
+
+    // nothing recorded yet means nothing has been counted
+    if (current != NULL)
+        *stats = *current;
+    else
+        memset(stats, 0, sizeof(*stats));
+}
+
+void
+recontext_reset_stats(void)
+{
+    recontext_stats *current = g_private_get(&thread_stats);
+
+    if (current != NULL)
+        memset(current, 0, sizeof(*current));
+}
+
+/* set the counters of this thread aside, so a job starts from zero */
+void
+recontext_stats_begin_job(recontext_stats *saved)
+{
+    recontext_stats *current = recontext_thread_stats();
+
+    *saved = *current;
+    memset(current, 0, sizeof(*current));
+}
+
+/* hand the counts of the job to job and restore the counters set aside */
+void
+recontext_stats_end_job(recontext_stats *saved, recontext_stats *job)
+{
+    recontext_stats *current = recontext_thread_stats();
+
+    *job = *current;
+    *current = *saved;
+}
+
+/* add the counts of a job run elsewhere to this thread */
+void
+recontext_stats_add(const recontext_stats *job)
+{
+    recontext_stats *current;
+    int op;
+
+    if (!stats_enabled)
+        return;
+
+    current = recontext_thread_stats();
+    for (op = 0; op < RECONTEXT_OP_COUNT; op++) {
+        recontext_op_stats *to = &current->ops[op];
+        const recontext_op_stats *from = &job->ops[op];
+
+        to->calls += from->calls;
+        to->total_ns += from->total_ns;
+        to->max_ns = MAX(to->max_ns, from->max_ns);
+        to->statements += from->statements;
+        to->bytes += from->bytes;
+    }
+}
+
+const char*
+recontext_op_name(recontext_op op)
+{
+    if (op < 0 || op >= RECONTEXT_OP_COUNT)
+        return NULL;
+
+    return recontext_op_names[op];
+}
+
+static size_t default_budget = 0;
+
+void
+recontext_set_default_budget(size_t bytes)
+{
+    G_LOCK(thread_contexts);
+    default_budget = bytes;
+    G_UNLOCK(thread_contexts);
+}
+
+void
+recontext_set_budget(recontext *rc, size_t bytes)
+{
+    rc->priv->budget = bytes;
+}
+
+size_t
+recontext_get_usage(recontext *rc)
+{
+    return rc->priv->usage;
+}
+
+/* rough per-statement overhead of the stores on top of the term strings */
+#define RECONTEXT_STATEMENT_COST 96
+
+static size_t
+recontext_node_cost(librdf_node *node)
+{
+    size_t length = 0;
+
+    if (librdf_node_is_resource(node))
+        librdf_uri_as_counted_string(librdf_node_get_uri(node), &length);
+    else if (librdf_node_is_literal(node))
+        librdf_node_get_literal_value_as_counted_string(node, &length);
+    else if (librdf_node_is_blank(node))
+        librdf_node_get_counted_blank_identifier(node, &length);
+
+    return length;
+}
+
+/*
+ * Account for a statement about to be added. Usage is only tracked while
+ * a budget is set; returns non-zero once the budget is exceeded.
+ */
+int
+recontext_charge(recontext *rc, librdf_statement *statement)
+{
+    recontext_priv *priv = rc->priv;
+
+    if (priv->budget == 0)
+        return 0;
+
+    priv->usage += RECONTEXT_STATEMENT_COST +
+        recontext_node_cost(librdf_statement_get_subject(statement)) +
+        recontext_node_cost(librdf_statement_get_predicate(statement)) +
+        recontext_node_cost(librdf_statement_get_object(statement));
+
+    return priv->usage > priv->budget;
+}
+
+/* add parsed statements one by one, stopping at the budget */
+static int
+recontext_add_parsed(recontext *rc, librdf_stream *stream)
+{
+    guint errors = rc->ctx->errors;
+    int error = 0;
+
+    if (stream == NULL)
+        return 1;
+
+    while (!librdf_stream_end(stream)) {
+        librdf_statement *statement = librdf_stream_get_object(stream);
+
+        if (recontext_charge(rc, statement)) {
+            error = 1;
+            break;
+        }
+
+        librdf_model_add_statement(rc->model, statement);
+        librdf_stream_next(stream);
+    }
+
+    librdf_free_stream(stream);
+
+    // the stream just ends on a syntax error, only the logger knows
+    if (rc->ctx->errors != errors)
+        error = 1;
+
+    return error;
+}
+
+#define RDF_NS "http://www.w3.org/1999/02/22-rdf-syntax-ns#"
+
+/* serial numbers of recontexts, guarded by the thread_contexts lock */
+static guint64 last_serial = 0;
+
+static void
+recontext_mark(recontext *rc, const char *predicate, gsize generation)
+{
+    recontext_priv *priv = rc->priv;
+
+    // container members hang off rdf:_N and rdf:li arcs
+    if (g_str_has_prefix(predicate, RDF_NS))
+        priv->containers_changed = generation;
+
+    g_hash_table_insert(priv->changed, g_string_chunk_insert_const(priv->strings, predicate),
+                        GSIZE_TO_POINTER(generation));
+}
+
+/*
+ * Record a change to the statements with the given predicate, NULL when
+ * any predicate may have changed. Returns the new generation.
+ */
+gsize
+recontext_changed(recontext *rc, const char *predicate)
+{
+    recontext_priv *priv = rc->priv;
+
+    priv->generation++;
+
+    if (predicate == NULL) {
+        priv->all_changed = priv->generation;
+        priv->containers_changed = priv->generation;
+    } else {
+        recontext_mark(rc, predicate, priv->generation);
+    }
+
+    return priv->generation;
+}
+
+static void
+recontext_mark_node(gpointer data, gpointer user_data)
+{
+    recontext *rc = user_data;
+    librdf_node *node = data;
+
+    recontext_mark(rc, (const char *) librdf_uri_as_string(librdf_node_get_uri(node)),
+                   rc->priv->generation);
+}
+
+/* record a change to every predicate used in source */
+void
+recontext_changed_model(recontext *rc, recontext *source)
+{
+    librdf_stream *stream;
+
+    rc->priv->generation++;
+
+    if (source->priv->storage == RECONTEXT_STORAGE_COMPACT) {
+        recontext_compact_foreach_predicate(recontext_compact_get(source->storage),
+                                            recontext_mark_node, rc);
+        return;
+    }
+
+    stream = librdf_model_as_stream(source->model);
+    while (!librdf_stream_end(stream)) {
+        recontext_mark_node(librdf_statement_get_predicate(librdf_stream_get_object(stream)), rc);
+        librdf_stream_next(stream);
+    }
+    librdf_free_stream(stream);
+}
+
+gboolean
+recontext_changed_since(recontext *rc, const char *predicate, gsize since)
+{
+    recontext_priv *priv = rc->priv;
+
+    if (priv->all_changed > since)
+        return TRUE;
+
+    return GPOINTER_TO_SIZE(g_hash_table_lookup(priv->changed, predicate)) > since;
+}
+
+uint64_t
+recontext_get_generation(recontext *rc)
+{
+    return rc->priv->generation;
+}
+
+void
+recontext_touch(recontext *rc, const char *predicate)
+{
+    recontext_changed(rc, predicate);
+}
+
+int
+recontext_add(recontext *rc, librdf_node *subject, librdf_node *predicate, librdf_node *object)
+{
+    librdf_statement *statement;
+    size_t usage = rc->priv->usage;
+    int error;
+
+    statement = librdf_new_statement_from_nodes(rc->world, subject, predicate, object);
+    if (statement == NULL)
+        return 1;
+
+    error = recontext_charge(rc, statement);
+    if (!error)
+        error = librdf_model_add_statement(rc->model, statement);
+
+    // a statement that did not make it in costs nothing
+    if (error)
+        rc->priv->usage = usage;
+    else
+        recontext_changed(rc, (const char *) librdf_uri_as_string(librdf_node_get_uri(predicate)));
+
+    librdf_free_statement(statement);
+    return error;
+}
+
+/*
+ * Three kinds of store are on offer. The compact store (see
+ * recontext_compact.c) suits the small per-asset graphs best. The indexed
+ * store keeps the statements in trees keyed by subject, predicate and
+ * object, so a lookup costs in proportion to its result rather than to
+ * the graph; Redland's "hashes" store stands in where "trees" is not
+ * built in. Redland's plain "memory" store is an unindexed list, and it
+ * is the fallback whenever another store cannot be created.
+ */
+static librdf_storage*
+recontext_new_storage(librdf_world *world, recontext_storage *storage)
+{
+    librdf_storage *result = NULL;
+
+    if (*storage == RECONTEXT_STORAGE_DEFAULT) {
+        G_LOCK(thread_contexts);
+        *storage = default_storage;
+        G_UNLOCK(thread_contexts);
+    }
+
+    if (*storage == RECONTEXT_STORAGE_COMPACT)
+        result = librdf_new_storage(world, RECONTEXT_COMPACT_STORAGE, NULL, NULL);
+
+    if (*storage == RECONTEXT_STORAGE_INDEXED) {
+        result = librdf_new_storage(world, "trees", NULL,
+            "index-spo='yes',index-pso='yes',index-ops='yes'");
+        if (result == NULL)
+            result = librdf_new_storage(world, "hashes", "recontext",
+                "hash-type='memory',index-predicates='yes'");
+    }
+
+    // Redland's own list store backs everything else
+    if (result == NULL) {
+        result = librdf_new_storage(world, "memory", NULL, NULL);
+        *storage = RECONTEXT_STORAGE_MEMORY;
+    }
+
+    return result;
+}
+
+/* takes over a reference on ctx */
+static recontext*
+recontext_new_owning(recontext_ctx *ctx, const char *subject, recontext_storage storage)
+{
+    recontext* rc;
+    char uuid_str[sizeof("urn:uuid:") + 36];
+
+    // the private part shares the allocation of the recontext
+    rc = g_malloc0(sizeof(recontext) + sizeof(recontext_priv));
+    rc->priv = (recontext_priv *) (rc + 1);
+    rc->priv->strings = g_string_chunk_new(256);
+    rc->priv->changed = g_hash_table_new(g_str_hash, g_str_equal);
+
+    rc->ctx = ctx;
+    rc->world = rc->ctx->world;
+    rc->storage = recontext_new_storage(rc->world, &storage);
+    rc->priv->storage = storage;
+    rc->model = librdf_new_model(rc->world, rc->storage, NULL);
+
+    if (subject == NULL) {
+        uuid_t uuid;
+        uuid_generate(uuid);
+        strcpy(uuid_str, "urn:uuid:");
+        uuid_unparse(uuid, uuid_str + sizeof("urn:uuid:") - 1);
+        subject = uuid_str;
+    }
+
+    rc->main_subject = g_string_chunk_insert(rc->priv->strings, subject);
+    rc->priv->base_uri = librdf_new_uri(rc->world, (const unsigned char *) rc->main_subject);
+
+    G_LOCK(thread_contexts);
+    rc->priv->budget = default_budget;
+    rc->priv->serial = ++last_serial;
+    G_UNLOCK(thread_contexts);
+
+    return rc;
+}
+
+recontext*
+recontext_new_with_storage(const char *subject, recontext_storage storage)
+{
+    return recontext_new_owning(recontext_ctx_ref(), subject, storage);
+}
+
+/* a recontext in the world of ctx rather than the calling thread's */
+recontext*
+recontext_new_in_ctx(recontext_ctx *ctx, const char *subject, recontext_storage storage)
+{
+    G_LOCK(thread_contexts);
+    ctx->refcount++;
+    G_UNLOCK(thread_contexts);
+
+    return recontext_new_owning(ctx, subject, storage);
+}
+
+/* node for another world; nodes hold interned URIs of their own world */
+static librdf_node*
+recontext_node_for_world(librdf_world *world, librdf_node *node)
+{
+    const unsigned char *value;
+    librdf_uri *datatype;
+    librdf_node *result;
+    const char *language;
+    size_t length = 0;
+
+    if (librdf_node_is_resource(node))
+        return librdf_new_node_from_uri_string(world,
+            librdf_uri_as_string(librdf_node_get_uri(node)));
+
+    if (librdf_node_is_blank(node))
+        return librdf_new_node_from_blank_identifier(world,
+            librdf_node_get_blank_identifier(node));
+
+    value = librdf_node_get_literal_value_as_counted_string(node, &length);
+    language = librdf_node_get_literal_value_language(node);
+    datatype = librdf_node_get_literal_value_datatype_uri(node);
+    if (datatype != NULL)
+        datatype = librdf_new_uri(world, librdf_uri_as_string(datatype));
+
+    result = librdf_new_node_from_typed_counted_literal(world, value, length, language,
+                                                        language ? strlen(language) : 0,
+                                                        datatype);
+    if (datatype != NULL)
+        librdf_free_uri(datatype);
+
+    return result;
+}
+
+/*
+ * A copy of rc in the world of ctx, built node by node so that it does
+ * not refer into the world of rc. Change tracking carries over, and the
+ * copy counts as rc itself for the XMP sync records.
+ */
+recontext*
+recontext_copy_to_ctx(recontext *rc, recontext_ctx *ctx)
+{
+    recontext *copy;
+    librdf_stream *stream;
+    GHashTableIter iter;
+    gpointer predicate;
+    gpointer generation;
+
+    copy = recontext_new_in_ctx(ctx, rc->main_subject, rc->priv->storage);
+
+    stream = librdf_model_as_stream(rc->model);
+    while (!librdf_stream_end(stream)) {
+        librdf_statement *statement = librdf_stream_get_object(stream);
+
+        librdf_model_add(copy->model,
+            recontext_node_for_world(copy->world, librdf_statement_get_subject(statement)),
+            recontext_node_for_world(copy->world, librdf_statement_get_predicate(statement)),
+            recontext_node_for_world(copy->world, librdf_statement_get_object(statement)));
+        librdf_stream_next(stream);
+    }
+    librdf_free_stream(stream);
+
+    copy->priv->budget = rc->priv->budget;
+    copy->priv->usage = rc->priv->usage;
+    copy->priv->serial = rc->priv->serial;
+    copy->priv->generation = rc->priv->generation;
+    copy->priv->all_changed = rc->priv->all_changed;
+    copy->priv->containers_changed = rc->priv->containers_changed;
+
+    g_hash_table_iter_init(&iter, rc->priv->changed);
+    while (g_hash_table_iter_next(&iter, &predicate, &generation))
+        g_hash_table_insert(copy->priv->changed,
+                            g_string_chunk_insert_const(copy->priv->strings, predicate),
+                            generation);
+
+    return copy;
+}
+
+recontext*
+recontext_new(const char *subject)
+{
+    return recontext_new_with_storage(subject, RECONTEXT_STORAGE_DEFAULT);
+}
+
+/*
+ * Parser and serializer names per interchange format. RDF/XML is what
+ * XMP uses; N-Triples and Turtle are much cheaper to read and write and
+ * are meant for sidecar caches and exchange between our own tools.
+ */
+static const struct {
+    const char *parser;
+    const char *serializer;
+    const char *extension;
+} recontext_formats[] = {
+    [RECONTEXT_FORMAT_AUTO]     = { NULL,       NULL,            NULL   },
+    [RECONTEXT_FORMAT_RDFXML]   = { "rdfxml",   "rdfxml-abbrev", ".rdf" },
+    [RECONTEXT_FORMAT_NTRIPLES] = { "ntriples", "ntriples",      ".nt"  },
+    [RECONTEXT_FORMAT_TURTLE]   = { "turtle",   "turtle",        ".ttl" },
+};
+
+#define RECONTEXT_GUESS_PREFIX 512
+
+recontext_format
+recontext_guess_format(recontext_ctx *ctx, const char *data, size_t length, const char *filename)
+{
+    recontext_format format;
+    const char *name;
+    gchar *prefix;
+
+    if (filename != NULL) {
+        for (format = RECONTEXT_FORMAT_RDFXML; format <= RECONTEXT_FORMAT_TURTLE; format++) {
+            if (g_str_has_suffix(filename, recontext_formats[format].extension))
+                return format;
+        }
+    }
+
+    // the guesser wants a NUL-terminated buffer, a short prefix is plenty
+    prefix = g_strndup(data, MIN(length, RECONTEXT_GUESS_PREFIX));
+    name = librdf_parser_guess_name2(ctx->world, NULL, (const unsigned char *) prefix,
+                                     (const unsigned char *) filename);
+    g_free(prefix);
+
+    if (name != NULL) {
+        for (format = RECONTEXT_FORMAT_RDFXML; format <= RECONTEXT_FORMAT_TURTLE; format++) {
+            if (strcmp(name, recontext_formats[format].parser) == 0)
+                return format;
+        }
+    }
+
+    return RECONTEXT_FORMAT_RDFXML;
+}
+
+static int
+recontext_parse_counted_string(recontext *rc, const char *data, size_t length,
+                               recontext_format format)
+{
+    librdf_parser *parser;
+    const char *name;
+    guint64 start;
+    int error;
+
+    if (format == RECONTEXT_FORMAT_AUTO)
+        format = recontext_guess_format(rc->ctx, data, length, NULL);
+    name = recontext_formats[format].parser;
+
+    parser = recontext_ctx_acquire_parser(rc->ctx, name);
+    if (parser == NULL)
+        return 1;
+
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_PARSE);
+    if (rc->priv->budget == 0)
+        error = librdf_parser_parse_counted_string_into_model(parser,
+            (const unsigned char *) data, length, rc->priv->base_uri, rc->model);
+    else
+        error = recontext_add_parsed(rc, librdf_parser_parse_counted_string_as_stream(parser,
+            (const unsigned char *) data, length, rc->priv->base_uri));
+    RECONTEXT_OP_END(RECONTEXT_OP_PARSE, start, recontext_model_size(rc->model), length);
+    recontext_changed(rc, NULL);
+
+    recontext_ctx_release_parser(rc->ctx, name, parser);
+    return error;
+}
+
+recontext*
+recontext_new_from_string_fmt(const char *data, const char *base_uri, recontext_format format)
+{
+    recontext* rc;
+
+    rc = recontext_new(base_uri);
+
+    // syntax errors and running out of budget both fail the whole parse
+    if (recontext_parse_counted_string(rc, data, strlen(data), format) != 0) {
+        recontext_destroy(rc);
+        return NULL;
+    }
+
+    return rc;
+}
+
+recontext*
+recontext_new_from_string(const char *rdf_xml, const char *base_uri)
+{
+    return recontext_new_from_string_fmt(rdf_xml, base_uri, RECONTEXT_FORMAT_RDFXML);
+}
+
+/*
+ * Files are streamed through the parser in chunks instead of being read
+ * into memory first, so peak memory stays at the size of the model.
+ */
+static int
+recontext_parse_file_handle(recontext *rc, FILE *fh, recontext_format format)
+{
+    librdf_parser *parser;
+    const char *name;
+    guint64 start;
+    int error;
+
+    name = recontext_formats[format].parser;
+
+    parser = recontext_ctx_acquire_parser(rc->ctx, name);
+    if (parser == NULL)
+        return 1;
+
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_PARSE);
+    if (rc->priv->budget == 0)
+        error = librdf_parser_parse_file_handle_into_model(parser, fh, 0,
+            rc->priv->base_uri, rc->model);
+    else
+        error = recontext_add_parsed(rc, librdf_parser_parse_file_handle_as_stream(parser, fh, 0,
+            rc->priv->base_uri));
+    RECONTEXT_OP_END(RECONTEXT_OP_PARSE, start, recontext_model_size(rc->model),
+                     MAX(ftell(fh), 0));
+    recontext_changed(rc, NULL);
+
+    recontext_ctx_release_parser(rc->ctx, name, parser);
+    return error;
+}
+
+recontext*
+recontext_new_from_file(const char *filename, const char *base_uri)
+{
+    FILE      *fh;
+    char       prefix[RECONTEXT_GUESS_PREFIX];
+    size_t     length;
+    int        error;
+    recontext *rc;
+
+    fh = g_fopen(filename, "rb");
+    if (fh == NULL)
+        return NULL;
+
+    // peek at the head of the file for format detection
+    length = fread(prefix, 1, sizeof(prefix), fh);
+    if (fseek(fh, 0, SEEK_SET) != 0) {
+        fclose(fh);
+        return NULL;
+    }
+
+    rc = recontext_new(base_uri);
+    error = recontext_parse_file_handle(rc, fh,
+        recontext_guess_format(rc->ctx, prefix, length, filename));
+    fclose(fh);
+
+    if (error != 0) {
+        recontext_destroy(rc);
+        return NULL;
+    }
+
+    return rc;
+}
+
+recontext*
+recontext_extract(recontext* rc, char* subject, int remove)
+{
+    recontext        *new;
+    librdf_node      *subject_node;
+    librdf_statement *query_statement;
+    librdf_stream    *stream;
+    guint64           start;
+
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_EXTRACT);
+
+    // compact graphs are extracted into compact graphs, as plain id copies
+    if (rc->priv->storage == RECONTEXT_STORAGE_COMPACT) {
+        new = recontext_new_in_ctx(rc->ctx, subject, RECONTEXT_STORAGE_COMPACT);
+
+        if (new->priv->storage == RECONTEXT_STORAGE_COMPACT) {
+            subject_node = librdf_new_node_from_uri(rc->world, new->priv->base_uri);
+            recontext_compact_copy(recontext_compact_get(new->storage),
+                                   recontext_compact_get(rc->storage), subject_node);
+            if (remove) {
+                recontext_compact_remove_subject(recontext_compact_get(rc->storage), subject_node);
+                recontext_changed_model(rc, new);
+            }
+            librdf_free_node(subject_node);
+
+            RECONTEXT_OP_END(RECONTEXT_OP_EXTRACT, start,
+                             recontext_model_size(new->model), 0);
+            return new;
+        }
+    } else {
+        new = recontext_new_in_ctx(rc->ctx, subject, rc->priv->storage);
+    }
+
+    query_statement = librdf_new_statement_from_nodes(rc->world,
+        librdf_new_node_from_uri(rc->world, new->priv->base_uri), NULL, NULL);
+
+    stream = librdf_model_find_statements(rc->model, query_statement);
+    librdf_model_add_statements(new->model, stream);
+    librdf_free_stream(stream);
+    librdf_free_statement(query_statement);
+
+    // removing while the lookup stream is open would invalidate indexed
+    // stores, so drop the statements afterwards by walking the copy
+    if (remove) {
+        stream = librdf_model_as_stream(new->model);
+
+        while (!librdf_stream_end(stream)) {
+            librdf_model_remove_statement(rc->model, librdf_stream_get_object(stream));
+            librdf_stream_next(stream);
+        }
+
+        librdf_free_stream(stream);
+        recontext_changed_model(rc, new);
+    }
+
+    RECONTEXT_OP_END(RECONTEXT_OP_EXTRACT, start, recontext_model_size(new->model), 0);
+    return new;
+}
+
+int
+recontext_merge(recontext* rc, recontext *other, const char *relation)
+{
+    return recontext_merge_with_flags(rc, other, relation, 0);
+}
+
+/* charge a statement the merge adds, unless rc or the merge has it already */
+static int
+recontext_charge_new(recontext *rc, librdf_statement *statement, GHashTable *seen)
+{
+    gchar *subject;
+    gchar *predicate;
+    gchar *object;
+    gchar *key;
+
+    if (librdf_model_contains_statement(rc->model, statement))
+        return 0;
+
+    subject = recontext_node_key(librdf_statement_get_subject(statement));
+    predicate = recontext_node_key(librdf_statement_get_predicate(statement));
+    object = recontext_node_key(librdf_statement_get_object(statement));
+    key = g_strjoin(" ", subject, predicate, object, NULL);
+    g_free(subject);
+    g_free(predicate);
+    g_free(object);
+
+    if (g_hash_table_contains(seen, key)) {
+        g_free(key);
+        return 0;
+    }
+    g_hash_table_add(seen, key);
+
+    return recontext_charge(rc, statement);
+}
+
+/*
+ * Price what a merge adds to rc: the statements of batch, or of other
+ * when there is no batch, and the link, each counted once and only when
+ * rc lacks it. On failure the usage of rc is left as it was.
+ */
+static int
+recontext_charge_merge(recontext *rc, recontext *other, GPtrArray *batch,
+                       librdf_statement *link)
+{
+    size_t usage = rc->priv->usage;
+    GHashTable *seen;
+    int over;
+    guint i;
+
+    seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    over = recontext_charge_new(rc, link, seen);
+
+    if (batch != NULL) {
+        for (i = 0; i < batch->len && !over; i++)
+            over = recontext_charge_new(rc, g_ptr_array_index(batch, i), seen);
+    } else {
+        librdf_stream *stream = librdf_model_as_stream(other->model);
+
+        while (!librdf_stream_end(stream) && !over) {
+            over = recontext_charge_new(rc, librdf_stream_get_object(stream), seen);
+            librdf_stream_next(stream);
+        }
+        librdf_free_stream(stream);
+    }
+
+    g_hash_table_destroy(seen);
+
+    if (over)
+        rc->priv->usage = usage;
+    return over;
+}
+
+int
+recontext_merge_with_flags(recontext *rc, recontext *other, const char *relation, int flags)
+{
+    librdf_stream *stream;
+    librdf_statement *link;
+    GPtrArray *batch = NULL;
+    recontext *moved = NULL;
+    guint64 start;
+    guint i;
+
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_MERGE);
+
+    // nodes must not be shared between worlds, bring the graph over first
+    if (other->ctx != rc->ctx)
+        other = moved = recontext_copy_to_ctx(other, rc->ctx);
+
+    if (relation == NULL)
+        relation = "http://purl.org/dc/elements/1.1/source";
+
+    link = librdf_new_statement_from_nodes(rc->world,
+        librdf_new_node_from_uri(rc->world, rc->priv->base_uri),
+        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) relation),
+        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) other->main_subject));
+
+    if (flags & RECONTEXT_MERGE_DEDUP)
+        batch = recontext_merge_dedup(rc, other);
+
+    // price what is added before adding anything, so a merge that does
+    // not fit leaves the target untouched
+    if (rc->priv->budget != 0 && recontext_charge_merge(rc, other, batch, link)) {
+        if (batch != NULL)
+            g_ptr_array_unref(batch);
+        librdf_free_statement(link);
+        if (moved != NULL)
+            recontext_destroy(moved);
+        RECONTEXT_OP_END(RECONTEXT_OP_MERGE, start, 0, 0);
+        return 1;
+    }
+
+    if (batch != NULL) {
+        // the stores drop duplicates themselves; adding without lookups in
+        // between lets the compact store sort once instead of per statement
+        for (i = 0; i < batch->len; i++)
+            librdf_model_add_statement(rc->model, g_ptr_array_index(batch, i));
+        g_ptr_array_unref(batch);
+    } else if (rc->priv->storage == RECONTEXT_STORAGE_COMPACT &&
+               other->priv->storage == RECONTEXT_STORAGE_COMPACT) {
+        recontext_compact_copy(recontext_compact_get(rc->storage),
+                               recontext_compact_get(other->storage), NULL);
+    } else {
+        stream = librdf_model_as_stream(other->model);
+        librdf_model_add_statements(rc->model, stream);
+        librdf_free_stream(stream);
+    }
+
+    librdf_model_add_statement(rc->model, link);
+    librdf_free_statement(link);
+
+    recontext_changed_model(rc, other);
+    recontext_mark(rc, relation, rc->priv->generation);
+
+    RECONTEXT_OP_END(RECONTEXT_OP_MERGE, start, recontext_model_size(other->model), 0);
+
+    if (moved != NULL)
+        recontext_destroy(moved);
+    return 0;
+}
+
+static const char*
+recontext_memrmem(const char *haystack, size_t length, const char *needle, size_t needle_length)
+{
+    size_t i;
+
+    if (length < needle_length)
+        return NULL;
+
+    for (i = length - needle_length + 1; i-- > 0;) {
+        if (haystack[i] == *needle && memcmp(haystack + i, needle, needle_length) == 0)
+            return haystack + i;
+    }
+
+    return NULL;
+}
 
-#include <uuid/uuid.h>
+/*
+ * The packet may be a slice of a larger binary buffer; the RDF inside it
+ * is located by length rather than NUL termination and parsed in place.
+ */
+static int
+recontext_xmp_find_rdf(const char *packet, size_t length, const char **rdf, size_t *rdf_length)
+{
+    const char    *rdf_start;
+    const char    *rdf_end;
 
-#include <glib.h>
-#include <glib/gstdio.h>
+    rdf_start = memmem(packet, length, "<rdf:RDF", 8);
+    if (rdf_start == NULL)
+        return 0;
 
-#include "recontext.h"
+    rdf_end = recontext_memrmem(rdf_start, length - (rdf_start - packet), "</rdf:RDF>", 10);
+    if (rdf_end == NULL)
+        return 0;
+
+    *rdf = rdf_start;
+    *rdf_length = rdf_end + 10 - rdf_start;
+    return 1;
+}
 
 recontext*
-recontext_new(const char *subject)
+recontext_new_from_xmp_counted(const char *packet, size_t length, const char *base_uri)
 {
-    recontext* rc;
-    char uuid_str[37];
-    char uuid_uri[45];
+    recontext     *rc;
+    const char    *rdf;
+    size_t         rdf_length;
 
-    rc = malloc(sizeof(recontext));
-    rc->world = librdf_new_world();
-    librdf_world_open(rc->world);
-    rc->storage = librdf_new_storage(rc->world, "memory", NULL, NULL);
-    rc->model = librdf_new_model(rc->world, rc->storage, NULL);
-    rc->parser = librdf_new_parser(rc->world, "rdfxml", NULL, NULL);
+    if (!recontext_xmp_find_rdf(packet, length, &rdf, &rdf_length))
+        return NULL;
 
-    if (subject == NULL) {
-        uuid_t uuid;
-        uuid_generate(uuid);
-        uuid_unparse(uuid, uuid_str);
-        sprintf(uuid_uri, "urn:uuid:%s", uuid_str);
-        rc->main_subject = uuid_uri;
-    } else {
-        rc->main_subject = malloc(strlen(subject) + 1);
-        strcpy(rc->main_subject, subject);
+    rc = recontext_cache_load(rdf, rdf_length, base_uri);
+    if (rc != NULL)
+        return rc;
+
+    rc = recontext_new(base_uri);
+
+    if (recontext_parse_counted_string(rc, rdf, rdf_length, RECONTEXT_FORMAT_RDFXML) != 0) {
+        recontext_destroy(rc);
+        return NULL;
     }
 
+    recontext_cache_save(rc, rdf, rdf_length, base_uri);
     return rc;
 }
 
 recontext*
-recontext_new_from_string(const char *rdf_xml, const char *base_uri)
+recontext_new_from_xmp(const char *packet, const char *base_uri)
 {
-    recontext* rc;
-    librdf_uri *uri;
+    return recontext_new_from_xmp_counted(packet, strlen(packet), base_uri);
+}
 
-    rc = recontext_new(base_uri);
-    uri = librdf_new_uri(rc->world, (const unsigned char *) rc->main_subject);
-    librdf_parser_parse_string_into_model(rc->parser, rdf_xml, uri, rc->model);
+#define XMP_PACKET_HEADER \
+    "<?xpacket begin=\"\xef\xbb\xbf\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>\n" \
+    "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">\n"
+#define XMP_PACKET_FOOTER   "</x:xmpmeta>\n"
+#define XMP_PACKET_TRAILER  "<?xpacket end=\"w\"?>"
 
-    return rc;
+/*
+ * Wrap the RDF/XML serialization into a writable XMP packet, followed by
+ * the given number of bytes of whitespace padding. The padding lets the
+ * packet grow in place later on.
+ */
+char*
+recontext_to_xmp_packet(recontext *rc, size_t padding, size_t *length)
+{
+    GString *packet;
+    char    *rdf;
+    char    *start;
+    size_t   rdf_length;
+    size_t   i;
+
+    rdf = recontext_serialize_fmt(rc, RECONTEXT_FORMAT_RDFXML, &rdf_length);
+    if (rdf == NULL)
+        return NULL;
+
+    // the XML declaration has no place inside a packet
+    start = rdf;
+    if (g_str_has_prefix(rdf, "<?xml")) {
+        char *end = strstr(rdf, "?>");
+
+        if (end != NULL) {
+            start = end + 2;
+            while (*start == '\n' || *start == '\r')
+                start++;
+        }
+    }
+
+    packet = g_string_sized_new(sizeof(XMP_PACKET_HEADER) + rdf_length + padding +
+                                sizeof(XMP_PACKET_FOOTER) + sizeof(XMP_PACKET_TRAILER));
+    g_string_append(packet, XMP_PACKET_HEADER);
+    g_string_append_len(packet, start, rdf_length - (start - rdf));
+    g_string_append(packet, XMP_PACKET_FOOTER);
+
+    // whitespace, broken into lines as other writers do
+    for (i = 0; i < padding; i++)
+        g_string_append_c(packet, i % 100 == 99 ? '\n' : ' ');
+
+    g_string_append(packet, XMP_PACKET_TRAILER);
+    g_free(rdf);
+
+    if (length != NULL)
+        *length = packet->len;
+
+    return g_string_free(packet, FALSE);
+}
+
+/*
+ * Focused parsing keeps only the concise bounded description of the main
+ * subject: its own statements, optionally limited to a predicate
+ * allow-list, plus everything reachable from them through blank nodes.
+ * Statements about other named resources, such as embedded histories,
+ * never reach the model.
+ *
+ * Blank node statements may show up before the statement linking them to
+ * the main subject, so they are held back until they become reachable.
+ * With an allow-list, parsing stops at the first statement about another
+ * named resource once every allowed predicate has been seen; a subject
+ * described again later in the document is not picked up in that case.
+ */
+typedef struct {
+    recontext           *rc;
+    librdf_node         *subject;
+    const char * const  *predicates;
+    gboolean            *seen;
+    guint                n_predicates;
+    guint                n_seen;
+    GHashTable          *reachable;
+    GHashTable          *pending;
+    gboolean             over_budget;
+} recontext_focus;
+
+/* held statements were charged when they were held back */
+static void
+recontext_focus_keep(recontext_focus *focus, librdf_statement *statement, gboolean charged)
+{
+    librdf_node *object = librdf_statement_get_object(statement);
+    const char  *id;
+    GPtrArray   *held;
+    guint        i;
+
+    if (!charged && recontext_charge(focus->rc, statement)) {
+        focus->over_budget = TRUE;
+        return;
+    }
+
+    librdf_model_add_statement(focus->rc->model, statement);
+
+    if (!librdf_node_is_blank(object))
+        return;
+
+    id = (const char *) librdf_node_get_blank_identifier(object);
+    if (g_hash_table_contains(focus->reachable, id))
+        return;
+
+    g_hash_table_add(focus->reachable, g_strdup(id));
+
+    held = g_hash_table_lookup(focus->pending, id);
+    if (held == NULL)
+        return;
+
+    g_hash_table_steal(focus->pending, id);
+    for (i = 0; i < held->len; i++)
+        recontext_focus_keep(focus, g_ptr_array_index(held, i), TRUE);
+    g_ptr_array_free(held, TRUE);
+}
+
+static gboolean
+recontext_focus_allowed(recontext_focus *focus, librdf_node *pred)
+{
+    const char *uri;
+    guint i;
+
+    if (focus->predicates == NULL)
+        return TRUE;
+
+    uri = (const char *) librdf_uri_as_string(librdf_node_get_uri(pred));
+
+    for (i = 0; i < focus->n_predicates; i++) {
+        if (strcmp(uri, focus->predicates[i]) == 0) {
+            if (!focus->seen[i]) {
+                focus->seen[i] = TRUE;
+                focus->n_seen++;
+            }
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* returns FALSE once the rest of the document is not needed */
+static gboolean
+recontext_focus_process(recontext_focus *focus, librdf_statement *statement)
+{
+    librdf_node *subject = librdf_statement_get_subject(statement);
+    const char  *id;
+    GPtrArray   *held;
+
+    if (librdf_node_equals(subject, focus->subject)) {
+        if (recontext_focus_allowed(focus, librdf_statement_get_predicate(statement)))
+            recontext_focus_keep(focus, statement, FALSE);
+        return TRUE;
+    }
+
+    if (!librdf_node_is_blank(subject))
+        return focus->predicates == NULL || focus->n_seen < focus->n_predicates;
+
+    id = (const char *) librdf_node_get_blank_identifier(subject);
+
+    if (g_hash_table_contains(focus->reachable, id)) {
+        recontext_focus_keep(focus, statement, FALSE);
+        return TRUE;
+    }
+
+    // held-back statements take memory too and are charged when held
+    if (recontext_charge(focus->rc, statement)) {
+        focus->over_budget = TRUE;
+        return FALSE;
+    }
+
+    held = g_hash_table_lookup(focus->pending, id);
+    if (held == NULL) {
+        held = g_ptr_array_new_with_free_func((GDestroyNotify) librdf_free_statement);
+        g_hash_table_insert(focus->pending, g_strdup(id), held);
+    }
+    g_ptr_array_add(held, librdf_new_statement_from_statement(statement));
+
+    return TRUE;
 }
 
 recontext*
-recontext_new_from_file(const char *filename, const char *base_uri)
+recontext_new_focused(const char *data, size_t length, const char *base_uri,
+                      recontext_format format, const char * const *predicates)
 {
-    int    error;
-    int    result;
-    char  *contents;
-    gsize  length;
-    recontext *rc;
-    librdf_uri *uri;
+    recontext       *rc;
+    recontext_focus  focus;
+    librdf_parser   *parser;
+    librdf_stream   *stream;
+    const char      *name;
+    FILE            *fh;
+    guint64          start;
+    guint            errors;
+    gboolean         failed;
+
+    if (length == 0)
+        return NULL;
+
+    // reading through a memory stream makes raptor parse in chunks, so
+    // stopping early also saves the parsing of the rest
+    fh = fmemopen((void *) data, length, "r");
+    if (fh == NULL)
+        return NULL;
 
     rc = recontext_new(base_uri);
-    uri = librdf_new_uri(rc->world, (const unsigned char *) rc->main_subject);
-
-    result = g_file_get_contents(filename, &contents, &length, NULL);
-
-    if (result) {
-        error = librdf_parser_parse_counted_string_into_model(rc->parser,
-            (const unsigned char *) contents,
-            length,
-            uri,
-            rc->model);
-        if (error == 0) {
-            return rc;
-        } else {
-            recontext_destroy(rc);
-            return NULL;
+
+    if (format == RECONTEXT_FORMAT_AUTO)
+        format = recontext_guess_format(rc->ctx, data, length, NULL);
+    name = recontext_formats[format].parser;
+
+    memset(&focus, 0, sizeof(focus));
+    focus.rc = rc;
+    focus.subject = librdf_new_node_from_uri(rc->world, rc->priv->base_uri);
+    focus.predicates = predicates;
+    if (predicates != NULL) {
+        while (predicates[focus.n_predicates] != NULL)
+            focus.n_predicates++;
+        focus.seen = g_new0(gboolean, focus.n_predicates);
+    }
+    focus.reachable = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    focus.pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify) g_ptr_array_unref);
+
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_PARSE);
+    errors = rc->ctx->errors;
+    parser = recontext_ctx_acquire_parser(rc->ctx, name);
+    stream = parser ? librdf_parser_parse_file_handle_as_stream(parser, fh, 0,
+                                                                rc->priv->base_uri) : NULL;
+
+    if (stream != NULL) {
+        while (!librdf_stream_end(stream)) {
+            if (!recontext_focus_process(&focus, librdf_stream_get_object(stream)) ||
+                focus.over_budget)
+                break;
+            librdf_stream_next(stream);
         }
+        librdf_free_stream(stream);
+    }
+
+    // an early stop leaves the rest unparsed, errors up to there count
+    failed = stream == NULL || focus.over_budget || rc->ctx->errors != errors;
+
+    recontext_ctx_release_parser(rc->ctx, name, parser);
+    // bytes actually consumed, which is less than length after an early stop
+    RECONTEXT_OP_END(RECONTEXT_OP_PARSE, start, recontext_model_size(rc->model),
+                     MAX(ftell(fh), 0));
+    fclose(fh);
+
+    g_hash_table_destroy(focus.pending);
+    g_hash_table_destroy(focus.reachable);
+    g_free(focus.seen);
+    librdf_free_node(focus.subject);
+
+    if (failed) {
+        recontext_destroy(rc);
+        return NULL;
     }
+
+    recontext_changed(rc, NULL);
+    return rc;
 }
 
 recontext*
-recontext_extract(recontext* rc, char* subject, int remove)
+recontext_new_from_xmp_focused(const char *packet, size_t length, const char *base_uri,
+                               const char * const *predicates)
+{
+    const char    *rdf;
+    size_t         rdf_length;
+
+    if (!recontext_xmp_find_rdf(packet, length, &rdf, &rdf_length))
+        return NULL;
+
+    return recontext_new_focused(rdf, rdf_length, base_uri, RECONTEXT_FORMAT_RDFXML, predicates);
+}
+
+/*
+ * Serialization runs directly on the live model and streams its output
+ * through a raptor iostream, so nothing is copied or buffered unless the
+ * caller asks for a string. Strings are kept per format until the next
+ * change and also serve the streaming calls while they are current.
+ */
+typedef struct {
+    recontext_write_func  func;
+    void                 *user_data;
+    size_t                length;
+    int                   error;
+} recontext_sink;
+
+static int
+recontext_sink_write_bytes(void *context, const void *ptr, size_t size, size_t nmemb)
+{
+    recontext_sink *sink = context;
+    size_t length = size * nmemb;
+
+    if (sink->error)
+        return 0;
+
+    if (sink->func != NULL && length > 0 && sink->func(sink->user_data, ptr, length) != 0) {
+        sink->error = 1;
+        return 0;
+    }
+
+    sink->length += length;
+    return (int) nmemb;
+}
+
+static int
+recontext_sink_write_byte(void *context, const int byte)
+{
+    unsigned char c = (unsigned char) byte;
+
+    return recontext_sink_write_bytes(context, &c, 1, 1) == 1 ? 0 : 1;
+}
+
+gboolean
+recontext_cache_valid(recontext *rc, recontext_format format)
+{
+    return rc->priv->cache[format] != NULL &&
+           rc->priv->cache_generation[format] == rc->priv->generation;
+}
+
+static const raptor_iostream_handler recontext_sink_handler = {
+    2,                              /* version */
+    NULL,                           /* init */
+    NULL,                           /* finish */
+    recontext_sink_write_byte,
+    recontext_sink_write_bytes,
+    NULL,                           /* write_end */
+    NULL,                           /* read_bytes */
+    NULL                            /* read_eof */
+};
+
+int
+recontext_serialize_to_callback_fmt(recontext *rc, recontext_format format,
+                                    recontext_write_func func, void *user_data, size_t *length)
+{
+    recontext_sink     sink = { func, user_data, 0, 0 };
+    raptor_iostream   *iostream;
+    librdf_serializer *serializer;
+    const char        *name;
+    guint64            start;
+    int                error;
+
+    if (format == RECONTEXT_FORMAT_AUTO)
+        format = RECONTEXT_FORMAT_RDFXML;
+    name = recontext_formats[format].serializer;
+
+    if (recontext_cache_valid(rc, format)) {
+        start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_SERIALIZE);
+        recontext_sink_write_bytes(&sink, rc->priv->cache[format], 1,
+                                   rc->priv->cache_length[format]);
+        RECONTEXT_OP_END(RECONTEXT_OP_SERIALIZE, start, 0, sink.length);
+
+        if (length != NULL)
+            *length = sink.length;
+        return sink.error;
+    }
+
+    serializer = recontext_ctx_acquire_serializer(rc->ctx, name);
+    if (serializer == NULL)
+        return 1;
+
+    iostream = raptor_new_iostream_from_handler(librdf_world_get_raptor(rc->world),
+                                                &sink, &recontext_sink_handler);
+    if (iostream == NULL) {
+        recontext_ctx_release_serializer(rc->ctx, name, serializer);
+        return 1;
+    }
+
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_SERIALIZE);
+    error = librdf_serializer_serialize_model_to_iostream(serializer, rc->priv->base_uri,
+                                                          rc->model, iostream);
+
+    raptor_free_iostream(iostream);
+    RECONTEXT_OP_END(RECONTEXT_OP_SERIALIZE, start, recontext_model_size(rc->model),
+                     sink.length);
+    recontext_ctx_release_serializer(rc->ctx, name, serializer);
+
+    if (length != NULL)
+        *length = sink.length;
+
+    return error || sink.error;
+}
+
+static int
+recontext_write_fd(void *user_data, const void *data, size_t length)
+{
+    int fd = *(int *) user_data;
+    const char *p = data;
+
+    while (length > 0) {
+        ssize_t written = write(fd, p, length);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+
+        p += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+int
+recontext_serialize_to_callback(recontext *rc, recontext_write_func func, void *user_data,
+                                size_t *length)
+{
+    return recontext_serialize_to_callback_fmt(rc, RECONTEXT_FORMAT_RDFXML,
+                                               func, user_data, length);
+}
+
+int
+recontext_serialize_to_fd(recontext *rc, int fd, size_t *length)
+{
+    return recontext_serialize_to_callback(rc, recontext_write_fd, &fd, length);
+}
+
+static int
+recontext_write_file_handle(void *user_data, const void *data, size_t length)
+{
+    return fwrite(data, 1, length, user_data) != length;
+}
+
+int
+recontext_serialize_to_file_handle(recontext *rc, FILE *fh, size_t *length)
+{
+    return recontext_serialize_to_callback(rc, recontext_write_file_handle, fh, length);
+}
+
+static int
+recontext_write_string(void *user_data, const void *data, size_t length)
+{
+    g_string_append_len(user_data, data, length);
+    return 0;
+}
+
+/* serialize into the cache unless it is current */
+static int
+recontext_cache_fill(recontext *rc, recontext_format format)
+{
+    recontext_priv *priv = rc->priv;
+    GString *buffer;
+
+    if (recontext_cache_valid(rc, format))
+        return 0;
+
+    buffer = g_string_sized_new(4096);
+
+    if (recontext_serialize_to_callback_fmt(rc, format, recontext_write_string,
+                                            buffer, NULL) != 0) {
+        g_string_free(buffer, TRUE);
+        return 1;
+    }
+
+    g_free(priv->cache[format]);
+    priv->cache_length[format] = buffer->len;
+    priv->cache_generation[format] = priv->generation;
+    priv->cache[format] = g_string_free(buffer, FALSE);
+
+    return 0;
+}
+
+/* the output is kept, so a serialize call that follows comes for free */
+size_t
+recontext_serialize_size(recontext *rc)
+{
+    if (recontext_cache_fill(rc, RECONTEXT_FORMAT_RDFXML) != 0)
+        return 0;
+
+    return rc->priv->cache_length[RECONTEXT_FORMAT_RDFXML];
+}
+
+char*
+recontext_serialize_fmt(recontext *rc, recontext_format format, size_t *length)
+{
+    recontext_priv *priv = rc->priv;
+    char *data;
+
+    if (format == RECONTEXT_FORMAT_AUTO)
+        format = RECONTEXT_FORMAT_RDFXML;
+
+    if (recontext_cache_fill(rc, format) != 0)
+        return NULL;
+
+    if (length != NULL)
+        *length = priv->cache_length[format];
+
+    // the copy keeps the cache intact whatever the caller does with it
+    data = g_malloc(priv->cache_length[format] + 1);
+    memcpy(data, priv->cache[format], priv->cache_length[format] + 1);
+    return data;
+}
+
+char*
+recontext_serialize_counted(recontext *rc, size_t *length)
+{
+    return recontext_serialize_fmt(rc, RECONTEXT_FORMAT_RDFXML, length);
+}
+
+char*
+recontext_serialize(recontext *rc)
+{
+    return recontext_serialize_fmt(rc, RECONTEXT_FORMAT_RDFXML, NULL);
+}
+
+void
+recontext_add_value(GPtrArray *values, librdf_node *node)
+{
+    if (librdf_node_is_literal(node))
+        g_ptr_array_add(values, g_strdup((const gchar *) librdf_node_get_literal_value(node)));
+    else if (librdf_node_is_resource(node))
+        g_ptr_array_add(values, g_strdup((const gchar *) librdf_uri_as_string(librdf_node_get_uri(node))));
+}
+
+static gint
+recontext_compare_members(gconstpointer a, gconstpointer b)
+{
+    librdf_statement *sa = *(librdf_statement * const *) a;
+    librdf_statement *sb = *(librdf_statement * const *) b;
+
+    return librdf_node_get_li_ordinal(librdf_statement_get_predicate(sa)) -
+           librdf_node_get_li_ordinal(librdf_statement_get_predicate(sb));
+}
+
+/*
+ * Resolve an rdf:Alt, rdf:Seq or rdf:Bag container with a single lookup
+ * of its arcs, adding copies of the member nodes in rdf:_N order. Alt
+ * contributes its first member only, unless every alternative is asked
+ * for.
+ */
+void
+recontext_add_container_members(recontext *rc, librdf_node *container, gboolean alternatives,
+                                GPtrArray *nodes)
 {
-    recontext        *new;
     librdf_statement *query_statement;
     librdf_stream    *stream;
+    GPtrArray        *members;
+    const char       *type = NULL;
+    guint             i;
 
-    new = recontext_new(subject);
+    members = g_ptr_array_new_with_free_func((GDestroyNotify) librdf_free_statement);
 
     query_statement = librdf_new_statement_from_nodes(rc->world,
-        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) subject), NULL, NULL);
-
+        librdf_new_node_from_node(container), NULL, NULL);
     stream = librdf_model_find_statements(rc->model, query_statement);
 
     while (!librdf_stream_end(stream)) {
         librdf_statement *statement = librdf_stream_get_object(stream);
+        librdf_node *pred = librdf_statement_get_predicate(statement);
+        librdf_node *object = librdf_statement_get_object(statement);
+        const char *pred_uri = (const char *) librdf_uri_as_string(librdf_node_get_uri(pred));
 
-        librdf_model_add_statement(new->model, statement);
-        if (remove) {
-            librdf_model_remove_statement(rc->model, statement);
+        if (strcmp(pred_uri, RDF_NS "type") == 0) {
+            if (librdf_node_is_resource(object)) {
+                const char *type_uri = (const char *) librdf_uri_as_string(librdf_node_get_uri(object));
+                if (strcmp(type_uri, RDF_NS "Alt") == 0 ||
+                    strcmp(type_uri, RDF_NS "Seq") == 0 ||
+                    strcmp(type_uri, RDF_NS "Bag") == 0)
+                    type = type_uri + strlen(RDF_NS);
+            }
+        } else if (librdf_node_get_li_ordinal(pred) > 0 &&
+                   (librdf_node_is_literal(object) || librdf_node_is_resource(object))) {
+            g_ptr_array_add(members, librdf_new_statement_from_statement(statement));
         }
 
         librdf_stream_next(stream);
@@ -115,124 +1990,185 @@ recontext_extract(recontext* rc, char* subject, int remove)
 
     librdf_free_stream(stream);
     librdf_free_statement(query_statement);
-    return new;
+
+    if (type != NULL) {
+        g_ptr_array_sort(members, recontext_compare_members);
+
+        for (i = 0; i < members->len; i++) {
+            librdf_statement *member = g_ptr_array_index(members, i);
+
+            if (type[0] == 'A' && !alternatives &&
+                librdf_node_get_li_ordinal(librdf_statement_get_predicate(member)) != 1)
+                continue;
+
+            g_ptr_array_add(nodes, librdf_new_node_from_node(librdf_statement_get_object(member)));
+        }
+    }
+
+    g_ptr_array_free(members, TRUE);
 }
 
 void
-recontext_merge(recontext* rc, recontext *other, const char *relation)
+recontext_add_container_values(recontext *rc, librdf_node *container, GPtrArray *values)
 {
-    librdf_stream *stream;
-    const char *real_relation;
+    GPtrArray *nodes;
+    guint      i;
 
-    stream = librdf_model_as_stream(other->model);
-    librdf_model_add_statements(rc->model, stream);
-    librdf_free_stream(stream);
+    nodes = g_ptr_array_new_with_free_func((GDestroyNotify) librdf_free_node);
+    recontext_add_container_members(rc, container, FALSE, nodes);
 
-    if (relation == NULL) {
-        real_relation = "http://purl.org/dc/elements/1.1/source";
-    } else {
-        real_relation = strdup(relation);
+    for (i = 0; i < nodes->len; i++)
+        recontext_add_value(values, g_ptr_array_index(nodes, i));
+
+    g_ptr_array_free(nodes, TRUE);
+}
+
+char**
+recontext_get_values(recontext *rc, const char *subject, const char * const *predicates)
+{
+    GPtrArray *values;
+    int        i;
+
+    values = g_ptr_array_new();
+
+    for (i = 0; predicates[i] != NULL; i++) {
+        librdf_statement *query_statement;
+        librdf_stream    *stream;
+
+        query_statement = librdf_new_statement_from_nodes(rc->world,
+            subject ? librdf_new_node_from_uri_string(rc->world, (const unsigned char *) subject) : NULL,
+            librdf_new_node_from_uri_string(rc->world, (const unsigned char *) predicates[i]),
+            NULL);
+        stream = librdf_model_find_statements(rc->model, query_statement);
+
+        while (!librdf_stream_end(stream)) {
+            librdf_node *object = librdf_statement_get_object(librdf_stream_get_object(stream));
+
+            if (librdf_node_is_blank(object))
+                recontext_add_container_values(rc, object, values);
+            else
+                recontext_add_value(values, object);
+
+            librdf_stream_next(stream);
+        }
+
+        librdf_free_stream(stream);
+        librdf_free_statement(query_statement);
     }
 
-    librdf_model_add (rc->model,
-        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) rc->main_subject),
-        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) real_relation),
-        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) other->main_subject));
+    g_ptr_array_add(values, NULL);
+    return (char **) g_ptr_array_free(values, FALSE);
 }
 
-recontext*
-recontext_new_from_xmp(const char *packet, const char *base_uri)
+/* the SPARQL text behind recontext_query_values() */
+static gchar*
+recontext_values_query_text(const char *subject, const char * const *predicates)
 {
-    recontext     *rc;
-    char          *rdf_start;
-    char          *rdf_end;
-    char          *rdf;
-    int            result;
-    librdf_uri    *uri;
+    GString *query_string;
+    GString *pred_filter;
+    gchar   *subject_term;
+    int      i;
 
-    rdf_start = g_strstr_len(packet, -1, "<rdf:RDF");
-    rdf_end = g_strrstr(packet, "</rdf:RDF>") + 10;
+    subject_term = subject ? g_strdup_printf("<%s>", subject) : g_strdup("?subject");
 
-    rdf = g_strndup(rdf_start, rdf_end - rdf_start);
+    pred_filter = g_string_new("FILTER(");
+    for (i = 0; predicates[i] != NULL; i++)
+        g_string_append_printf(pred_filter, "%s?pred = <%s>", i ? " || " : "", predicates[i]);
+    g_string_append(pred_filter, i ? ")" : "false)");
 
-    rc = recontext_new_from_string(rdf, base_uri);
+    query_string = g_string_new("PREFIX rdf: <" RDF_NS ">\n");
+    g_string_append_printf(query_string,
+        "SELECT ?label WHERE {\n"
+        "    {\n"
+        "        %1$s ?pred ?label .\n"
+        "        %2$s\n"
+        "        FILTER(isLiteral(?label) || isURI(?label))\n"
+        "    }\n"
+        "    UNION\n"
+        "    {\n"
+        "        %1$s ?pred ?node .\n"
+        "        %2$s\n"
+        "        FILTER(isBlank(?node))\n"
+        "        ?node a rdf:Alt .\n"
+        "        ?node rdf:_1 ?label .\n"
+        "        FILTER(isLiteral(?label) || isURI(?label))\n"
+        "    }\n"
+        "    UNION\n"
+        "    {\n"
+        "        %1$s ?pred ?node .\n"
+        "        %2$s\n"
+        "        FILTER(isBlank(?node))\n"
+        "        ?node a ?container .\n"
+        "        FILTER(?container = rdf:Seq || ?container = rdf:Bag)\n"
+        "        ?node ?member ?label .\n"
+        "        FILTER(regex(str(?member), \"^" RDF_NS "_[0-9]+$\"))\n"
+        "        FILTER(isLiteral(?label) || isURI(?label))\n"
+        "    }\n"
+        "}\n",
+        subject_term, pred_filter->str);
 
-    free(rdf);
-    return rc;
+    g_string_free(pred_filter, TRUE);
+    g_free(subject_term);
+
+    return g_string_free(query_string, FALSE);
 }
 
-char*
-recontext_serialize(recontext *rc)
+/*
+ * Reference implementation of recontext_get_values() on top of the SPARQL
+ * engine. Compiled queries are cached under the subject and predicate
+ * list, the query text is only generated for a new combination;
+ * container members come back in no particular order.
+ */
+char**
+recontext_query_values(recontext *rc, const char *subject, const char * const *predicates)
 {
-    librdf_uri *uri_dc;
-    librdf_uri *uri_dcterms;
-    librdf_uri *uri_cc;
-    librdf_uri *uri_xhv;
-    librdf_uri *uri_og;
-    librdf_uri *feature_uri;
-    librdf_uri *base_uri;
-    librdf_node *feature_node;
+    GString              *name;
+    librdf_query         *query;
+    librdf_query_results *results;
+    GPtrArray            *values;
+    guint64               start;
+    int                   i;
 
-    librdf_model *serialize_model;
-    librdf_storage *serialize_storage;
-    librdf_stream *orig_stream;
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_QUERY);
+    values = g_ptr_array_new();
 
-    librdf_serializer *serializer;
-    unsigned char *result;
-
-    uri_dc = librdf_new_uri(rc->world,
-        (const unsigned char *) "http://purl.org/dc/elements/1.1/");
-    uri_dcterms = librdf_new_uri(rc->world,
-        (const unsigned char *) "http://purl.org/dc/terms/");
-    uri_cc = librdf_new_uri(rc->world,
-        (const unsigned char *) "http://creativecommons.org/ns#");
-    uri_xhv = librdf_new_uri(rc->world,
-        (const unsigned char *) "http://www.w3.org/1999/xhtml/vocab#");
-    uri_og = librdf_new_uri(rc->world,
-        (const unsigned char *) "http://ogp.me/ns#");
-
-    // copy the original model
-    serialize_storage = librdf_new_storage(rc->world, "memory", NULL, NULL);
-    serialize_model = librdf_new_model(rc->world, serialize_storage, NULL);
-
-    orig_stream = librdf_model_as_stream(rc->model);
-    librdf_model_add_statements(serialize_model, orig_stream);
-    librdf_free_stream(orig_stream);
-
-    base_uri = librdf_new_uri(rc->world, (const unsigned char *) rc->main_subject);
-
-    serializer = librdf_new_serializer(rc->world, "rdfxml-abbrev", NULL, NULL);
-
-    librdf_serializer_set_feature(serializer,
-        feature_uri = librdf_new_uri(rc->world, (const unsigned char *) "http://feature.librdf.org/raptor-relativeURIs"),
-        feature_node = librdf_new_node_from_literal(rc->world, (const unsigned char *) "1", NULL, 0));
-    librdf_free_uri(feature_uri);
-    librdf_free_node(feature_node);
+    name = g_string_new("values ");
+    if (subject != NULL)
+        g_string_append(name, subject);
+    for (i = 0; predicates[i] != NULL; i++) {
+        g_string_append_c(name, '\n');
+        g_string_append(name, predicates[i]);
+    }
 
-    librdf_serializer_set_feature(serializer,
-        feature_uri = librdf_new_uri(rc->world, (const unsigned char *) "http://feature.librdf.org/raptor-writeBaseURI"),
-        feature_node = librdf_new_node_from_literal(rc->world, (const unsigned char *) "0", NULL, 0));
-    librdf_free_uri(feature_uri);
-    librdf_free_node(feature_node);
+    query = recontext_ctx_lookup_query(rc->ctx, name->str);
+    if (query == NULL) {
+        gchar *query_string = recontext_values_query_text(subject, predicates);
+
+        query = recontext_ctx_add_query(rc->ctx, name->str, query_string);
+        g_free(query_string);
+    }
+
+    results = query ? librdf_model_query_execute(rc->model, query) : NULL;
 
-    librdf_serializer_set_namespace(serializer, uri_dc, "dc");
-    librdf_serializer_set_namespace(serializer, uri_dcterms, "dcterms");
-    librdf_serializer_set_namespace(serializer, uri_cc, "cc");
-    librdf_serializer_set_namespace(serializer, uri_xhv, "xhv");
-    librdf_serializer_set_namespace(serializer, uri_og, "og");
+    while (results != NULL && !librdf_query_results_finished(results)) {
+        librdf_node *node = librdf_query_results_get_binding_value_by_name(results, "label");
 
-    result = librdf_serializer_serialize_model_to_string(serializer, base_uri, serialize_model);
+        if (node != NULL) {
+            recontext_add_value(values, node);
+            librdf_free_node(node);
+        }
+
+        librdf_query_results_next(results);
+    }
+
+    if (results != NULL)
+        librdf_free_query_results(results);
 
-    librdf_free_model(serialize_model);
-    librdf_free_serializer(serializer);
-    librdf_free_uri(base_uri);
-    librdf_free_uri(uri_dc);
-    librdf_free_uri(uri_dcterms);
-    librdf_free_uri(uri_cc);
-    librdf_free_uri(uri_xhv);
-    librdf_free_uri(uri_og);
+    g_string_free(name, TRUE);
 
-    return (char *) result;
+    RECONTEXT_OP_END(RECONTEXT_OP_QUERY, start, values->len, 0);
+    g_ptr_array_add(values, NULL);
+    return (char **) g_ptr_array_free(values, FALSE);
 }
 
 const char*
@@ -243,5 +2179,17 @@ recontext_get_main_subject (recontext *rc)
 
 void recontext_destroy(recontext *rc)
 {
-    librdf_free_world(rc->world);
-}
\ No newline at end of file
+    int i;
+
+    for (i = 0; i < (int) G_N_ELEMENTS(rc->priv->cache); i++)
+        g_free(rc->priv->cache[i]);
+    g_hash_table_destroy(rc->priv->changed);
+
+    librdf_free_model(rc->model);
+    librdf_free_storage(rc->storage);
+    librdf_free_uri(rc->priv->base_uri);
+    g_string_chunk_free(rc->priv->strings);
+
+    recontext_ctx_unref(rc->ctx);
+    g_free(rc);
+}
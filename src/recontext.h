@@ -10,28 +10,189 @@
 #ifndef __RECONTEXT_H__
 #define __RECONTEXT_H__
 
+#include <stdint.h>
+#include <stdio.h>
 #include <redland.h>
 
+typedef struct recontext_ctx_s recontext_ctx;
+typedef struct recontext_priv_s recontext_priv;
+
 struct recontext_s {
+    recontext_ctx   *ctx;
     librdf_world    *world;
     librdf_storage  *storage;
     librdf_model    *model;
-    librdf_parser   *parser;
 
     char *main_subject;
+
+    recontext_priv  *priv;
 };
 
 typedef struct recontext_s recontext;
 
+typedef enum {
+    RECONTEXT_FORMAT_AUTO,
+    RECONTEXT_FORMAT_RDFXML,
+    RECONTEXT_FORMAT_NTRIPLES,
+    RECONTEXT_FORMAT_TURTLE
+} recontext_format;
+
+typedef enum {
+    RECONTEXT_STORAGE_DEFAULT,
+    RECONTEXT_STORAGE_MEMORY,   /* unindexed, cheapest for small graphs */
+    RECONTEXT_STORAGE_INDEXED,  /* indexed lookups for large graphs */
+    RECONTEXT_STORAGE_COMPACT   /* interned terms and packed triples, for per-asset graphs */
+} recontext_storage;
+
+/* output callback for streaming serialization, return non-zero to abort */
+typedef int (*recontext_write_func)(void *user_data, const void *data, size_t length);
+
+typedef enum {
+    RECONTEXT_OP_WORLD,         /* setting up the world of a thread */
+    RECONTEXT_OP_PARSE,
+    RECONTEXT_OP_EXTRACT,
+    RECONTEXT_OP_MERGE,
+    RECONTEXT_OP_QUERY,
+    RECONTEXT_OP_WRITE_EXIV2,
+    RECONTEXT_OP_SERIALIZE,
+    RECONTEXT_OP_COUNT
+} recontext_op;
+
+typedef struct {
+    uint64_t    calls;
+    uint64_t    total_ns;
+    uint64_t    max_ns;
+    uint64_t    statements;     /* statements parsed, copied, scanned or written */
+    uint64_t    bytes;          /* bytes parsed or emitted */
+} recontext_op_stats;
+
+typedef struct {
+    recontext_op_stats  ops[RECONTEXT_OP_COUNT];
+} recontext_stats;
+
+/* called with begin set before and unset after each operation */
+typedef void (*recontext_trace_func)(recontext_op op, int begin, void *user_data);
+
+void            recontext_init(void);
+void            recontext_cleanup(void);
+void            recontext_set_default_storage(recontext_storage storage);
+
+/*
+ * Memory budget in bytes for the statements parsed or merged into a
+ * recontext, 0 for none. Parsing past the budget makes the constructor
+ * return NULL and recontext_merge() fail without changing anything.
+ */
+void            recontext_set_default_budget(size_t bytes);
+void            recontext_set_budget(recontext *rc, size_t bytes);
+size_t          recontext_get_usage(recontext *rc);
+
+/*
+ * Optional cache of parsed XMP packets in directory, for packets parsed
+ * with a base URI. Size limits are in bytes for the files on disk and
+ * the entries kept in memory.
+ */
+int             recontext_cache_open(const char *directory, size_t disk_bytes,
+                                     size_t memory_bytes);
+void            recontext_cache_close(void);
+
+/*
+ * Instrumentation, off by default. Stats are kept per thread; work that
+ * batch and async calls run on worker threads is counted in the thread
+ * that collects its result.
+ */
+void            recontext_set_stats_enabled(int enabled);
+void            recontext_get_stats(recontext_stats *stats);
+void            recontext_reset_stats(void);
+void            recontext_set_trace_func(recontext_trace_func func, void *user_data);
+const char*     recontext_op_name(recontext_op op);
+
 recontext*      recontext_new(const char *subject);
+recontext*      recontext_new_with_storage(const char *subject, recontext_storage storage);
 recontext*      recontext_new_from_string(const char *rdf_xml, const char *uri_str);
+recontext*      recontext_new_from_string_fmt(const char *data, const char *uri_str,
+                                              recontext_format format);
 recontext*      recontext_new_from_file(const char *filename, const char *uri_str);
 recontext*      recontext_new_from_xmp(const char *packet, const char *base_uri);
+recontext*      recontext_new_from_xmp_counted(const char *packet, size_t length,
+                                               const char *base_uri);
+
+/* parse only what is reachable from the main subject, see recontext.c */
+recontext*      recontext_new_focused(const char *data, size_t length, const char *base_uri,
+                                      recontext_format format, const char * const *predicates);
+recontext*      recontext_new_from_xmp_focused(const char *packet, size_t length,
+                                               const char *base_uri,
+                                               const char * const *predicates);
 
 recontext*      recontext_extract(recontext* rc, char* subject, int remove);
-void            recontext_merge(recontext *rc, recontext* other, const char *relation);
+int             recontext_merge(recontext *rc, recontext* other, const char *relation);
+
+/*
+ * With RECONTEXT_MERGE_DEDUP, statements already in rc are not added
+ * again, and blank nodes of other that describe the same thing as one in
+ * rc (equal statements all the way down) are mapped onto it.
+ */
+#define RECONTEXT_MERGE_DEDUP   (1 << 0)
+
+int             recontext_merge_with_flags(recontext *rc, recontext *other, const char *relation,
+                                           int flags);
+
+/*
+ * Drop the description of sources more than max_depth dc:source,
+ * dcterms:source or prov:wasDerivedFrom links away from the main subject,
+ * -1 for no limit. If the graph still holds more than max_statements,
+ * the depth is cut further; the main subject and its links to its direct
+ * sources are always kept. Returns the number of statements removed.
+ */
+size_t          recontext_compact(recontext *rc, int max_depth, size_t max_statements);
+
+/*
+ * Compare graphs regardless of statement order and blank node labels.
+ * recontext_hash() returns a hex digest, free it with g_free(). Blank
+ * nodes are told apart by their surroundings only, so blank structures
+ * that look alike from every node, such as two rings of different
+ * sizes, may compare equal.
+ *
+ * recontext_diff() returns the number of statements in to but not in
+ * from and the other way round. Unless NULL, added and removed receive
+ * new recontexts holding those statements.
+ */
+char*           recontext_hash(recontext *rc);
+size_t          recontext_diff(recontext *from, recontext *to, recontext **added,
+                               recontext **removed);
+
+/*
+ * Every change made through the library bumps the generation of a
+ * recontext, and cached output is reused until it moves on. Code that
+ * changes rc->model directly must report it with recontext_touch(),
+ * naming the predicate it changed or NULL for any.
+ */
+uint64_t        recontext_get_generation(recontext *rc);
+void            recontext_touch(recontext *rc, const char *predicate);
+
+/* add a statement, taking ownership of the nodes like librdf_model_add() */
+int             recontext_add(recontext *rc, librdf_node *subject, librdf_node *predicate,
+                              librdf_node *object);
+
+/* NULL-terminated value lists, free with g_strfreev() */
+char**          recontext_get_values(recontext *rc, const char *subject,
+                                     const char * const *predicates);
+char**          recontext_query_values(recontext *rc, const char *subject,
+                                       const char * const *predicates);
 
 char*           recontext_serialize(recontext *rc);
+char*           recontext_serialize_counted(recontext *rc, size_t *length);
+char*           recontext_serialize_fmt(recontext *rc, recontext_format format, size_t *length);
+int             recontext_serialize_to_callback(recontext *rc, recontext_write_func func,
+                                                void *user_data, size_t *length);
+int             recontext_serialize_to_callback_fmt(recontext *rc, recontext_format format,
+                                                    recontext_write_func func, void *user_data,
+                                                    size_t *length);
+int             recontext_serialize_to_fd(recontext *rc, int fd, size_t *length);
+int             recontext_serialize_to_file_handle(recontext *rc, FILE *fh, size_t *length);
+size_t          recontext_serialize_size(recontext *rc);
+
+/* a complete <?xpacket?> with padding bytes of whitespace before the trailer */
+char*           recontext_to_xmp_packet(recontext *rc, size_t padding, size_t *length);
 const char*     recontext_get_main_subject (recontext *rc);
 
 void            recontext_destroy(recontext *rc);
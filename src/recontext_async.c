@@ -0,0 +1,356 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "recontext.h"
+#include "recontext_async.h"
+#include "recontext_gexiv2.h"
+#include "recontext_media.h"
+#include "recontext_private.h"
+
+typedef enum {
+    RECONTEXT_ASYNC_STRING,
+    RECONTEXT_ASYNC_FILE,
+    RECONTEXT_ASYNC_XMP,
+    RECONTEXT_ASYNC_MEDIA_FILE
+} recontext_async_source;
+
+typedef struct {
+    recontext_async_source  source;
+    char                   *data;       /* string, packet or file name */
+    size_t                  length;
+    char                   *base_uri;
+    recontext_format        format;
+    recontext_stats         stats;      /* counted by the worker */
+} recontext_async_parse;
+
+typedef struct {
+    recontext              *rc;
+    recontext_format        format;
+    GExiv2Metadata         *metadata;
+    recontext_stats         stats;
+} recontext_async_op;
+
+static void
+recontext_async_parse_free(recontext_async_parse *parse)
+{
+    g_free(parse->data);
+    g_free(parse->base_uri);
+    g_free(parse);
+}
+
+static void
+recontext_async_op_free(recontext_async_op *op)
+{
+    if (op->rc != NULL)
+        recontext_destroy(op->rc);
+    if (op->metadata != NULL)
+        g_object_unref(op->metadata);
+    g_free(op);
+}
+
+/*
+ * The recontext is built inside a private context, which it then holds
+ * on its own once the job lets go of it. Files that cannot be opened are
+ * reported with the matching G_IO_ERROR code, everything else that fails
+ * as G_IO_ERROR_INVALID_DATA.
+ */
+static void
+recontext_async_parse_thread(GTask *task, gpointer source_object, gpointer task_data,
+                             GCancellable *cancellable)
+{
+    recontext_async_parse *parse = task_data;
+    recontext_stats saved;
+    recontext_ctx *ctx;
+    recontext *rc = NULL;
+
+    if (g_task_return_error_if_cancelled(task))
+        return;
+
+    if ((parse->source == RECONTEXT_ASYNC_FILE || parse->source == RECONTEXT_ASYNC_MEDIA_FILE) &&
+        g_access(parse->data, R_OK) != 0) {
+        int saved_errno = errno;
+
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                                "Could not open %s: %s", parse->data, g_strerror(saved_errno));
+        return;
+    }
+
+    recontext_stats_begin_job(&saved);
+    ctx = recontext_ctx_new_private();
+    recontext_ctx_enter(ctx);
+
+    switch (parse->source) {
+    case RECONTEXT_ASYNC_STRING:
+        rc = recontext_new_from_string_fmt(parse->data, parse->base_uri, parse->format);
+        break;
+    case RECONTEXT_ASYNC_FILE:
+        rc = recontext_new_from_file(parse->data, parse->base_uri);
+        break;
+    case RECONTEXT_ASYNC_XMP:
+        rc = recontext_new_from_xmp_counted(parse->data, parse->length, parse->base_uri);
+        break;
+    case RECONTEXT_ASYNC_MEDIA_FILE:
+        rc = recontext_new_from_media_file(parse->data, parse->base_uri);
+        break;
+    }
+
+    recontext_ctx_enter(NULL);
+    recontext_ctx_unref(ctx);
+    recontext_stats_end_job(&saved, &parse->stats);
+
+    if (rc == NULL)
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Could not read metadata");
+    else
+        g_task_return_pointer(task, rc, (GDestroyNotify) recontext_destroy);
+}
+
+static void
+recontext_async_parse_start(recontext_async_parse *parse, GCancellable *cancellable,
+                            GAsyncReadyCallback callback, gpointer user_data)
+{
+    GTask *task;
+
+    task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_task_data(task, parse, (GDestroyNotify) recontext_async_parse_free);
+
+    // a cancelled parse reports back at once, its result is dropped later
+    g_task_set_return_on_cancel(task, TRUE);
+    g_task_run_in_thread(task, recontext_async_parse_thread);
+    g_object_unref(task);
+}
+
+void
+recontext_new_from_string_async(const char *data, const char *base_uri, recontext_format format,
+                                GCancellable *cancellable, GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+    recontext_async_parse *parse = g_new0(recontext_async_parse, 1);
+
+    parse->source = RECONTEXT_ASYNC_STRING;
+    parse->data = g_strdup(data);
+    parse->base_uri = g_strdup(base_uri);
+    parse->format = format;
+
+    recontext_async_parse_start(parse, cancellable, callback, user_data);
+}
+
+void
+recontext_new_from_file_async(const char *filename, const char *base_uri,
+                              GCancellable *cancellable, GAsyncReadyCallback callback,
+                              gpointer user_data)
+{
+    recontext_async_parse *parse = g_new0(recontext_async_parse, 1);
+
+    parse->source = RECONTEXT_ASYNC_FILE;
+    parse->data = g_strdup(filename);
+    parse->base_uri = g_strdup(base_uri);
+
+    recontext_async_parse_start(parse, cancellable, callback, user_data);
+}
+
+void
+recontext_new_from_xmp_async(const char *packet, size_t length, const char *base_uri,
+                             GCancellable *cancellable, GAsyncReadyCallback callback,
+                             gpointer user_data)
+{
+    recontext_async_parse *parse = g_new0(recontext_async_parse, 1);
+
+    parse->source = RECONTEXT_ASYNC_XMP;
+    parse->data = g_malloc(length + 1);
+    memcpy(parse->data, packet, length);
+    parse->data[length] = '\0';
+    parse->length = length;
+    parse->base_uri = g_strdup(base_uri);
+
+    recontext_async_parse_start(parse, cancellable, callback, user_data);
+}
+
+void
+recontext_new_from_media_file_async(const char *filename, const char *base_uri,
+                                    GCancellable *cancellable, GAsyncReadyCallback callback,
+                                    gpointer user_data)
+{
+    recontext_async_parse *parse = g_new0(recontext_async_parse, 1);
+
+    parse->source = RECONTEXT_ASYNC_MEDIA_FILE;
+    parse->data = g_strdup(filename);
+    parse->base_uri = g_strdup(base_uri);
+
+    recontext_async_parse_start(parse, cancellable, callback, user_data);
+}
+
+recontext*
+recontext_new_finish(GAsyncResult *result, GError **error)
+{
+    recontext_async_parse *parse = g_task_get_task_data(G_TASK(result));
+    GError *local_error = NULL;
+    recontext *rc;
+
+    rc = g_task_propagate_pointer(G_TASK(result), &local_error);
+
+    // a cancelled parse may still be running, its counts are left out
+    if (!g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        recontext_stats_add(&parse->stats);
+
+    if (local_error != NULL)
+        g_propagate_error(error, local_error);
+
+    return rc;
+}
+
+/*
+ * Jobs on existing recontexts work on a copy in a private context, taken
+ * on the calling thread. Nothing of rc is touched in the background, so
+ * it remains free for use while the job runs. The copy cannot move to the
+ * worker: rc and its world are not safe to read from another thread while
+ * the caller may change or destroy them. Its cost is one pass over the
+ * statements of rc plus a copy of each node.
+ */
+static recontext*
+recontext_async_snapshot(recontext *rc)
+{
+    recontext_ctx *ctx;
+    recontext *snapshot;
+
+    ctx = recontext_ctx_new_private();
+    snapshot = recontext_copy_to_ctx(rc, ctx);
+    recontext_ctx_unref(ctx);
+
+    return snapshot;
+}
+
+static void
+recontext_async_serialize_thread(GTask *task, gpointer source_object, gpointer task_data,
+                                 GCancellable *cancellable)
+{
+    recontext_async_op *op = task_data;
+    recontext_stats saved;
+    size_t length = 0;
+    char *data;
+
+    if (g_task_return_error_if_cancelled(task))
+        return;
+
+    recontext_stats_begin_job(&saved);
+    data = recontext_serialize_fmt(op->rc, op->format, &length);
+    recontext_stats_end_job(&saved, &op->stats);
+
+    if (data == NULL)
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Could not serialize metadata");
+    else
+        g_task_return_pointer(task, g_bytes_new_take(data, length),
+                              (GDestroyNotify) g_bytes_unref);
+}
+
+void
+recontext_serialize_async(recontext *rc, recontext_format format, GCancellable *cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data)
+{
+    recontext_async_op *op;
+    GTask *task;
+
+    task = g_task_new(NULL, cancellable, callback, user_data);
+
+    // output still in the cache is handed out right away
+    if (recontext_cache_valid(rc, format)) {
+        size_t length = 0;
+        char *data = recontext_serialize_fmt(rc, format, &length);
+
+        g_task_return_pointer(task, g_bytes_new_take(data, length),
+                              (GDestroyNotify) g_bytes_unref);
+        g_object_unref(task);
+        return;
+    }
+
+    op = g_new0(recontext_async_op, 1);
+    op->rc = recontext_async_snapshot(rc);
+    op->format = format;
+
+    g_task_set_task_data(task, op, (GDestroyNotify) recontext_async_op_free);
+    g_task_run_in_thread(task, recontext_async_serialize_thread);
+    g_object_unref(task);
+}
+
+char*
+recontext_serialize_finish(GAsyncResult *result, size_t *length, GError **error)
+{
+    recontext_async_op *op = g_task_get_task_data(G_TASK(result));
+    GBytes *bytes;
+    gsize size;
+    char *data;
+
+    // output handed out from the cache ran no job
+    if (op != NULL)
+        recontext_stats_add(&op->stats);
+
+    bytes = g_task_propagate_pointer(G_TASK(result), error);
+    if (bytes == NULL)
+        return NULL;
+
+    // the buffer came from recontext_serialize_fmt() and stays NUL-terminated
+    data = g_bytes_unref_to_data(bytes, &size);
+
+    if (length != NULL)
+        *length = size;
+
+    return data;
+}
+
+static void
+recontext_async_write_exiv2_thread(GTask *task, gpointer source_object, gpointer task_data,
+                                   GCancellable *cancellable)
+{
+    recontext_async_op *op = task_data;
+    recontext_stats saved;
+
+    if (g_task_return_error_if_cancelled(task))
+        return;
+
+    recontext_stats_begin_job(&saved);
+    recontext_write_exiv2(op->rc, op->metadata);
+    recontext_stats_end_job(&saved, &op->stats);
+    g_task_return_boolean(task, TRUE);
+}
+
+void
+recontext_write_exiv2_async(recontext *rc, GExiv2Metadata *metadata, GCancellable *cancellable,
+                            GAsyncReadyCallback callback, gpointer user_data)
+{
+    recontext_async_op *op = g_new0(recontext_async_op, 1);
+    GTask *task;
+
+    recontext_gexiv2_init();
+
+    op->rc = recontext_async_snapshot(rc);
+    op->metadata = g_object_ref(metadata);
+
+    task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_task_data(task, op, (GDestroyNotify) recontext_async_op_free);
+    g_task_run_in_thread(task, recontext_async_write_exiv2_thread);
+    g_object_unref(task);
+}
+
+gboolean
+recontext_write_exiv2_finish(GAsyncResult *result, GError **error)
+{
+    recontext_async_op *op = g_task_get_task_data(G_TASK(result));
+
+    recontext_stats_add(&op->stats);
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
@@ -0,0 +1,77 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __RECONTEXT_ASYNC_H__
+#define __RECONTEXT_ASYNC_H__
+
+#include <gio/gio.h>
+
+#include "recontext.h"
+#include "recontext_gexiv2.h"
+
+/*
+ * Asynchronous variants of the blocking calls. The work runs on the GIO
+ * worker threads and the callback is invoked in the thread-default main
+ * context of the caller, where the matching _finish call collects the
+ * result. Cancelled operations fail with G_IO_ERROR_CANCELLED.
+ *
+ * Stats counted while the work runs are added to the thread calling the
+ * _finish function.
+ *
+ * Recontexts built asynchronously have a Redland world to themselves and
+ * may be used from any one thread at a time. Merging them with recontexts
+ * of another world copies the statements over.
+ *
+ * Constructors reading files fail with G_IO_ERROR_NOT_FOUND,
+ * G_IO_ERROR_PERMISSION_DENIED and so on when the file cannot be opened,
+ * and with G_IO_ERROR_INVALID_DATA when it holds no usable metadata.
+ *
+ * Serializing or writing works on a copy of rc taken when the call is
+ * made; rc may be used or destroyed right after. The copy is made on the
+ * calling thread and costs a full pass over the statements of rc, growing
+ * linearly with the model, so these calls do not return in constant time.
+ * Output still in the serialize cache of rc is returned at once without a
+ * copy. metadata must be left alone until the write has finished.
+ */
+void            recontext_new_from_string_async(const char *data, const char *base_uri,
+                                                recontext_format format,
+                                                GCancellable *cancellable,
+                                                GAsyncReadyCallback callback,
+                                                gpointer user_data);
+void            recontext_new_from_file_async(const char *filename, const char *base_uri,
+                                              GCancellable *cancellable,
+                                              GAsyncReadyCallback callback,
+                                              gpointer user_data);
+void            recontext_new_from_xmp_async(const char *packet, size_t length,
+                                             const char *base_uri,
+                                             GCancellable *cancellable,
+                                             GAsyncReadyCallback callback,
+                                             gpointer user_data);
+void            recontext_new_from_media_file_async(const char *filename, const char *base_uri,
+                                                    GCancellable *cancellable,
+                                                    GAsyncReadyCallback callback,
+                                                    gpointer user_data);
+
+/* finishes any of the constructors above */
+recontext*      recontext_new_finish(GAsyncResult *result, GError **error);
+
+void            recontext_serialize_async(recontext *rc, recontext_format format,
+                                          GCancellable *cancellable,
+                                          GAsyncReadyCallback callback,
+                                          gpointer user_data);
+char*           recontext_serialize_finish(GAsyncResult *result, size_t *length,
+                                           GError **error);
+
+void            recontext_write_exiv2_async(recontext *rc, GExiv2Metadata *metadata,
+                                            GCancellable *cancellable,
+                                            GAsyncReadyCallback callback,
+                                            gpointer user_data);
+gboolean        recontext_write_exiv2_finish(GAsyncResult *result, GError **error);
+
+#endif /* __RECONTEXT_ASYNC_H__ */
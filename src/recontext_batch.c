@@ -0,0 +1,253 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "recontext.h"
+#include "recontext_batch.h"
+#include "recontext_gexiv2.h"
+#include "recontext_media.h"
+#include "recontext_private.h"
+
+/* jobs queued per worker ahead of the in-order delivery point */
+#define RECONTEXT_BATCH_WINDOW 4
+
+typedef struct {
+    const recontext_batch_options  *options;
+    recontext_batch_result         *results;
+    recontext_stats                *stats;      /* counted per asset by the workers */
+    gboolean                       *done;
+
+    GMutex                          lock;
+    GCond                           cond;
+} recontext_batch;
+
+/*
+ * Each worker thread keeps a reference on its own library context for as
+ * long as the thread lives, so the world is set up once per thread rather
+ * than once per asset.
+ */
+static GPrivate worker_ctx = G_PRIVATE_INIT((GDestroyNotify) recontext_ctx_unref);
+
+static gchar*
+recontext_batch_base_uri(const char *filename)
+{
+    gchar *absolute;
+    gchar *uri;
+
+    if (g_path_is_absolute(filename)) {
+        absolute = g_strdup(filename);
+    } else {
+        gchar *cwd = g_get_current_dir();
+        absolute = g_build_filename(cwd, filename, NULL);
+        g_free(cwd);
+    }
+
+    uri = g_filename_to_uri(absolute, NULL, NULL);
+    g_free(absolute);
+    return uri;
+}
+
+static recontext*
+recontext_batch_load(const char *filename, const char *base_uri,
+                     const recontext_batch_options *options)
+{
+    recontext *rc;
+
+    if (options->sidecar_suffix != NULL) {
+        gchar *sidecar = g_strconcat(filename, options->sidecar_suffix, NULL);
+        rc = recontext_new_from_file(sidecar, base_uri);
+        g_free(sidecar);
+        return rc;
+    }
+
+    if (g_str_has_suffix(filename, ".rdf") || g_str_has_suffix(filename, ".nt") ||
+        g_str_has_suffix(filename, ".ttl"))
+        return recontext_new_from_file(filename, base_uri);
+
+    rc = recontext_new_from_media_file(filename, base_uri);
+    if (rc == NULL)
+        rc = recontext_new_from_file(filename, base_uri);
+
+    return rc;
+}
+
+static int
+recontext_batch_write_exiv2(recontext *rc, const char *filename)
+{
+    GExiv2Metadata *metadata;
+    int error = 1;
+
+    metadata = gexiv2_metadata_new();
+
+    if (gexiv2_metadata_open_path(metadata, filename, NULL)) {
+        recontext_write_exiv2(rc, metadata);
+        error = !gexiv2_metadata_save_file(metadata, filename, NULL);
+    }
+
+    g_object_unref(metadata);
+    return error;
+}
+
+static void
+recontext_batch_process(recontext_batch_result *result, const recontext_batch_options *options)
+{
+    recontext *rc;
+    recontext *extracted;
+    gchar     *base_uri;
+
+    base_uri = recontext_batch_base_uri(result->filename);
+    rc = recontext_batch_load(result->filename, base_uri, options);
+    g_free(base_uri);
+
+    if (rc == NULL) {
+        result->error = 1;
+        return;
+    }
+
+    switch (options->mode) {
+    case RECONTEXT_BATCH_SERIALIZE:
+        result->output = recontext_serialize_fmt(rc, options->format, &result->length);
+        break;
+    case RECONTEXT_BATCH_EXTRACT:
+        extracted = recontext_extract(rc, rc->main_subject, 0);
+        result->output = recontext_serialize_fmt(extracted, options->format, &result->length);
+        recontext_destroy(extracted);
+        break;
+    case RECONTEXT_BATCH_MERGE:
+        // N-Triples is the cheapest way to hand a graph to another world
+        result->output = recontext_serialize_fmt(rc, RECONTEXT_FORMAT_NTRIPLES, &result->length);
+        break;
+    case RECONTEXT_BATCH_WRITE_EXIV2:
+        result->error = recontext_batch_write_exiv2(rc, result->filename);
+        break;
+    }
+
+    if (options->mode != RECONTEXT_BATCH_WRITE_EXIV2 && result->output == NULL)
+        result->error = 1;
+
+    recontext_destroy(rc);
+}
+
+static void
+recontext_batch_worker(gpointer data, gpointer user_data)
+{
+    recontext_batch *batch = user_data;
+    guint index = GPOINTER_TO_UINT(data) - 1;
+    recontext_stats saved;
+
+    if (g_private_get(&worker_ctx) == NULL)
+        g_private_set(&worker_ctx, recontext_ctx_ref());
+
+    recontext_stats_begin_job(&saved);
+    recontext_batch_process(&batch->results[index], batch->options);
+    recontext_stats_end_job(&saved, &batch->stats[index]);
+
+    g_mutex_lock(&batch->lock);
+    batch->done[index] = TRUE;
+    g_cond_broadcast(&batch->cond);
+    g_mutex_unlock(&batch->lock);
+}
+
+static int
+recontext_batch_merge(recontext *merged, const recontext_batch_result *result)
+{
+    recontext *asset;
+    gchar *base_uri;
+    int error = 1;
+
+    base_uri = recontext_batch_base_uri(result->filename);
+    asset = recontext_new_from_string_fmt(result->output, base_uri, RECONTEXT_FORMAT_NTRIPLES);
+    if (asset != NULL) {
+        error = recontext_merge(merged, asset, NULL);
+        recontext_destroy(asset);
+    }
+    g_free(base_uri);
+
+    return error;
+}
+
+size_t
+recontext_batch_run(const char * const *filenames, size_t n_filenames,
+                    const recontext_batch_options *options,
+                    recontext_batch_result_func func, void *user_data,
+                    recontext *merged)
+{
+    recontext_batch  batch;
+    GThreadPool     *pool;
+    size_t           next_push = 0;
+    size_t           next_done = 0;
+    size_t           failed = 0;
+    size_t           window;
+    int              threads;
+    size_t           i;
+
+    threads = options->threads > 0 ? options->threads : (int) g_get_num_processors();
+    window = (size_t) threads * RECONTEXT_BATCH_WINDOW;
+
+    batch.options = options;
+    batch.results = g_new0(recontext_batch_result, n_filenames);
+    batch.stats = g_new0(recontext_stats, n_filenames);
+    batch.done = g_new0(gboolean, n_filenames);
+    g_mutex_init(&batch.lock);
+    g_cond_init(&batch.cond);
+
+    for (i = 0; i < n_filenames; i++)
+        batch.results[i].filename = filenames[i];
+
+    if (options->mode == RECONTEXT_BATCH_WRITE_EXIV2)
+        recontext_gexiv2_init();
+
+    pool = g_thread_pool_new(recontext_batch_worker, &batch, threads, TRUE, NULL);
+
+    while (next_done < n_filenames) {
+        recontext_batch_result *result;
+
+        // keep the pool busy without letting it run arbitrarily far ahead
+        while (next_push < n_filenames && next_push - next_done < window) {
+            g_thread_pool_push(pool, GUINT_TO_POINTER(next_push + 1), NULL);
+            next_push++;
+        }
+
+        g_mutex_lock(&batch.lock);
+        while (!batch.done[next_done])
+            g_cond_wait(&batch.cond, &batch.lock);
+        g_mutex_unlock(&batch.lock);
+
+        result = &batch.results[next_done];
+        recontext_stats_add(&batch.stats[next_done]);
+
+        // merging happens here, so its failures are reported here too
+        if (!result->error && options->mode == RECONTEXT_BATCH_MERGE && merged != NULL)
+            result->error = recontext_batch_merge(merged, result);
+
+        if (result->error)
+            failed++;
+
+        if (func != NULL)
+            func(result, user_data);
+
+        g_free(result->output);
+        result->output = NULL;
+        next_done++;
+    }
+
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    g_mutex_clear(&batch.lock);
+    g_cond_clear(&batch.cond);
+    g_free(batch.results);
+    g_free(batch.stats);
+    g_free(batch.done);
+
+    return failed;
+}
@@ -0,0 +1,51 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __RECONTEXT_BATCH_H__
+#define __RECONTEXT_BATCH_H__
+
+#include "recontext.h"
+
+typedef enum {
+    RECONTEXT_BATCH_SERIALIZE,      /* serialize each asset's metadata */
+    RECONTEXT_BATCH_EXTRACT,        /* serialize statements about the asset itself */
+    RECONTEXT_BATCH_MERGE,          /* merge all assets into one recontext */
+    RECONTEXT_BATCH_WRITE_EXIV2     /* write the metadata back with recontext_write_exiv2() */
+} recontext_batch_mode;
+
+typedef struct {
+    recontext_batch_mode  mode;
+    recontext_format      format;           /* output format, AUTO means RDF/XML */
+    int                   threads;          /* worker threads, 0 for one per core */
+    const char           *sidecar_suffix;   /* read RDF from filename + suffix, NULL for the asset */
+} recontext_batch_options;
+
+typedef struct {
+    const char  *filename;
+    int          error;
+    char        *output;    /* serialized metadata, only valid during the callback */
+    size_t       length;
+} recontext_batch_result;
+
+typedef void (*recontext_batch_result_func)(const recontext_batch_result *result, void *user_data);
+
+/*
+ * Process a list of assets on a pool of worker threads, each with its own
+ * library context. Results are handed to func on the calling thread in
+ * input order. In merge mode, every asset is merged into the caller's
+ * merged recontext. Stats counted by the workers are added to the calling
+ * thread as the results are delivered. Returns the number of assets that
+ * failed.
+ */
+size_t          recontext_batch_run(const char * const *filenames, size_t n_filenames,
+                                    const recontext_batch_options *options,
+                                    recontext_batch_result_func func, void *user_data,
+                                    recontext *merged);
+
+#endif /* __RECONTEXT_BATCH_H__ */
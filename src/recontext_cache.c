@@ -0,0 +1,730 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "recontext.h"
+#include "recontext_private.h"
+
+/*
+ * Cache of parsed XMP packets. Entries are keyed by a hash of the RDF
+ * bytes seeded with the base URI and hold the graph as a table of terms
+ * and a table of term id triples, so a hit rebuilds the model without
+ * running the RDF/XML parser. Entries are stored one per file in the
+ * cache directory and read through a mapping; recently used ones are
+ * also kept in memory. Both tiers evict the least recently used entries
+ * beyond their size limits.
+ *
+ * Entries are checked against a second hash, the packet length and the
+ * base URI, and bounds-checked throughout. Anything that does not add up
+ * is dropped and the packet parsed as usual.
+ *
+ * Like the other process-wide settings, the cache is opened and closed
+ * while no other thread is inside the library.
+ */
+
+#define CACHE_MAGIC     "RCX1"
+#define CACHE_SUFFIX    ".rcx"
+#define NO_STRING       G_MAXUINT32
+
+enum {
+    CACHE_TERM_RESOURCE = 1,
+    CACHE_TERM_LITERAL,
+    CACHE_TERM_BLANK
+};
+
+/* everything is in host byte order, the cache is local to the machine */
+typedef struct {
+    char        magic[4];
+    guint32     pointer_size;   /* tells builds of different word size apart */
+    guint64     check;
+    guint64     packet_length;
+    guint32     base_uri;       /* offset into the strings */
+    guint32     n_terms;
+    guint32     n_triples;
+    guint32     strings_length;
+} recontext_cache_header;
+
+typedef struct {
+    guint32     type;
+    guint32     value;
+    guint32     language;
+    guint32     datatype;
+} recontext_cache_term;
+
+typedef struct {
+    guint64     key;
+    size_t      size;
+    GBytes     *bytes;          /* in-memory entries only */
+} recontext_cache_entry;
+
+typedef struct {
+    GHashTable *entries;        /* key -> link in lru */
+    GQueue      lru;            /* most recently used first */
+    size_t      used;
+    size_t      limit;
+} recontext_cache_tier;
+
+static gchar                *cache_dir = NULL;
+static guint                 cache_epoch = 0;   /* bumped on every open */
+static recontext_cache_tier  cache_disk;
+static recontext_cache_tier  cache_memory;
+
+G_LOCK_DEFINE_STATIC(cache);
+
+/* MurmurHash64A */
+guint64
+recontext_hash64(const void *data, size_t length, guint64 seed)
+{
+    const guint64 m = 0xc6a4a7935bd1e995ull;
+    const guint8 *p = data;
+    const guint8 *end = p + (length & ~(size_t) 7);
+    guint64 h = seed ^ (length * m);
+
+    for (; p != end; p += 8) {
+        guint64 k;
+
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    switch (length & 7) {
+    case 7: h ^= (guint64) p[6] << 48;  /* fall through */
+    case 6: h ^= (guint64) p[5] << 40;  /* fall through */
+    case 5: h ^= (guint64) p[4] << 32;  /* fall through */
+    case 4: h ^= (guint64) p[3] << 24;  /* fall through */
+    case 3: h ^= (guint64) p[2] << 16;  /* fall through */
+    case 2: h ^= (guint64) p[1] << 8;  /* fall through */
+    case 1: h ^= (guint64) p[0];
+            h *= m;
+    }
+
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+static void
+recontext_cache_hashes(const char *rdf, size_t length, const char *base_uri,
+                       guint64 *key, guint64 *check)
+{
+    guint64 seed = recontext_hash64(base_uri, strlen(base_uri), 0);
+
+    *key = recontext_hash64(rdf, length, seed);
+    *check = recontext_hash64(rdf, length, seed ^ 0x9e3779b97f4a7c15ull);
+}
+
+static gchar*
+recontext_cache_path(guint64 key)
+{
+    gchar name[sizeof("0123456789abcdef" CACHE_SUFFIX)];
+
+    g_snprintf(name, sizeof(name), "%016" G_GINT64_MODIFIER "x" CACHE_SUFFIX, key);
+    return g_build_filename(cache_dir, name, NULL);
+}
+
+static void
+recontext_cache_tier_init(recontext_cache_tier *tier, size_t limit)
+{
+    tier->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    g_queue_init(&tier->lru);
+    tier->used = 0;
+    tier->limit = limit;
+}
+
+/* drop an entry, and with evict set its file as well */
+static void
+recontext_cache_tier_remove(recontext_cache_tier *tier, GList *link, gboolean evict)
+{
+    recontext_cache_entry *entry = link->data;
+
+    g_hash_table_remove(tier->entries, &entry->key);
+    g_queue_delete_link(&tier->lru, link);
+    tier->used -= entry->size;
+
+    if (evict && tier == &cache_disk) {
+        gchar *path = recontext_cache_path(entry->key);
+        g_unlink(path);
+        g_free(path);
+    }
+
+    if (entry->bytes != NULL)
+        g_bytes_unref(entry->bytes);
+    g_free(entry);
+}
+
+static void
+recontext_cache_tier_clear(recontext_cache_tier *tier)
+{
+    while (tier->lru.head != NULL)
+        recontext_cache_tier_remove(tier, tier->lru.head, FALSE);
+    g_hash_table_destroy(tier->entries);
+    tier->entries = NULL;
+}
+
+/* the entry for key, marked as most recently used */
+static recontext_cache_entry*
+recontext_cache_tier_lookup(recontext_cache_tier *tier, guint64 key)
+{
+    GList *link = g_hash_table_lookup(tier->entries, &key);
+
+    if (link == NULL)
+        return NULL;
+
+    g_queue_unlink(&tier->lru, link);
+    g_queue_push_head_link(&tier->lru, link);
+    return link->data;
+}
+
+static void
+recontext_cache_tier_drop(recontext_cache_tier *tier, guint64 key)
+{
+    GList *link = g_hash_table_lookup(tier->entries, &key);
+
+    if (link != NULL)
+        recontext_cache_tier_remove(tier, link, TRUE);
+}
+
+static void
+recontext_cache_tier_insert(recontext_cache_tier *tier, recontext_cache_entry *entry)
+{
+    GList *link = g_hash_table_lookup(tier->entries, &entry->key);
+
+    // a replaced entry shares its file with the new one
+    if (link != NULL)
+        recontext_cache_tier_remove(tier, link, FALSE);
+
+    g_queue_push_head(&tier->lru, entry);
+    g_hash_table_insert(tier->entries, &entry->key, tier->lru.head);
+    tier->used += entry->size;
+
+    while (tier->used > tier->limit && tier->lru.tail != NULL)
+        recontext_cache_tier_remove(tier, tier->lru.tail, TRUE);
+}
+
+typedef struct {
+    guint64     key;
+    size_t      size;
+    time_t      mtime;
+} recontext_cache_file;
+
+static gint
+recontext_cache_compare_files(gconstpointer a, gconstpointer b)
+{
+    const recontext_cache_file *x = a;
+    const recontext_cache_file *y = b;
+
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+/* index the entries left by earlier runs, oldest first */
+static void
+recontext_cache_scan(void)
+{
+    GArray *files;
+    GDir *dir;
+    const gchar *name;
+    guint i;
+
+    dir = g_dir_open(cache_dir, 0, NULL);
+    if (dir == NULL)
+        return;
+
+    files = g_array_new(FALSE, FALSE, sizeof(recontext_cache_file));
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        recontext_cache_file file;
+        GStatBuf st;
+        gchar *path;
+        gchar *end;
+
+        if (!g_str_has_suffix(name, CACHE_SUFFIX))
+            continue;
+
+        file.key = g_ascii_strtoull(name, &end, 16);
+        if (strcmp(end, CACHE_SUFFIX) != 0)
+            continue;
+
+        path = g_build_filename(cache_dir, name, NULL);
+        if (g_stat(path, &st) == 0) {
+            file.size = st.st_size;
+            file.mtime = st.st_mtime;
+            g_array_append_val(files, file);
+        }
+        g_free(path);
+    }
+
+    g_dir_close(dir);
+    g_array_sort(files, recontext_cache_compare_files);
+
+    for (i = 0; i < files->len; i++) {
+        recontext_cache_file *file = &g_array_index(files, recontext_cache_file, i);
+        recontext_cache_entry *entry = g_new0(recontext_cache_entry, 1);
+
+        entry->key = file->key;
+        entry->size = file->size;
+        recontext_cache_tier_insert(&cache_disk, entry);
+    }
+
+    g_array_free(files, TRUE);
+}
+
+int
+recontext_cache_open(const char *directory, size_t disk_bytes, size_t memory_bytes)
+{
+    recontext_cache_close();
+
+    if (g_mkdir_with_parents(directory, 0700) != 0)
+        return 1;
+
+    G_LOCK(cache);
+    cache_dir = g_strdup(directory);
+    cache_epoch++;
+    recontext_cache_tier_init(&cache_disk, disk_bytes);
+    recontext_cache_tier_init(&cache_memory, memory_bytes);
+    recontext_cache_scan();
+    G_UNLOCK(cache);
+
+    return 0;
+}
+
+void
+recontext_cache_close(void)
+{
+    G_LOCK(cache);
+
+    if (cache_dir != NULL) {
+        recontext_cache_tier_clear(&cache_memory);
+        recontext_cache_tier_clear(&cache_disk);
+        g_free(cache_dir);
+        cache_dir = NULL;
+    }
+
+    G_UNLOCK(cache);
+}
+
+static const char*
+recontext_cache_string(const char *strings, guint32 length, guint32 offset)
+{
+    return offset < length ? strings + offset : NULL;
+}
+
+/*
+ * Rebuild a recontext from an entry, or return NULL if the entry is not
+ * valid for this packet. The last byte of the strings is checked to be
+ * NUL once, so any offset within them yields a terminated string.
+ */
+/*
+ * Rebuild a graph from an entry. On failure, invalid tells an entry that
+ * cannot be used from a load that ran out of budget.
+ */
+static recontext*
+recontext_cache_decode(GBytes *bytes, const char *base_uri, size_t length, guint64 check,
+                       gboolean *invalid)
+{
+    const recontext_cache_header *header;
+    const recontext_cache_term   *terms;
+    const guint32                *triples;
+    const char                   *strings;
+    const char                   *base;
+    const guint8                 *data;
+    librdf_node                 **nodes;
+    GHashTable                   *blanks;   /* stored id -> fresh node */
+    recontext                    *rc;
+    gsize                         size;
+    guint64                       expected;
+    guint64                       start;
+    guint32                       i;
+    gboolean                      over_budget = FALSE;
+    int                           error = 0;
+
+    *invalid = TRUE;
+    data = g_bytes_get_data(bytes, &size);
+    header = (const recontext_cache_header *) data;
+
+    if (size < sizeof(*header) || memcmp(header->magic, CACHE_MAGIC, 4) != 0 ||
+        header->pointer_size != sizeof(void *) || header->check != check ||
+        header->packet_length != length)
+        return NULL;
+
+    expected = sizeof(*header) + (guint64) header->n_terms * sizeof(recontext_cache_term) +
+               (guint64) header->n_triples * 3 * sizeof(guint32) + header->strings_length;
+    if (expected != size || header->strings_length == 0)
+        return NULL;
+
+    terms = (const recontext_cache_term *) (header + 1);
+    triples = (const guint32 *) (terms + header->n_terms);
+    strings = (const char *) (triples + 3 * (gsize) header->n_triples);
+
+    base = recontext_cache_string(strings, header->strings_length, header->base_uri);
+    if (strings[header->strings_length - 1] != '\0' || base == NULL ||
+        strcmp(base, base_uri) != 0)
+        return NULL;
+
+    rc = recontext_new(base_uri);
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_PARSE);
+    nodes = g_new0(librdf_node *, header->n_terms);
+    blanks = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                   (GDestroyNotify) librdf_free_node);
+
+    for (i = 0; i < header->n_terms && !error; i++) {
+        const recontext_cache_term *term = &terms[i];
+        const char *value = recontext_cache_string(strings, header->strings_length, term->value);
+        const char *language;
+        const char *datatype;
+        librdf_node *fresh;
+        librdf_uri *uri = NULL;
+
+        if (value == NULL) {
+            error = 1;
+            break;
+        }
+
+        switch (term->type) {
+        case CACHE_TERM_RESOURCE:
+            nodes[i] = librdf_new_node_from_uri_string(rc->world, (const unsigned char *) value);
+            break;
+        case CACHE_TERM_LITERAL:
+            language = recontext_cache_string(strings, header->strings_length, term->language);
+            datatype = recontext_cache_string(strings, header->strings_length, term->datatype);
+            if (datatype != NULL)
+                uri = librdf_new_uri(rc->world, (const unsigned char *) datatype);
+            nodes[i] = librdf_new_node_from_typed_literal(rc->world, (const unsigned char *) value,
+                                                          language, uri);
+            if (uri != NULL)
+                librdf_free_uri(uri);
+            break;
+        case CACHE_TERM_BLANK:
+            // blank nodes are new on every load, the same as on a parse
+            fresh = g_hash_table_lookup(blanks, value);
+            if (fresh == NULL) {
+                fresh = librdf_new_node_from_blank_identifier(rc->world, NULL);
+                if (fresh != NULL)
+                    g_hash_table_insert(blanks, (gpointer) value, fresh);
+            }
+            nodes[i] = fresh != NULL ? librdf_new_node_from_node(fresh) : NULL;
+            break;
+        }
+
+        error = nodes[i] == NULL;
+    }
+
+    for (i = 0; i < header->n_triples && !error; i++) {
+        const guint32 *t = triples + 3 * (gsize) i;
+        librdf_statement *statement;
+
+        if (t[0] >= header->n_terms || t[1] >= header->n_terms || t[2] >= header->n_terms) {
+            error = 1;
+            break;
+        }
+
+        statement = librdf_new_statement_from_nodes(rc->world,
+            librdf_new_node_from_node(nodes[t[0]]),
+            librdf_new_node_from_node(nodes[t[1]]),
+            librdf_new_node_from_node(nodes[t[2]]));
+
+        if (recontext_charge(rc, statement)) {
+            over_budget = TRUE;
+            error = 1;
+        } else {
+            error = librdf_model_add_statement(rc->model, statement) != 0;
+        }
+        librdf_free_statement(statement);
+    }
+
+    for (i = 0; i < header->n_terms; i++) {
+        if (nodes[i] != NULL)
+            librdf_free_node(nodes[i]);
+    }
+    g_free(nodes);
+    g_hash_table_destroy(blanks);
+
+    if (error) {
+        *invalid = !over_budget;
+        recontext_destroy(rc);
+        return NULL;
+    }
+
+    *invalid = FALSE;
+    RECONTEXT_OP_END(RECONTEXT_OP_PARSE, start, header->n_triples, length);
+    recontext_changed(rc, NULL);
+    return rc;
+}
+
+static guint32
+recontext_cache_add_string(GString *strings, const char *value)
+{
+    guint32 offset = strings->len;
+
+    if (value == NULL)
+        return NO_STRING;
+
+    g_string_append_len(strings, value, strlen(value) + 1);
+    return offset;
+}
+
+static guint32
+recontext_cache_add_term(GHashTable *ids, GArray *terms, GString *strings, librdf_node *node)
+{
+    recontext_cache_term term = { 0, NO_STRING, NO_STRING, NO_STRING };
+    const char *value = NULL;
+    const char *language = NULL;
+    const char *datatype = NULL;
+    gpointer id;
+    gchar *key;
+
+    if (librdf_node_is_resource(node)) {
+        term.type = CACHE_TERM_RESOURCE;
+        value = (const char *) librdf_uri_as_string(librdf_node_get_uri(node));
+    } else if (librdf_node_is_literal(node)) {
+        librdf_uri *uri = librdf_node_get_literal_value_datatype_uri(node);
+
+        term.type = CACHE_TERM_LITERAL;
+        value = (const char *) librdf_node_get_literal_value(node);
+        language = librdf_node_get_literal_value_language(node);
+        datatype = uri != NULL ? (const char *) librdf_uri_as_string(uri) : NULL;
+    } else {
+        term.type = CACHE_TERM_BLANK;
+        value = (const char *) librdf_node_get_blank_identifier(node);
+    }
+
+    key = g_strdup_printf("%u\x1f%s\x1f%s\x1f%s", term.type, value,
+                          language ? language : "", datatype ? datatype : "");
+
+    id = g_hash_table_lookup(ids, key);
+    if (id != NULL) {
+        g_free(key);
+        return GPOINTER_TO_UINT(id) - 1;
+    }
+
+    term.value = recontext_cache_add_string(strings, value);
+    term.language = recontext_cache_add_string(strings, language);
+    term.datatype = recontext_cache_add_string(strings, datatype);
+    g_array_append_val(terms, term);
+    g_hash_table_insert(ids, key, GUINT_TO_POINTER(terms->len));
+
+    return terms->len - 1;
+}
+
+static GBytes*
+recontext_cache_encode(recontext *rc, const char *base_uri, size_t length, guint64 check)
+{
+    recontext_cache_header header;
+    librdf_stream *stream;
+    GHashTable    *ids;
+    GArray        *terms;
+    GArray        *triples;
+    GString       *strings;
+    GByteArray    *data;
+
+    ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    terms = g_array_new(FALSE, FALSE, sizeof(recontext_cache_term));
+    triples = g_array_new(FALSE, FALSE, sizeof(guint32));
+    strings = g_string_new(NULL);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.pointer_size = sizeof(void *);
+    header.check = check;
+    header.packet_length = length;
+    header.base_uri = recontext_cache_add_string(strings, base_uri);
+
+    stream = librdf_model_as_stream(rc->model);
+    while (!librdf_stream_end(stream)) {
+        librdf_statement *statement = librdf_stream_get_object(stream);
+        guint32 t[3];
+
+        t[0] = recontext_cache_add_term(ids, terms, strings, librdf_statement_get_subject(statement));
+        t[1] = recontext_cache_add_term(ids, terms, strings, librdf_statement_get_predicate(statement));
+        t[2] = recontext_cache_add_term(ids, terms, strings, librdf_statement_get_object(statement));
+        g_array_append_vals(triples, t, 3);
+
+        librdf_stream_next(stream);
+    }
+    librdf_free_stream(stream);
+
+    header.n_terms = terms->len;
+    header.n_triples = triples->len / 3;
+    header.strings_length = strings->len;
+
+    data = g_byte_array_sized_new(sizeof(header) + terms->len * sizeof(recontext_cache_term) +
+                                  triples->len * sizeof(guint32) + strings->len);
+    g_byte_array_append(data, (const guint8 *) &header, sizeof(header));
+    g_byte_array_append(data, (const guint8 *) terms->data,
+                        terms->len * sizeof(recontext_cache_term));
+    g_byte_array_append(data, (const guint8 *) triples->data, triples->len * sizeof(guint32));
+    g_byte_array_append(data, (const guint8 *) strings->str, strings->len);
+
+    g_string_free(strings, TRUE);
+    g_array_free(triples, TRUE);
+    g_array_free(terms, TRUE);
+    g_hash_table_destroy(ids);
+
+    return g_byte_array_free_to_bytes(data);
+}
+
+/* keep an entry in memory, with the lock held */
+static void
+recontext_cache_remember(guint64 key, GBytes *bytes)
+{
+    recontext_cache_entry *entry;
+
+    if (g_bytes_get_size(bytes) > cache_memory.limit)
+        return;
+
+    entry = g_new0(recontext_cache_entry, 1);
+    entry->key = key;
+    entry->size = g_bytes_get_size(bytes);
+    entry->bytes = g_bytes_ref(bytes);
+    recontext_cache_tier_insert(&cache_memory, entry);
+}
+
+/* forget an entry that did not decode, with the lock held */
+static void
+recontext_cache_forget(guint64 key)
+{
+    recontext_cache_tier_drop(&cache_memory, key);
+    recontext_cache_tier_drop(&cache_disk, key);
+}
+
+/* whether the cache is open; cache_dir changes under the lock only */
+static gboolean
+recontext_cache_is_open(void)
+{
+    gboolean open;
+
+    G_LOCK(cache);
+    open = cache_dir != NULL;
+    G_UNLOCK(cache);
+
+    return open;
+}
+
+/*
+ * Look up the graph of an RDF/XML packet. Returns NULL on a miss, when
+ * the cache is closed or when there is no base URI to key on.
+ */
+recontext*
+recontext_cache_load(const char *rdf, size_t length, const char *base_uri)
+{
+    recontext_cache_entry *entry;
+    recontext   *rc;
+    GBytes      *bytes = NULL;
+    gchar       *path = NULL;
+    gboolean     invalid;
+    guint64      key;
+    guint64      check;
+
+    if (base_uri == NULL || !recontext_cache_is_open())
+        return NULL;
+
+    recontext_cache_hashes(rdf, length, base_uri, &key, &check);
+
+    // the cache may have been closed meanwhile, the path is built from cache_dir
+    G_LOCK(cache);
+    if (cache_dir == NULL) {
+        G_UNLOCK(cache);
+        return NULL;
+    }
+    entry = recontext_cache_tier_lookup(&cache_memory, key);
+    if (entry != NULL)
+        bytes = g_bytes_ref(entry->bytes);
+    else if (recontext_cache_tier_lookup(&cache_disk, key) != NULL)
+        path = recontext_cache_path(key);
+    G_UNLOCK(cache);
+
+    // the mapping keeps the data even if the file is evicted meanwhile
+    if (path != NULL) {
+        GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+
+        if (mapped != NULL) {
+            bytes = g_mapped_file_get_bytes(mapped);
+            g_mapped_file_unref(mapped);
+            g_utime(path, NULL);
+        }
+        g_free(path);
+    }
+
+    if (bytes == NULL)
+        return NULL;
+
+    rc = recontext_cache_decode(bytes, base_uri, length, check, &invalid);
+
+    // running out of budget fails this load only, the entry stays good
+    G_LOCK(cache);
+    if (cache_dir != NULL && rc == NULL && invalid)
+        recontext_cache_forget(key);
+    else if (cache_dir != NULL && path != NULL)
+        recontext_cache_remember(key, bytes);
+    G_UNLOCK(cache);
+
+    g_bytes_unref(bytes);
+    return rc;
+}
+
+/* store the graph parsed from an RDF/XML packet */
+void
+recontext_cache_save(recontext *rc, const char *rdf, size_t length, const char *base_uri)
+{
+    recontext_cache_entry *entry;
+    GBytes  *bytes;
+    guint64  key;
+    guint64  check;
+    gchar   *path;
+    guint    epoch;
+
+    if (base_uri == NULL || !recontext_cache_is_open())
+        return;
+
+    recontext_cache_hashes(rdf, length, base_uri, &key, &check);
+    bytes = recontext_cache_encode(rc, base_uri, length, check);
+
+    G_LOCK(cache);
+
+    if (cache_dir == NULL || g_bytes_get_size(bytes) > cache_disk.limit) {
+        G_UNLOCK(cache);
+        g_bytes_unref(bytes);
+        return;
+    }
+
+    path = recontext_cache_path(key);
+    epoch = cache_epoch;
+    G_UNLOCK(cache);
+
+    // written to a temporary file and renamed, readers never see half an
+    // entry, and other threads need not wait for the disk meanwhile
+    if (!g_file_set_contents(path, g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), NULL)) {
+        g_free(path);
+        g_bytes_unref(bytes);
+        return;
+    }
+
+    // only index the file if the cache it went into is still the open one
+    G_LOCK(cache);
+    if (cache_dir != NULL && cache_epoch == epoch) {
+        entry = g_new0(recontext_cache_entry, 1);
+        entry->key = key;
+        entry->size = g_bytes_get_size(bytes);
+        recontext_cache_tier_insert(&cache_disk, entry);
+        recontext_cache_remember(key, bytes);
+    }
+    G_UNLOCK(cache);
+
+    g_free(path);
+    g_bytes_unref(bytes);
+}
@@ -0,0 +1,834 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "recontext.h"
+#include "recontext_private.h"
+
+/*
+ * Compact in-memory store, plugged into Redland as a storage module.
+ *
+ * Terms are interned once into a dictionary and triples are kept as
+ * packed arrays of term ids. The array is sorted by subject, predicate,
+ * object on demand, which also drops duplicates; a second permutation
+ * sorted by predicate, object, subject serves lookups by predicate. Adding
+ * statements only appends, so parsing a graph costs one dictionary lookup
+ * per term and a single sort before the first read. Statements appended
+ * after that are sorted on their own and merged into the sorted prefix.
+ */
+
+#define NO_TERM G_MAXUINT32
+
+typedef struct {
+    guint32 s;
+    guint32 p;
+    guint32 o;
+} recontext_triple;
+
+struct recontext_compact_s {
+    librdf_world    *world;
+    GHashTable      *ids;           /* librdf_node* -> id + 1 */
+    GPtrArray       *terms;         /* id -> librdf_node* */
+    GArray          *triples;       /* recontext_triple */
+    GArray          *pos;           /* guint32 indices into triples */
+    guint            sorted;        /* length of the sorted, unique prefix */
+    gboolean         pos_valid;
+};
+
+static guint
+recontext_term_hash(gconstpointer key)
+{
+    librdf_node *node = (librdf_node *) key;
+    const unsigned char *value = NULL;
+    size_t length = 0;
+    guint hash;
+    size_t i;
+
+    if (librdf_node_is_resource(node)) {
+        value = librdf_uri_as_counted_string(librdf_node_get_uri(node), &length);
+        hash = 1;
+    } else if (librdf_node_is_literal(node)) {
+        value = librdf_node_get_literal_value_as_counted_string(node, &length);
+        hash = 2;
+    } else {
+        value = librdf_node_get_counted_blank_identifier(node, &length);
+        hash = 3;
+    }
+
+    // FNV-1a, language and datatype are left to the equality check
+    hash ^= 2166136261u;
+    for (i = 0; i < length; i++)
+        hash = (hash ^ value[i]) * 16777619u;
+
+    return hash;
+}
+
+static gboolean
+recontext_term_equal(gconstpointer a, gconstpointer b)
+{
+    return librdf_node_equals((librdf_node *) a, (librdf_node *) b);
+}
+
+static recontext_compact_store*
+recontext_compact_new(librdf_world *world)
+{
+    recontext_compact_store *store = g_new0(recontext_compact_store, 1);
+
+    store->world = world;
+    store->ids = g_hash_table_new(recontext_term_hash, recontext_term_equal);
+    store->terms = g_ptr_array_new_with_free_func((GDestroyNotify) librdf_free_node);
+    store->triples = g_array_new(FALSE, FALSE, sizeof(recontext_triple));
+    store->pos = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+    return store;
+}
+
+static void
+recontext_compact_free(recontext_compact_store *store)
+{
+    g_hash_table_destroy(store->ids);
+    g_ptr_array_free(store->terms, TRUE);
+    g_array_free(store->triples, TRUE);
+    g_array_free(store->pos, TRUE);
+    g_free(store);
+}
+
+static guint32
+recontext_compact_lookup(recontext_compact_store *store, librdf_node *node)
+{
+    gpointer id = g_hash_table_lookup(store->ids, node);
+
+    return id != NULL ? GPOINTER_TO_UINT(id) - 1 : NO_TERM;
+}
+
+static guint32
+recontext_compact_intern(recontext_compact_store *store, librdf_node *node)
+{
+    guint32 id = recontext_compact_lookup(store, node);
+
+    if (id == NO_TERM) {
+        librdf_node *copy = librdf_new_node_from_node(node);
+
+        id = store->terms->len;
+        g_ptr_array_add(store->terms, copy);
+        g_hash_table_insert(store->ids, copy, GUINT_TO_POINTER(id + 1));
+    }
+
+    return id;
+}
+
+static void
+recontext_compact_append(recontext_compact_store *store, guint32 s, guint32 p, guint32 o)
+{
+    recontext_triple triple = { s, p, o };
+
+    g_array_append_val(store->triples, triple);
+    store->pos_valid = FALSE;
+}
+
+static int
+recontext_triple_compare(const void *a, const void *b)
+{
+    const recontext_triple *x = a;
+    const recontext_triple *y = b;
+
+    if (x->s != y->s)
+        return x->s < y->s ? -1 : 1;
+    if (x->p != y->p)
+        return x->p < y->p ? -1 : 1;
+    if (x->o != y->o)
+        return x->o < y->o ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Sort the appended tail and merge it into the sorted prefix. Tail triples
+ * already in the prefix are dropped first, then the merge runs backwards
+ * from the end, so only the part of the prefix past the first insertion
+ * point moves.
+ */
+static void
+recontext_compact_sort(recontext_compact_store *store)
+{
+    recontext_triple *t = (recontext_triple *) store->triples->data;
+    recontext_triple *tail;
+    guint head = store->sorted;
+    guint n = store->triples->len;
+    guint i, j, k;
+
+    if (head == n)
+        return;
+
+    qsort(t + head, n - head, sizeof(recontext_triple), recontext_triple_compare);
+
+    for (i = head, j = head; i < n; i++) {
+        if (j > head && recontext_triple_compare(&t[j - 1], &t[i]) == 0)
+            continue;
+        if (head > 0 && bsearch(&t[i], t, head, sizeof(recontext_triple),
+                                recontext_triple_compare) != NULL)
+            continue;
+        t[j++] = t[i];
+    }
+    g_array_set_size(store->triples, j);
+
+    if (head > 0 && j > head && recontext_triple_compare(&t[head - 1], &t[head]) > 0) {
+        tail = g_new(recontext_triple, j - head);
+        memcpy(tail, t + head, (j - head) * sizeof(recontext_triple));
+
+        for (i = head, k = j - head; k > 0; ) {
+            if (i > 0 && recontext_triple_compare(&t[i - 1], &tail[k - 1]) > 0) {
+                t[i + k - 1] = t[i - 1];
+                i--;
+            } else {
+                t[i + k - 1] = tail[k - 1];
+                k--;
+            }
+        }
+
+        g_free(tail);
+    }
+
+    store->sorted = j;
+    store->pos_valid = FALSE;
+}
+
+static gint
+recontext_pos_compare(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const recontext_triple *t = user_data;
+    const recontext_triple *x = &t[*(const guint32 *) a];
+    const recontext_triple *y = &t[*(const guint32 *) b];
+
+    if (x->p != y->p)
+        return x->p < y->p ? -1 : 1;
+    if (x->o != y->o)
+        return x->o < y->o ? -1 : 1;
+    if (x->s != y->s)
+        return x->s < y->s ? -1 : 1;
+    return 0;
+}
+
+static void
+recontext_compact_index_pos(recontext_compact_store *store)
+{
+    guint32 i;
+
+    recontext_compact_sort(store);
+    if (store->pos_valid)
+        return;
+
+    g_array_set_size(store->pos, store->triples->len);
+    for (i = 0; i < store->triples->len; i++)
+        g_array_index(store->pos, guint32, i) = i;
+
+    g_array_sort_with_data(store->pos, recontext_pos_compare, store->triples->data);
+    store->pos_valid = TRUE;
+}
+
+/* first triple in SPO order not less than (s, p, 0) */
+static guint
+recontext_compact_lower_spo(recontext_compact_store *store, guint32 s, guint32 p)
+{
+    const recontext_triple *t = (const recontext_triple *) store->triples->data;
+    guint lo = 0, hi = store->triples->len;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+
+        if (t[mid].s < s || (t[mid].s == s && p != NO_TERM && t[mid].p < p))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* first entry in POS order not less than (p, o, 0) */
+static guint
+recontext_compact_lower_pos(recontext_compact_store *store, guint32 p, guint32 o)
+{
+    const recontext_triple *t = (const recontext_triple *) store->triples->data;
+    const guint32 *pos = (const guint32 *) store->pos->data;
+    guint lo = 0, hi = store->pos->len;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        const recontext_triple *x = &t[pos[mid]];
+
+        if (x->p < p || (x->p == p && o != NO_TERM && x->o < o))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Collect the triples matching a pattern, NO_TERM standing for a wildcard.
+ * Matches are copied out, so the store may change while they are in use.
+ */
+static GArray*
+recontext_compact_match(recontext_compact_store *store, guint32 s, guint32 p, guint32 o)
+{
+    const recontext_triple *t;
+    GArray *matches;
+    guint i;
+
+    matches = g_array_new(FALSE, FALSE, sizeof(recontext_triple));
+
+    recontext_compact_sort(store);
+    t = (const recontext_triple *) store->triples->data;
+
+    if (s != NO_TERM) {
+        for (i = recontext_compact_lower_spo(store, s, p);
+             i < store->triples->len && t[i].s == s && (p == NO_TERM || t[i].p == p); i++) {
+            if (o == NO_TERM || t[i].o == o)
+                g_array_append_val(matches, t[i]);
+        }
+    } else if (p != NO_TERM) {
+        const guint32 *pos;
+
+        recontext_compact_index_pos(store);
+        pos = (const guint32 *) store->pos->data;
+
+        for (i = recontext_compact_lower_pos(store, p, o);
+             i < store->pos->len && t[pos[i]].p == p && (o == NO_TERM || t[pos[i]].o == o); i++)
+            g_array_append_val(matches, t[pos[i]]);
+    } else {
+        for (i = 0; i < store->triples->len; i++) {
+            if (o == NO_TERM || t[i].o == o)
+                g_array_append_val(matches, t[i]);
+        }
+    }
+
+    return matches;
+}
+
+/* resolve a statement pattern to ids; FALSE if a bound term is unknown */
+static gboolean
+recontext_compact_pattern(recontext_compact_store *store, librdf_statement *statement,
+                          guint32 *s, guint32 *p, guint32 *o)
+{
+    librdf_node *subject = statement ? librdf_statement_get_subject(statement) : NULL;
+    librdf_node *predicate = statement ? librdf_statement_get_predicate(statement) : NULL;
+    librdf_node *object = statement ? librdf_statement_get_object(statement) : NULL;
+
+    *s = *p = *o = NO_TERM;
+
+    if (subject != NULL && (*s = recontext_compact_lookup(store, subject)) == NO_TERM)
+        return FALSE;
+    if (predicate != NULL && (*p = recontext_compact_lookup(store, predicate)) == NO_TERM)
+        return FALSE;
+    if (object != NULL && (*o = recontext_compact_lookup(store, object)) == NO_TERM)
+        return FALSE;
+
+    return TRUE;
+}
+
+/* statement streams over a set of matches */
+
+typedef struct {
+    recontext_compact_store *store;
+    GArray                  *matches;
+    guint                    index;
+    librdf_statement        *current;
+} recontext_compact_stream;
+
+static int
+recontext_compact_stream_end(void *context)
+{
+    recontext_compact_stream *stream = context;
+
+    return stream->index >= stream->matches->len;
+}
+
+static int
+recontext_compact_stream_next(void *context)
+{
+    recontext_compact_stream *stream = context;
+
+    if (stream->current != NULL) {
+        librdf_free_statement(stream->current);
+        stream->current = NULL;
+    }
+    stream->index++;
+
+    return stream->index >= stream->matches->len;
+}
+
+static void*
+recontext_compact_stream_get(void *context, int flags)
+{
+    recontext_compact_stream *stream = context;
+    recontext_triple *t;
+    GPtrArray *terms = stream->store->terms;
+
+    if (flags != LIBRDF_STREAM_GET_METHOD_GET_OBJECT)
+        return NULL;
+
+    if (stream->current == NULL) {
+        t = &g_array_index(stream->matches, recontext_triple, stream->index);
+        stream->current = librdf_new_statement_from_nodes(stream->store->world,
+            librdf_new_node_from_node(g_ptr_array_index(terms, t->s)),
+            librdf_new_node_from_node(g_ptr_array_index(terms, t->p)),
+            librdf_new_node_from_node(g_ptr_array_index(terms, t->o)));
+    }
+
+    return stream->current;
+}
+
+static void
+recontext_compact_stream_finished(void *context)
+{
+    recontext_compact_stream *stream = context;
+
+    if (stream->current != NULL)
+        librdf_free_statement(stream->current);
+    g_array_free(stream->matches, TRUE);
+    g_free(stream);
+}
+
+static librdf_stream*
+recontext_compact_new_stream(recontext_compact_store *store, GArray *matches)
+{
+    recontext_compact_stream *stream = g_new0(recontext_compact_stream, 1);
+
+    stream->store = store;
+    stream->matches = matches;
+
+    return librdf_new_stream(store->world, stream,
+                             recontext_compact_stream_end,
+                             recontext_compact_stream_next,
+                             recontext_compact_stream_get,
+                             recontext_compact_stream_finished);
+}
+
+/* node iterators for the arc and source/target lookups */
+
+typedef struct {
+    GPtrArray   *nodes;
+    guint        index;
+} recontext_compact_iterator;
+
+static int
+recontext_compact_iterator_end(void *context)
+{
+    recontext_compact_iterator *iterator = context;
+
+    return iterator->index >= iterator->nodes->len;
+}
+
+static int
+recontext_compact_iterator_next(void *context)
+{
+    recontext_compact_iterator *iterator = context;
+
+    iterator->index++;
+    return iterator->index >= iterator->nodes->len;
+}
+
+static void*
+recontext_compact_iterator_get(void *context, int flags)
+{
+    recontext_compact_iterator *iterator = context;
+
+    if (flags != LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT)
+        return NULL;
+
+    return g_ptr_array_index(iterator->nodes, iterator->index);
+}
+
+static void
+recontext_compact_iterator_finished(void *context)
+{
+    recontext_compact_iterator *iterator = context;
+
+    g_ptr_array_free(iterator->nodes, TRUE);
+    g_free(iterator);
+}
+
+/* iterate one position (0 subject, 1 predicate, 2 object) of the matches */
+static librdf_iterator*
+recontext_compact_nodes(recontext_compact_store *store, guint32 s, guint32 p, guint32 o,
+                        int position, gboolean unknown)
+{
+    recontext_compact_iterator *iterator = g_new0(recontext_compact_iterator, 1);
+    GArray *matches;
+    guint i;
+
+    iterator->nodes = g_ptr_array_new_with_free_func((GDestroyNotify) librdf_free_node);
+
+    matches = unknown ? NULL : recontext_compact_match(store, s, p, o);
+    for (i = 0; matches != NULL && i < matches->len; i++) {
+        recontext_triple *t = &g_array_index(matches, recontext_triple, i);
+        guint32 id = position == 0 ? t->s : position == 1 ? t->p : t->o;
+
+        g_ptr_array_add(iterator->nodes,
+                        librdf_new_node_from_node(g_ptr_array_index(store->terms, id)));
+    }
+    if (matches != NULL)
+        g_array_free(matches, TRUE);
+
+    return librdf_new_iterator(store->world, iterator,
+                               recontext_compact_iterator_end,
+                               recontext_compact_iterator_next,
+                               recontext_compact_iterator_get,
+                               recontext_compact_iterator_finished);
+}
+
+/* storage module methods */
+
+#define STORE(storage) ((recontext_compact_store *) librdf_storage_get_instance(storage))
+
+static int
+recontext_compact_init(librdf_storage *storage, const char *name, librdf_hash *options)
+{
+    librdf_storage_set_instance(storage,
+        recontext_compact_new(librdf_storage_get_world(storage)));
+
+    // storage modules own their options
+    if (options != NULL)
+        librdf_free_hash(options);
+
+    return 0;
+}
+
+static void
+recontext_compact_terminate(librdf_storage *storage)
+{
+    if (STORE(storage) != NULL)
+        recontext_compact_free(STORE(storage));
+}
+
+static int
+recontext_compact_open(librdf_storage *storage, librdf_model *model)
+{
+    return 0;
+}
+
+static int
+recontext_compact_close(librdf_storage *storage)
+{
+    return 0;
+}
+
+static int
+recontext_compact_size(librdf_storage *storage)
+{
+    recontext_compact_sort(STORE(storage));
+    return (int) STORE(storage)->triples->len;
+}
+
+static int
+recontext_compact_add_statement(librdf_storage *storage, librdf_statement *statement)
+{
+    recontext_compact_store *store = STORE(storage);
+
+    recontext_compact_append(store,
+        recontext_compact_intern(store, librdf_statement_get_subject(statement)),
+        recontext_compact_intern(store, librdf_statement_get_predicate(statement)),
+        recontext_compact_intern(store, librdf_statement_get_object(statement)));
+
+    return 0;
+}
+
+static int
+recontext_compact_add_statements(librdf_storage *storage, librdf_stream *stream)
+{
+    while (!librdf_stream_end(stream)) {
+        recontext_compact_add_statement(storage, librdf_stream_get_object(stream));
+        librdf_stream_next(stream);
+    }
+
+    return 0;
+}
+
+static int
+recontext_compact_remove_statement(librdf_storage *storage, librdf_statement *statement)
+{
+    recontext_compact_store *store = STORE(storage);
+    recontext_triple key;
+    recontext_triple *found;
+
+    if (!recontext_compact_pattern(store, statement, &key.s, &key.p, &key.o))
+        return 0;
+
+    recontext_compact_sort(store);
+    found = bsearch(&key, store->triples->data, store->triples->len,
+                    sizeof(recontext_triple), recontext_triple_compare);
+    if (found != NULL) {
+        g_array_remove_index(store->triples, found - (recontext_triple *) store->triples->data);
+        store->sorted = store->triples->len;
+        store->pos_valid = FALSE;
+    }
+
+    return 0;
+}
+
+static int
+recontext_compact_contains_statement(librdf_storage *storage, librdf_statement *statement)
+{
+    recontext_compact_store *store = STORE(storage);
+    recontext_triple key;
+
+    if (!recontext_compact_pattern(store, statement, &key.s, &key.p, &key.o))
+        return 0;
+
+    recontext_compact_sort(store);
+    return bsearch(&key, store->triples->data, store->triples->len,
+                   sizeof(recontext_triple), recontext_triple_compare) != NULL;
+}
+
+static librdf_stream*
+recontext_compact_serialise(librdf_storage *storage)
+{
+    recontext_compact_store *store = STORE(storage);
+
+    return recontext_compact_new_stream(store,
+        recontext_compact_match(store, NO_TERM, NO_TERM, NO_TERM));
+}
+
+static librdf_stream*
+recontext_compact_find_statements(librdf_storage *storage, librdf_statement *statement)
+{
+    recontext_compact_store *store = STORE(storage);
+    guint32 s, p, o;
+
+    if (!recontext_compact_pattern(store, statement, &s, &p, &o))
+        return recontext_compact_new_stream(store,
+            g_array_new(FALSE, FALSE, sizeof(recontext_triple)));
+
+    return recontext_compact_new_stream(store, recontext_compact_match(store, s, p, o));
+}
+
+static librdf_iterator*
+recontext_compact_find_sources(librdf_storage *storage, librdf_node *arc, librdf_node *target)
+{
+    recontext_compact_store *store = STORE(storage);
+    guint32 p = recontext_compact_lookup(store, arc);
+    guint32 o = recontext_compact_lookup(store, target);
+
+    return recontext_compact_nodes(store, NO_TERM, p, o, 0, p == NO_TERM || o == NO_TERM);
+}
+
+static librdf_iterator*
+recontext_compact_find_arcs(librdf_storage *storage, librdf_node *source, librdf_node *target)
+{
+    recontext_compact_store *store = STORE(storage);
+    guint32 s = recontext_compact_lookup(store, source);
+    guint32 o = recontext_compact_lookup(store, target);
+
+    return recontext_compact_nodes(store, s, NO_TERM, o, 1, s == NO_TERM || o == NO_TERM);
+}
+
+static librdf_iterator*
+recontext_compact_find_targets(librdf_storage *storage, librdf_node *source, librdf_node *arc)
+{
+    recontext_compact_store *store = STORE(storage);
+    guint32 s = recontext_compact_lookup(store, source);
+    guint32 p = recontext_compact_lookup(store, arc);
+
+    return recontext_compact_nodes(store, s, p, NO_TERM, 2, s == NO_TERM || p == NO_TERM);
+}
+
+static librdf_iterator*
+recontext_compact_get_arcs_in(librdf_storage *storage, librdf_node *node)
+{
+    recontext_compact_store *store = STORE(storage);
+    guint32 o = recontext_compact_lookup(store, node);
+
+    return recontext_compact_nodes(store, NO_TERM, NO_TERM, o, 1, o == NO_TERM);
+}
+
+static librdf_iterator*
+recontext_compact_get_arcs_out(librdf_storage *storage, librdf_node *node)
+{
+    recontext_compact_store *store = STORE(storage);
+    guint32 s = recontext_compact_lookup(store, node);
+
+    return recontext_compact_nodes(store, s, NO_TERM, NO_TERM, 1, s == NO_TERM);
+}
+
+static int
+recontext_compact_has_arc_in(librdf_storage *storage, librdf_node *node, librdf_node *property)
+{
+    recontext_compact_store *store = STORE(storage);
+    guint32 p = recontext_compact_lookup(store, property);
+    guint32 o = recontext_compact_lookup(store, node);
+    GArray *matches;
+    int found;
+
+    if (p == NO_TERM || o == NO_TERM)
+        return 0;
+
+    matches = recontext_compact_match(store, NO_TERM, p, o);
+    found = matches->len > 0;
+    g_array_free(matches, TRUE);
+
+    return found;
+}
+
+static int
+recontext_compact_has_arc_out(librdf_storage *storage, librdf_node *node, librdf_node *property)
+{
+    recontext_compact_store *store = STORE(storage);
+    guint32 s = recontext_compact_lookup(store, node);
+    guint32 p = recontext_compact_lookup(store, property);
+    guint i;
+
+    if (s == NO_TERM || p == NO_TERM)
+        return 0;
+
+    recontext_compact_sort(store);
+    i = recontext_compact_lower_spo(store, s, p);
+
+    return i < store->triples->len &&
+           g_array_index(store->triples, recontext_triple, i).s == s &&
+           g_array_index(store->triples, recontext_triple, i).p == p;
+}
+
+static void
+recontext_compact_register_factory(librdf_storage_factory *factory)
+{
+    factory->version            = LIBRDF_STORAGE_INTERFACE_VERSION;
+    factory->init               = recontext_compact_init;
+    factory->terminate          = recontext_compact_terminate;
+    factory->open               = recontext_compact_open;
+    factory->close              = recontext_compact_close;
+    factory->size               = recontext_compact_size;
+    factory->add_statement      = recontext_compact_add_statement;
+    factory->add_statements     = recontext_compact_add_statements;
+    factory->remove_statement   = recontext_compact_remove_statement;
+    factory->contains_statement = recontext_compact_contains_statement;
+    factory->has_arc_in         = recontext_compact_has_arc_in;
+    factory->has_arc_out        = recontext_compact_has_arc_out;
+    factory->serialise          = recontext_compact_serialise;
+    factory->find_statements    = recontext_compact_find_statements;
+    factory->find_sources       = recontext_compact_find_sources;
+    factory->find_arcs          = recontext_compact_find_arcs;
+    factory->find_targets       = recontext_compact_find_targets;
+    factory->get_arcs_in        = recontext_compact_get_arcs_in;
+    factory->get_arcs_out       = recontext_compact_get_arcs_out;
+}
+
+int
+recontext_compact_register(librdf_world *world)
+{
+    return librdf_storage_register_factory(world, RECONTEXT_COMPACT_STORAGE,
+                                           "librecontext compact store",
+                                           recontext_compact_register_factory);
+}
+
+recontext_compact_store*
+recontext_compact_get(librdf_storage *storage)
+{
+    return STORE(storage);
+}
+
+/*
+ * Copy the triples of one compact store into another, working on term ids
+ * throughout. Each source term is interned into the target at most once.
+ * With a subject, only the triples about that subject are copied.
+ */
+void
+recontext_compact_copy(recontext_compact_store *to, recontext_compact_store *from,
+                       librdf_node *subject)
+{
+    const recontext_triple *t;
+    guint32 *map;
+    guint32 s = NO_TERM;
+    guint begin = 0, end, i;
+
+    if (to == from)
+        return;
+
+    recontext_compact_sort(from);
+    t = (const recontext_triple *) from->triples->data;
+    end = from->triples->len;
+
+    if (subject != NULL) {
+        s = recontext_compact_lookup(from, subject);
+        if (s == NO_TERM)
+            return;
+
+        begin = recontext_compact_lower_spo(from, s, NO_TERM);
+        for (end = begin; end < from->triples->len && t[end].s == s; end++)
+            ;
+    }
+
+    map = g_new(guint32, from->terms->len);
+    memset(map, 0xff, from->terms->len * sizeof(guint32));
+
+    for (i = begin; i < end; i++) {
+        guint32 ids[3] = { t[i].s, t[i].p, t[i].o };
+        int k;
+
+        for (k = 0; k < 3; k++) {
+            if (map[ids[k]] == NO_TERM)
+                map[ids[k]] = recontext_compact_intern(to, g_ptr_array_index(from->terms, ids[k]));
+            ids[k] = map[ids[k]];
+        }
+
+        recontext_compact_append(to, ids[0], ids[1], ids[2]);
+    }
+
+    g_free(map);
+}
+
+/* drop every triple about a subject */
+void
+recontext_compact_remove_subject(recontext_compact_store *store, librdf_node *subject)
+{
+    const recontext_triple *t;
+    guint32 s;
+    guint begin, end;
+
+    s = recontext_compact_lookup(store, subject);
+    if (s == NO_TERM)
+        return;
+
+    recontext_compact_sort(store);
+    t = (const recontext_triple *) store->triples->data;
+
+    begin = recontext_compact_lower_spo(store, s, NO_TERM);
+    for (end = begin; end < store->triples->len && t[end].s == s; end++)
+        ;
+
+    g_array_remove_range(store->triples, begin, end - begin);
+    store->sorted = store->triples->len;
+    store->pos_valid = FALSE;
+}
+
+/* call func once for every distinct predicate, in id order */
+void
+recontext_compact_foreach_predicate(recontext_compact_store *store, GFunc func, gpointer user_data)
+{
+    const recontext_triple *t;
+    const guint32 *pos;
+    guint32 last = NO_TERM;
+    guint i;
+
+    recontext_compact_index_pos(store);
+    t = (const recontext_triple *) store->triples->data;
+    pos = (const guint32 *) store->pos->data;
+
+    for (i = 0; i < store->pos->len; i++) {
+        guint32 p = t[pos[i]].p;
+
+        if (p != last)
+            func(g_ptr_array_index(store->terms, p), user_data);
+        last = p;
+    }
+}
@@ -0,0 +1,336 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "recontext.h"
+#include "recontext_private.h"
+
+/*
+ * Graph comparison without serializing. Every statement is reduced to a
+ * 64-bit hash of its nodes, with blank nodes labeled by their
+ * surroundings instead of their parser-assigned identifiers: starting
+ * from one color for all, each round rehashes a blank node's color with
+ * the sorted colors of its arcs, until the rounds stop splitting blank
+ * nodes apart. The labels then depend only on the graph, so equal graphs
+ * give equal statement hashes whatever their order and blank labels.
+ */
+
+#define BLANK_MARK 0x9e3779b97f4a7c15ull
+
+typedef struct {
+    librdf_statement *statement;
+    guint64           terms[3];     /* hashes of the node keys */
+    gint              blanks[3];    /* blank node index, -1 for others */
+} recontext_labeled_triple;
+
+typedef struct {
+    GArray  *triples;
+    guint64 *colors;
+    guint    n_blanks;
+    guint64 *hashes;                /* per statement, in triple order */
+} recontext_labeling;
+
+typedef struct {
+    guint   node;
+    guint64 value;
+} recontext_arc;
+
+static guint64
+recontext_mix(guint64 a, guint64 b, guint64 c)
+{
+    guint64 words[3] = { a, b, c };
+
+    return recontext_hash64(words, sizeof(words), 0);
+}
+
+static guint64
+recontext_term(recontext_labeling *labeling, recontext_labeled_triple *triple, int i)
+{
+    if (triple->blanks[i] < 0)
+        return triple->terms[i];
+    return labeling->colors[triple->blanks[i]] ^ BLANK_MARK;
+}
+
+static gint
+recontext_compare_hashes(gconstpointer a, gconstpointer b)
+{
+    guint64 x = *(const guint64 *) a;
+    guint64 y = *(const guint64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static gint
+recontext_compare_arcs(gconstpointer a, gconstpointer b)
+{
+    const recontext_arc *x = a;
+    const recontext_arc *y = b;
+
+    if (x->node != y->node)
+        return x->node < y->node ? -1 : 1;
+    return recontext_compare_hashes(&x->value, &y->value);
+}
+
+static guint
+recontext_count_colors(const guint64 *colors, guint n)
+{
+    guint64 *sorted;
+    guint count = 0;
+    guint i;
+
+    sorted = g_new(guint64, n);
+    memcpy(sorted, colors, n * sizeof(guint64));
+    qsort(sorted, n, sizeof(guint64), recontext_compare_hashes);
+
+    for (i = 0; i < n; i++) {
+        if (i == 0 || sorted[i] != sorted[i - 1])
+            count++;
+    }
+
+    g_free(sorted);
+    return count;
+}
+
+static void
+recontext_labeling_refine(recontext_labeling *labeling)
+{
+    GArray *arcs;
+    guint classes = labeling->n_blanks > 0;
+    guint round;
+    guint i;
+
+    arcs = g_array_new(FALSE, FALSE, sizeof(recontext_arc));
+
+    // the partition can only get finer, so it settles within n rounds
+    for (round = 0; round < labeling->n_blanks; round++) {
+        guint64 *next;
+        guint count;
+
+        g_array_set_size(arcs, 0);
+
+        for (i = 0; i < labeling->triples->len; i++) {
+            recontext_labeled_triple *triple =
+                &g_array_index(labeling->triples, recontext_labeled_triple, i);
+            recontext_arc arc;
+
+            if (triple->blanks[0] >= 0) {
+                arc.node = triple->blanks[0];
+                arc.value = recontext_mix(1, triple->terms[1], recontext_term(labeling, triple, 2));
+                g_array_append_val(arcs, arc);
+            }
+            if (triple->blanks[2] >= 0) {
+                arc.node = triple->blanks[2];
+                arc.value = recontext_mix(2, triple->terms[1], recontext_term(labeling, triple, 0));
+                g_array_append_val(arcs, arc);
+            }
+        }
+
+        g_array_sort(arcs, recontext_compare_arcs);
+
+        next = g_new(guint64, labeling->n_blanks);
+        memcpy(next, labeling->colors, labeling->n_blanks * sizeof(guint64));
+        for (i = 0; i < arcs->len; i++) {
+            recontext_arc *arc = &g_array_index(arcs, recontext_arc, i);
+
+            next[arc->node] = recontext_mix(3, next[arc->node], arc->value);
+        }
+
+        g_free(labeling->colors);
+        labeling->colors = next;
+
+        count = recontext_count_colors(next, labeling->n_blanks);
+        if (count == classes)
+            break;
+        classes = count;
+    }
+
+    g_array_free(arcs, TRUE);
+}
+
+static void
+recontext_labeling_init(recontext_labeling *labeling, recontext *rc)
+{
+    GHashTable *blanks;
+    librdf_stream *stream;
+    guint i;
+
+    blanks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    labeling->triples = g_array_new(FALSE, FALSE, sizeof(recontext_labeled_triple));
+
+    stream = librdf_model_as_stream(rc->model);
+    while (!librdf_stream_end(stream)) {
+        librdf_statement *statement = librdf_stream_get_object(stream);
+        librdf_node *nodes[3];
+        recontext_labeled_triple triple;
+        int j;
+
+        nodes[0] = librdf_statement_get_subject(statement);
+        nodes[1] = librdf_statement_get_predicate(statement);
+        nodes[2] = librdf_statement_get_object(statement);
+
+        triple.statement = librdf_new_statement_from_statement(statement);
+
+        for (j = 0; j < 3; j++) {
+            gchar *key = recontext_node_key(nodes[j]);
+            gpointer index;
+
+            triple.terms[j] = recontext_hash64(key, strlen(key), 0);
+            triple.blanks[j] = -1;
+
+            if (key[0] != 'B') {
+                g_free(key);
+                continue;
+            }
+
+            index = g_hash_table_lookup(blanks, key);
+            if (index == NULL) {
+                index = GUINT_TO_POINTER(g_hash_table_size(blanks) + 1);
+                g_hash_table_insert(blanks, key, index);
+            } else {
+                g_free(key);
+            }
+            triple.blanks[j] = GPOINTER_TO_UINT(index) - 1;
+        }
+
+        g_array_append_val(labeling->triples, triple);
+        librdf_stream_next(stream);
+    }
+    librdf_free_stream(stream);
+
+    labeling->n_blanks = g_hash_table_size(blanks);
+    labeling->colors = g_new0(guint64, labeling->n_blanks);
+    g_hash_table_destroy(blanks);
+
+    recontext_labeling_refine(labeling);
+
+    labeling->hashes = g_new(guint64, labeling->triples->len);
+    for (i = 0; i < labeling->triples->len; i++) {
+        recontext_labeled_triple *triple =
+            &g_array_index(labeling->triples, recontext_labeled_triple, i);
+
+        labeling->hashes[i] = recontext_mix(recontext_term(labeling, triple, 0), triple->terms[1],
+                                            recontext_term(labeling, triple, 2));
+    }
+}
+
+static void
+recontext_labeling_clear(recontext_labeling *labeling)
+{
+    guint i;
+
+    for (i = 0; i < labeling->triples->len; i++) {
+        recontext_labeled_triple *triple =
+            &g_array_index(labeling->triples, recontext_labeled_triple, i);
+
+        librdf_free_statement(triple->statement);
+    }
+
+    g_array_free(labeling->triples, TRUE);
+    g_free(labeling->colors);
+    g_free(labeling->hashes);
+}
+
+char*
+recontext_hash(recontext *rc)
+{
+    recontext_labeling labeling;
+    GChecksum *checksum;
+    guint i;
+    char *digest;
+
+    recontext_labeling_init(&labeling, rc);
+    qsort(labeling.hashes, labeling.triples->len, sizeof(guint64), recontext_compare_hashes);
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    for (i = 0; i < labeling.triples->len; i++) {
+        guint64 word = GUINT64_TO_LE(labeling.hashes[i]);
+
+        // statements that only differed in their blank labels count once
+        if (i > 0 && labeling.hashes[i] == labeling.hashes[i - 1])
+            continue;
+        g_checksum_update(checksum, (const guchar *) &word, sizeof(word));
+    }
+
+    digest = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    recontext_labeling_clear(&labeling);
+
+    return digest;
+}
+
+/* the statements of one graph whose hash the other lacks */
+static size_t
+recontext_diff_missing(recontext_labeling *from, GHashTable *present, recontext *into)
+{
+    size_t count = 0;
+    guint i;
+
+    for (i = 0; i < from->triples->len; i++) {
+        if (g_hash_table_contains(present, &from->hashes[i]))
+            continue;
+
+        count++;
+        if (into != NULL)
+            librdf_model_add_statement(into->model,
+                g_array_index(from->triples, recontext_labeled_triple, i).statement);
+    }
+
+    if (into != NULL && count > 0)
+        recontext_changed(into, NULL);
+
+    return count;
+}
+
+static GHashTable*
+recontext_diff_index(recontext_labeling *labeling)
+{
+    GHashTable *index;
+    guint i;
+
+    index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (i = 0; i < labeling->triples->len; i++)
+        g_hash_table_add(index, &labeling->hashes[i]);
+
+    return index;
+}
+
+size_t
+recontext_diff(recontext *from, recontext *to, recontext **added, recontext **removed)
+{
+    recontext_labeling old_graph;
+    recontext_labeling new_graph;
+    GHashTable *old_index;
+    GHashTable *new_index;
+    size_t count;
+
+    recontext_labeling_init(&old_graph, from);
+    recontext_labeling_init(&new_graph, to);
+    old_index = recontext_diff_index(&old_graph);
+    new_index = recontext_diff_index(&new_graph);
+
+    if (added != NULL)
+        *added = recontext_new_in_ctx(to->ctx, to->main_subject, RECONTEXT_STORAGE_DEFAULT);
+    if (removed != NULL)
+        *removed = recontext_new_in_ctx(from->ctx, from->main_subject,
+                                        RECONTEXT_STORAGE_DEFAULT);
+
+    count = recontext_diff_missing(&new_graph, old_index, added ? *added : NULL);
+    count += recontext_diff_missing(&old_graph, new_index, removed ? *removed : NULL);
+
+    g_hash_table_destroy(new_index);
+    g_hash_table_destroy(old_index);
+    recontext_labeling_clear(&new_graph);
+    recontext_labeling_clear(&old_graph);
+
+    return count;
+}
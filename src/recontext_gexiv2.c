@@ -8,210 +8,460 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "recontext.h"
 #include "recontext_gexiv2.h"
+#include "recontext_media.h"
+#include "recontext_private.h"
+
+#define DC_NS       "http://purl.org/dc/elements/1.1/"
+#define DCTERMS_NS  "http://purl.org/dc/terms/"
+#define CC_NS       "http://creativecommons.org/ns#"
+#define XHV_NS      "http://www.w3.org/1999/xhtml/vocab#"
+#define XMPRIGHTS_NS "http://ns.adobe.com/xap/1.0/rights/"
+
+const recontext_xmp_mapping recontext_xmp_default_mappings[] = {
+    { "Xmp.dc.title",       RECONTEXT_XMP_LANG_ALT, { DC_NS "title", DCTERMS_NS "title" } },
+    { "Xmp.dc.description", RECONTEXT_XMP_LANG_ALT, { DC_NS "description", DCTERMS_NS "description" } },
+    { "Xmp.dc.rights",      RECONTEXT_XMP_LANG_ALT, { DC_NS "rights", DCTERMS_NS "rights" } },
+    { "Xmp.dc.creator",     RECONTEXT_XMP_SEQ,      { DC_NS "creator", DCTERMS_NS "creator" } },
+    { "Xmp.dc.contributor", RECONTEXT_XMP_BAG,      { DC_NS "contributor", DCTERMS_NS "contributor" } },
+    { "Xmp.dc.publisher",   RECONTEXT_XMP_BAG,      { DC_NS "publisher", DCTERMS_NS "publisher" } },
+    { "Xmp.dc.subject",     RECONTEXT_XMP_BAG,      { DC_NS "subject", DCTERMS_NS "subject" } },
+    { "Xmp.dc.date",        RECONTEXT_XMP_SEQ,      { DC_NS "date", DCTERMS_NS "date", DCTERMS_NS "created" } },
+    { "Xmp.dc.type",        RECONTEXT_XMP_BAG,      { DC_NS "type", DCTERMS_NS "type" } },
+    { "Xmp.dc.language",    RECONTEXT_XMP_BAG,      { DC_NS "language", DCTERMS_NS "language" } },
+    { "Xmp.dc.relation",    RECONTEXT_XMP_BAG,      { DC_NS "relation", DCTERMS_NS "relation" } },
+    { "Xmp.dc.source",      RECONTEXT_XMP_BAG,      { DC_NS "source", DCTERMS_NS "source" } },
+    { "Xmp.dc.identifier",  RECONTEXT_XMP_TEXT,     { DC_NS "identifier", DCTERMS_NS "identifier" } },
+    { "Xmp.dc.format",      RECONTEXT_XMP_TEXT,     { DC_NS "format", DCTERMS_NS "format" } },
+    { "Xmp.dc.coverage",    RECONTEXT_XMP_TEXT,     { DC_NS "coverage", DCTERMS_NS "coverage" } },
+
+    { "Xmp.xmpRights.Marked",       RECONTEXT_XMP_TEXT,     { XMPRIGHTS_NS "Marked" } },
+    { "Xmp.xmpRights.Owner",        RECONTEXT_XMP_BAG,      { XMPRIGHTS_NS "Owner" } },
+    { "Xmp.xmpRights.UsageTerms",   RECONTEXT_XMP_LANG_ALT, { XMPRIGHTS_NS "UsageTerms" } },
+    { "Xmp.xmpRights.WebStatement", RECONTEXT_XMP_TEXT,     { XMPRIGHTS_NS "WebStatement" } },
+
+    { "Xmp.cc.license",         RECONTEXT_XMP_TEXT, { CC_NS "license", XHV_NS "license", DCTERMS_NS "license" } },
+    { "Xmp.cc.attributionName", RECONTEXT_XMP_TEXT, { CC_NS "attributionName" } },
+    { "Xmp.cc.attributionURL",  RECONTEXT_XMP_TEXT, { CC_NS "attributionURL" } },
+    { "Xmp.cc.morePermissions", RECONTEXT_XMP_TEXT, { CC_NS "morePermissions" } },
+    { "Xmp.cc.useGuidelines",   RECONTEXT_XMP_TEXT, { CC_NS "useGuidelines" } },
+
+    { NULL }
+};
+
+/*
+ * Exiv2 only parses XMP safely from several threads once initialized, so
+ * code calling gexiv2 off the main thread goes through here first.
+ */
+void
+recontext_gexiv2_init(void)
+{
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        gexiv2_initialize();
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
+/* one gathered value of a tag, with what it takes to order it */
+typedef struct {
+    guint  rank;                    /* index of the predicate in the mapping */
+    guint  order;                   /* position it was found in */
+    gchar *lang;                    /* literal language, NULL for none */
+    gchar *text;
+} recontext_xmp_value;
+
+static void
+recontext_xmp_value_clear(gpointer data)
+{
+    recontext_xmp_value *value = data;
+
+    g_free(value->lang);
+    g_free(value->text);
+}
+
+/*
+ * Earlier predicates of a mapping come first. Sequences keep the order
+ * the values were found in, everything else is ordered by language and
+ * text so the outcome does not depend on how the store iterates.
+ */
+static gint
+recontext_compare_xmp_values(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const recontext_xmp_value *x = a;
+    const recontext_xmp_value *y = b;
+    const recontext_xmp_mapping *mapping = user_data;
+    gint result;
+
+    if (mapping->type == RECONTEXT_XMP_LANG_ALT &&
+        (result = g_strcmp0(x->lang, y->lang)) != 0)
+        return result;
+
+    if (x->rank != y->rank)
+        return x->rank < y->rank ? -1 : 1;
+
+    if (mapping->type != RECONTEXT_XMP_SEQ && (result = strcmp(x->text, y->text)) != 0)
+        return result;
+
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void
+recontext_xmp_add_node(GArray *values, guint rank, librdf_node *node)
+{
+    recontext_xmp_value value;
+    const char *lang;
+
+    value.rank = rank;
+    value.order = values->len;
+    value.lang = NULL;
+
+    if (librdf_node_is_literal(node)) {
+        value.text = g_strdup((const gchar *) librdf_node_get_literal_value(node));
+        lang = librdf_node_get_literal_value_language(node);
+        if (lang != NULL && lang[0] != '\0')
+            value.lang = g_strdup(lang);
+    } else if (librdf_node_is_resource(node)) {
+        value.text = g_strdup((const gchar *) librdf_uri_as_string(librdf_node_get_uri(node)));
+    } else {
+        return;
+    }
+
+    g_array_append_val(values, value);
+}
+
+static void
+recontext_xmp_add_object(recontext *rc, const recontext_xmp_mapping *mapping, GArray *values,
+                         guint rank, librdf_node *object)
+{
+    GPtrArray *members;
+    guint i;
+
+    if (!librdf_node_is_blank(object)) {
+        recontext_xmp_add_node(values, rank, object);
+        return;
+    }
+
+    // every alternative of a language alternative can keep its language
+    members = g_ptr_array_new_with_free_func((GDestroyNotify) librdf_free_node);
+    recontext_add_container_members(rc, object, mapping->type == RECONTEXT_XMP_LANG_ALT, members);
+
+    for (i = 0; i < members->len; i++)
+        recontext_xmp_add_node(values, rank, g_ptr_array_index(members, i));
+
+    g_ptr_array_free(members, TRUE);
+}
+
+/*
+ * Exiv2 only appends repeated values to tags it knows as arrays. Any
+ * other tag, such as dc:source which XMP declares a simple property, is
+ * written as an explicit array of indexed items instead.
+ */
+static void
+recontext_metadata_set_array(GExiv2Metadata *metadata, const recontext_xmp_mapping *mapping,
+                             GPtrArray *texts)
+{
+    const gchar *type = gexiv2_metadata_get_tag_type(mapping->tagname);
+    gboolean bag = mapping->type == RECONTEXT_XMP_BAG;
+    guint i;
+
+    if (g_strcmp0(type, bag ? "XmpBag" : "XmpSeq") == 0) {
+        g_ptr_array_add(texts, NULL);
+        gexiv2_metadata_set_tag_multiple(metadata, mapping->tagname, (const gchar **) texts->pdata);
+        return;
+    }
+
+    gexiv2_metadata_clear_tag(metadata, mapping->tagname);
+    gexiv2_metadata_set_xmp_tag_struct(metadata, mapping->tagname,
+                                       bag ? GEXIV2_STRUCTURE_XA_BAG : GEXIV2_STRUCTURE_XA_SEQ);
+
+    for (i = 0; i < texts->len; i++) {
+        gchar *item = g_strdup_printf("%s[%u]", mapping->tagname, i + 1);
+        gexiv2_metadata_set_tag_string(metadata, item, g_ptr_array_index(texts, i));
+        g_free(item);
+    }
+}
+
+/* drop a tag along with any indexed items written for it */
+static void
+recontext_metadata_clear_array(GExiv2Metadata *metadata, const char *tagname)
+{
+    guint i;
+
+    gexiv2_metadata_clear_tag(metadata, tagname);
+
+    for (i = 1; ; i++) {
+        gchar *item = g_strdup_printf("%s[%u]", tagname, i);
+        gboolean cleared = gexiv2_metadata_clear_tag(metadata, item);
+
+        g_free(item);
+        if (!cleared)
+            break;
+    }
+}
 
 static void
-recontext_metadata_append_tag_value(GExiv2Metadata *metadata, const gchar *tagname, gchar *value)
+recontext_metadata_set_tag_values(GExiv2Metadata *metadata, const recontext_xmp_mapping *mapping,
+                                  GArray *values)
 {
-    gchar** values;
-    gchar** temp;
-    guint length = 1;
+    GPtrArray *texts;
     guint i;
 
-    values = gexiv2_metadata_get_tag_multiple(metadata, tagname);
-    while (values[length - 1] != NULL) length++;
+    g_array_sort_with_data(values, recontext_compare_xmp_values, (gpointer) mapping);
+
+    if (mapping->type == RECONTEXT_XMP_TEXT) {
+        gexiv2_metadata_set_tag_string(metadata, mapping->tagname,
+                                       g_array_index(values, recontext_xmp_value, 0).text);
+        return;
+    }
 
-    temp = g_new (gchar*, length + 1);
+    texts = g_ptr_array_new_with_free_func(g_free);
 
-    for (i = 0; i < length + 1; i++) {
-        temp[i] = values[i];
+    for (i = 0; i < values->len; i++) {
+        recontext_xmp_value *value = &g_array_index(values, recontext_xmp_value, i);
+
+        if (mapping->type != RECONTEXT_XMP_LANG_ALT) {
+            g_ptr_array_add(texts, g_strdup(value->text));
+            continue;
+        }
+
+        // sorted by language, so the first value of each language wins
+        if (i > 0 && g_strcmp0(value->lang,
+                         g_array_index(values, recontext_xmp_value, i - 1).lang) == 0)
+            continue;
+
+        g_ptr_array_add(texts, g_strdup_printf("lang=\"%s\" %s",
+                                               value->lang ? value->lang : "x-default",
+                                               value->text));
     }
 
-    temp[length - 1] = g_strdup(value);
-    temp[length] = NULL;
+    if (mapping->type == RECONTEXT_XMP_LANG_ALT) {
+        g_ptr_array_add(texts, NULL);
+        gexiv2_metadata_set_tag_multiple(metadata, mapping->tagname, (const gchar **) texts->pdata);
+    } else {
+        recontext_metadata_set_array(metadata, mapping, texts);
+    }
 
-    gexiv2_metadata_set_tag_multiple(metadata, tagname, (const gchar **) temp);
+    g_ptr_array_free(texts, TRUE);
 }
 
+/*
+ * What a metadata object was last synced from, attached to the object
+ * itself so the record goes away with it.
+ */
+typedef struct {
+    guint64                      serial;
+    gsize                        generation;
+    const recontext_xmp_mapping *mappings;
+    gboolean                    *written;       /* per mapping, set by us */
+} recontext_xmp_sync;
+
+static void
+recontext_xmp_sync_free(gpointer data)
+{
+    recontext_xmp_sync *sync = data;
+
+    g_free(sync->written);
+    g_free(sync);
+}
+
+static GQuark
+recontext_xmp_sync_quark(void)
+{
+    return g_quark_from_static_string("recontext-xmp-sync");
+}
+
+static gboolean
+recontext_mapping_changed(recontext *rc, const recontext_xmp_mapping *mapping, gsize since)
+{
+    int j;
+
+    // values may come from containers, whose members change separately
+    if (rc->priv->containers_changed > since)
+        return TRUE;
+
+    for (j = 0; mapping->predicates[j] != NULL; j++) {
+        if (recontext_changed_since(rc, mapping->predicates[j], since))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Fill the mapped tags from a single pass over the statements about the
+ * main subject. Values are gathered per tag and each tag is written
+ * exactly once. Tags the graph has no values for are left alone, so the
+ * rest of the file's metadata survives.
+ *
+ * Writing the same recontext into the same metadata object again only
+ * touches the tags whose predicates changed in between, and skips the
+ * scan altogether when nothing did. A tag written before that has lost
+ * all its values is cleared then. Tags changed behind the writer's back
+ * in the meantime are not restored.
+ */
 void
-recontext_write_exiv2(recontext *rc, GExiv2Metadata *metadata)
+recontext_write_exiv2_mapped(recontext *rc, GExiv2Metadata *metadata,
+                             const recontext_xmp_mapping *mappings)
 {
-    gchar *source_query_string = \
-        "PREFIX dc: <http://purl.org/dc/elements/1.1/>                  "
-        "PREFIX dcterms: <http://purl.org/dc/terms/>                    "
-        "PREFIX rdf: <http://www.w3.org/1999/02/22-rdf-syntax-ns#>      "
-        "SELECT ?subject ?label WHERE {                                 "
-        "    {                                                          "
-        "        { ?subject dc:source ?label . }                        "
-        "        UNION                                                  "
-        "        { ?subject dcterms:source ?label . }                   "
-        "        FILTER(isLiteral(?label) || isURI(?label))             "
-        "    }                                                          "
-        "    UNION                                                      "
-        "    {                                                          "
-        "        { ?subject dc:source ?node . }                         "
-        "        UNION                                                  "
-        "        { ?subject dcterms:source ?node . }                    "
-        "        FILTER(isBlank(?node))                                 "
-        "        ?node a rdf:Alt .                                      "
-        "        {                                                      "
-        "            SELECT ?label WHERE {                              "
-        "                ?node rdf:_1 ?label .                          "
-        "                FILTER(isLiteral(?label) || isURI(?label))     "
-        "            }                                                  "
-        "        }                                                      "
-        "    }                                                          "
-        "    UNION                                                      "
-        "    {                                                          "
-        "        { ?subject dc:source ?node . }                         "
-        "        UNION                                                  "
-        "        { ?subject dcterms:source ?node . }                    "
-        "        FILTER(isBlank(?node))                                 "
-        "        ?node a rdf:Seq .                                      "
-        "        {                                                      "
-        "            SELECT ?label WHERE {                              "
-        "                ?node ?pred ?label                             "
-        "                FILTER(isLiteral(?label) || isURI(?label))     "
-        "                FILTER(?label != rdf:Seq)                      "
-        "            }                                                  "
-        "        }                                                      "
-        "    }                                                          "
-        "    UNION                                                      "
-        "    {                                                          "
-        "        { ?subject dc:source ?node . }                         "
-        "        UNION                                                  "
-        "        { ?subject dcterms:source ?node . }                    "
-        "        FILTER(isBlank(?node))                                 "
-        "        ?node a rdf:Bag .                                      "
-        "        {                                                      "
-        "            SELECT ?label WHERE {                              "
-        "                ?node ?pred ?label                             "
-        "                FILTER(isLiteral(?label) || isURI(?label))     "
-        "                FILTER(?label != rdf:Bag)                      "
-        "            }                                                  "
-        "        }                                                      "
-        "    }                                                          "
-        "}                                                              ";
-
-    gchar *creator_query_string = \
-        "PREFIX dc: <http://purl.org/dc/elements/1.1/>                  "
-        "PREFIX dcterms: <http://purl.org/dc/terms/>                    "
-        "PREFIX rdf: <http://www.w3.org/1999/02/22-rdf-syntax-ns#>      "
-        "SELECT ?subject ?label WHERE {                                 "
-        "    {                                                          "
-        "        { ?subject dc:creator ?label . }                       "
-        "        UNION                                                  "
-        "        { ?subject dcterms:creator ?label . }                  "
-        "        FILTER(isLiteral(?label) || isURI(?label))             "
-        "    }                                                          "
-        "    UNION                                                      "
-        "    {                                                          "
-        "        { ?subject dc:creator ?node . }                        "
-        "        UNION                                                  "
-        "        { ?subject dcterms:creator ?node . }                   "
-        "        FILTER(isBlank(?node))                                 "
-        "        ?node a rdf:Alt .                                      "
-        "        {                                                      "
-        "            SELECT ?label WHERE {                              "
-        "                ?node rdf:_1 ?label .                          "
-        "                FILTER(isLiteral(?label) || isURI(?label))     "
-        "            }                                                  "
-        "        }                                                      "
-        "    }                                                          "
-        "    UNION                                                      "
-        "    {                                                          "
-        "        { ?subject dc:creator ?node . }                        "
-        "        UNION                                                  "
-        "        { ?subject dcterms:creator ?node . }                   "
-        "        FILTER(isBlank(?node))                                 "
-        "        ?node a rdf:Seq .                                      "
-        "        {                                                      "
-        "            SELECT ?label WHERE {                              "
-        "                ?node ?pred ?label                             "
-        "                FILTER(isLiteral(?label) || isURI(?label))     "
-        "                FILTER(?label != rdf:Seq)                      "
-        "            }                                                  "
-        "        }                                                      "
-        "    }                                                          "
-        "    UNION                                                      "
-        "    {                                                          "
-        "        { ?subject dc:creator ?node . }                        "
-        "        UNION                                                  "
-        "        { ?subject dcterms:creator ?node . }                   "
-        "        FILTER(isBlank(?node))                                 "
-        "        ?node a rdf:Bag .                                      "
-        "        {                                                      "
-        "            SELECT ?label WHERE {                              "
-        "                ?node ?pred ?label                             "
-        "                FILTER(isLiteral(?label) || isURI(?label))     "
-        "                FILTER(?label != rdf:Bag)                      "
-        "            }                                                  "
-        "        }                                                      "
-        "    }                                                          "
-        "}                                                              ";
-
-    librdf_query *query;
-    librdf_query_results *results;
-
-    // iterate through sources
-    gexiv2_metadata_clear_tag(metadata, "Xmp.dc.source");
-
-    query = librdf_new_query(rc->world, "sparql", NULL,
-                             (const unsigned char *) source_query_string, NULL);
-    results = librdf_model_query_execute(rc->model, query);
-
-    while (!librdf_query_results_finished(results))
-    {
-        librdf_node *node = librdf_query_results_get_binding_value_by_name(results, "label");
-        gchar *value = NULL;
-
-        if (librdf_node_is_literal(node))
-            value = g_strdup((const gchar *) librdf_node_get_literal_value(node));
-        else if (librdf_node_is_resource(node))
-            value = g_strdup((const gchar *) librdf_uri_as_string(librdf_node_get_uri(node)));
-        else if (librdf_node_is_blank(node))
-            g_printerr("shouldn't happen. blank nodes are omitted in the query\n");
-
-        if (value != NULL) {
-            recontext_metadata_append_tag_value(metadata, "Xmp.dc.source", value);
-            g_free(value);
+    recontext_xmp_sync *sync;
+    GHashTable    *by_predicate;
+    GArray       **values;
+    guint         *targets;
+    librdf_statement *query_statement;
+    librdf_stream *stream;
+    guint          n_mappings;
+    size_t         scanned = 0;
+    gboolean       full;
+    gsize          since = 0;
+    guint64        start;
+    guint          i;
+    int            j;
+
+    start = RECONTEXT_OP_BEGIN(RECONTEXT_OP_WRITE_EXIV2);
+
+    sync = g_object_get_qdata(G_OBJECT(metadata), recontext_xmp_sync_quark());
+    full = sync == NULL || sync->serial != rc->priv->serial || sync->mappings != mappings;
+
+    if (!full) {
+        since = sync->generation;
+
+        if (since == rc->priv->generation) {
+            RECONTEXT_OP_END(RECONTEXT_OP_WRITE_EXIV2, start, 0, 0);
+            return;
         }
+    }
+
+    for (n_mappings = 0; mappings[n_mappings].tagname != NULL; n_mappings++)
+        ;
 
-        librdf_query_results_next(results);
+    if (sync == NULL) {
+        sync = g_new0(recontext_xmp_sync, 1);
+        g_object_set_qdata_full(G_OBJECT(metadata), recontext_xmp_sync_quark(), sync,
+                                recontext_xmp_sync_free);
+    }
+    if (full) {
+        g_free(sync->written);
+        sync->written = g_new0(gboolean, n_mappings);
     }
 
-    librdf_free_query_results(results);
-    librdf_free_query(query);
+    // a target is the mapping index and predicate rank packed together
+    by_predicate = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                         (GDestroyNotify) g_slist_free);
+    values = g_new0(GArray *, n_mappings);
+    targets = g_new(guint, n_mappings * RECONTEXT_XMP_MAX_PREDICATES);
 
-    // iterate through creators
-    gexiv2_metadata_clear_tag(metadata,  "Xmp.dc.creator");
+    for (i = 0; i < n_mappings; i++) {
+        if (!full && !recontext_mapping_changed(rc, &mappings[i], since))
+            continue;
 
-    query = librdf_new_query(rc->world, "sparql", NULL,
-                             (const unsigned char *) creator_query_string, NULL);
-    results = librdf_model_query_execute(rc->model, query);
+        values[i] = g_array_new(FALSE, FALSE, sizeof(recontext_xmp_value));
+        g_array_set_clear_func(values[i], recontext_xmp_value_clear);
 
-    while (!librdf_query_results_finished(results))
-    {
-        librdf_node *node = librdf_query_results_get_binding_value_by_name(results, "label");
-        gchar *value = NULL;
+        for (j = 0; mappings[i].predicates[j] != NULL; j++) {
+            const char *predicate = mappings[i].predicates[j];
+            GSList *list = g_hash_table_lookup(by_predicate, predicate);
+            guint *target = &targets[i * RECONTEXT_XMP_MAX_PREDICATES + j];
 
-        if (librdf_node_is_literal(node))
-            value = g_strdup((const gchar *) librdf_node_get_literal_value(node));
-        else if (librdf_node_is_resource(node))
-            value = g_strdup((const gchar *) librdf_uri_as_string(librdf_node_get_uri(node)));
-        else if (librdf_node_is_blank(node))
-            g_printerr("shouldn't happen. blank nodes are omitted in the query\n");
+            *target = i * RECONTEXT_XMP_MAX_PREDICATES + j;
 
-        if (value != NULL) {
-            recontext_metadata_append_tag_value(metadata, "Xmp.dc.creator", value);
-            g_free(value);
+            // steal first so inserting the new head doesn't free the list
+            g_hash_table_steal(by_predicate, predicate);
+            g_hash_table_insert(by_predicate, (gpointer) predicate, g_slist_prepend(list, target));
         }
+    }
+
+    // only the asset itself, not the sources and ancestors merged into it
+    stream = NULL;
+    if (g_hash_table_size(by_predicate) > 0) {
+        query_statement = librdf_new_statement_from_nodes(rc->world,
+            librdf_new_node_from_uri(rc->world, rc->priv->base_uri), NULL, NULL);
+        stream = librdf_model_find_statements(rc->model, query_statement);
+        librdf_free_statement(query_statement);
+    }
+
+    while (stream != NULL && !librdf_stream_end(stream)) {
+        librdf_statement *statement = librdf_stream_get_object(stream);
+        librdf_node *pred = librdf_statement_get_predicate(statement);
+        librdf_node *object = librdf_statement_get_object(statement);
+        GSList *list;
+
+        list = g_hash_table_lookup(by_predicate, librdf_uri_as_string(librdf_node_get_uri(pred)));
+
+        for (; list != NULL; list = list->next) {
+            guint target = *(guint *) list->data;
+            guint index = target / RECONTEXT_XMP_MAX_PREDICATES;
+
+            recontext_xmp_add_object(rc, &mappings[index], values[index],
+                                     target % RECONTEXT_XMP_MAX_PREDICATES, object);
+        }
+
+        scanned++;
+        librdf_stream_next(stream);
+    }
+
+    if (stream != NULL)
+        librdf_free_stream(stream);
+
+    for (i = 0; i < n_mappings; i++) {
+        if (values[i] == NULL)
+            continue;
+
+        if (values[i]->len > 0) {
+            recontext_metadata_set_tag_values(metadata, &mappings[i], values[i]);
+            sync->written[i] = TRUE;
+        } else if (sync->written[i]) {
+            recontext_metadata_clear_array(metadata, mappings[i].tagname);
+            sync->written[i] = FALSE;
+        }
+
+        g_array_free(values[i], TRUE);
+    }
+
+    g_free(targets);
+    g_free(values);
+    g_hash_table_destroy(by_predicate);
+
+    sync->serial = rc->priv->serial;
+    sync->generation = rc->priv->generation;
+    sync->mappings = mappings;
+
+    RECONTEXT_OP_END(RECONTEXT_OP_WRITE_EXIV2, start, scanned, 0);
+}
+
+void
+recontext_write_exiv2(recontext *rc, GExiv2Metadata *metadata)
+{
+    recontext_write_exiv2_mapped(rc, metadata, recontext_xmp_default_mappings);
+}
+
+int
+recontext_save_xmp(recontext *rc, const char *filename)
+{
+    GExiv2Metadata *metadata;
+    gchar *packet;
+    int error = 1;
+
+    metadata = gexiv2_metadata_new();
+
+    if (gexiv2_metadata_open_path(metadata, filename, NULL)) {
+        recontext_write_exiv2(rc, metadata);
 
-        librdf_query_results_next(results);
+        // the merged packet goes in place when the old one has room, and
+        // exiv2 rewrites the file otherwise, with the same result either way
+        packet = gexiv2_metadata_get_xmp_packet(metadata);
+        if (packet != NULL && recontext_write_xmp_packet_in_place(filename, packet,
+                                                                  strlen(packet)) == 0)
+            error = 0;
+        else
+            error = !gexiv2_metadata_save_file(metadata, filename, NULL);
+        g_free(packet);
     }
 
-    librdf_free_query_results(results);
-    librdf_free_query(query);
+    g_object_unref(metadata);
+    return error;
 }
@@ -13,6 +13,43 @@
 #include "recontext.h"
 #include <gexiv2.h>
 
+#define RECONTEXT_XMP_MAX_PREDICATES 4
+
+typedef enum {
+    RECONTEXT_XMP_TEXT,     /* simple property, first value wins */
+    RECONTEXT_XMP_BAG,      /* unordered array */
+    RECONTEXT_XMP_SEQ,      /* ordered array */
+    RECONTEXT_XMP_LANG_ALT  /* language alternative, untagged values as x-default */
+} recontext_xmp_type;
+
+/*
+ * Maps a set of RDF predicates onto one Exiv2 XMP tag. Tables are
+ * terminated by an entry with a NULL tagname. Only statements about the
+ * main subject are mapped. Where one value is kept, the first predicate
+ * with values wins, and among its values the one sorting first.
+ */
+typedef struct {
+    const char         *tagname;
+    recontext_xmp_type  type;
+    const char         *predicates[RECONTEXT_XMP_MAX_PREDICATES + 1];
+} recontext_xmp_mapping;
+
+extern const recontext_xmp_mapping recontext_xmp_default_mappings[];
+
+/*
+ * Writes into a metadata object are remembered on the object, and writing
+ * the same recontext into it again only updates the tags whose predicates
+ * changed since. Use a fresh object for each file opened.
+ */
 void recontext_write_exiv2(recontext *rc, GExiv2Metadata *metadata);
+void recontext_write_exiv2_mapped(recontext *rc, GExiv2Metadata *metadata,
+                                  const recontext_xmp_mapping *mappings);
+
+/*
+ * Save rc into a media file, merging the mapped tags into its existing
+ * XMP. The merged packet overwrites the old one in place when it has
+ * room, otherwise exiv2 rewrites the file in full.
+ */
+int  recontext_save_xmp(recontext *rc, const char *filename);
 
 #endif /* __RECONTEXT_GEXIV2_H__ */
@@ -0,0 +1,612 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <glib.h>
+
+#include "recontext.h"
+#include "recontext_media.h"
+
+#define XMP_JPEG_NAMESPACE  "http://ns.adobe.com/xap/1.0/"
+#define XMP_PNG_KEYWORD     "XML:com.adobe.xmp"
+#define XMP_TIFF_TAG        700
+
+static const guint8 xmp_bmff_uuid[16] = {
+    0xbe, 0x7a, 0xcf, 0xcb, 0x97, 0xa9, 0x42, 0xe8,
+    0x9c, 0x71, 0x99, 0x94, 0x91, 0xe3, 0xaf, 0xac
+};
+
+static guint16
+read_u16(const guint8 *p, int little)
+{
+    return little ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static guint32
+read_u32(const guint8 *p, int little)
+{
+    return little ? (guint32) p[0] | (guint32) p[1] << 8 | (guint32) p[2] << 16 | (guint32) p[3] << 24
+                  : (guint32) p[0] << 24 | (guint32) p[1] << 16 | (guint32) p[2] << 8 | (guint32) p[3];
+}
+
+static guint64
+read_u64(const guint8 *p)
+{
+    return (guint64) read_u32(p, 0) << 32 | read_u32(p + 4, 0);
+}
+
+/*
+ * JPEG: walk the marker segments up to the start of scan and pick the
+ * APP1 segment carrying the XMP namespace signature.
+ */
+static int
+locate_jpeg(const guint8 *data, size_t length, size_t *offset, size_t *xmp_length)
+{
+    const size_t signature = sizeof(XMP_JPEG_NAMESPACE);
+    size_t pos = 2;
+
+    while (pos + 4 <= length) {
+        guint8 marker;
+        size_t segment;
+
+        if (data[pos] != 0xff)
+            return 0;
+
+        marker = data[pos + 1];
+
+        // fill bytes and standalone markers carry no length
+        if (marker == 0xff) {
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) {
+            pos += 2;
+            continue;
+        }
+
+        // start of scan or end of image: entropy-coded data follows
+        if (marker == 0xda || marker == 0xd9)
+            return 0;
+
+        segment = read_u16(data + pos + 2, 0);
+        if (segment < 2 || segment > length - pos - 2)
+            return 0;
+
+        if (marker == 0xe1 && segment - 2 > signature &&
+            memcmp(data + pos + 4, XMP_JPEG_NAMESPACE, signature) == 0) {
+            *offset = pos + 4 + signature;
+            *xmp_length = segment - 2 - signature;
+            return 1;
+        }
+
+        pos += 2 + segment;
+    }
+
+    return 0;
+}
+
+/*
+ * PNG: walk the chunk list, skipping IDAT payloads by their length, and
+ * pick the uncompressed iTXt chunk with the XMP keyword.
+ */
+static int
+locate_png(const guint8 *data, size_t length, size_t *offset, size_t *xmp_length)
+{
+    const size_t keyword = sizeof(XMP_PNG_KEYWORD);
+    size_t pos = 8;
+
+    while (pos + 12 <= length) {
+        size_t chunk = read_u32(data + pos, 0);
+        const guint8 *type = data + pos + 4;
+        const guint8 *text = data + pos + 8;
+
+        if (chunk > length - pos - 12)
+            return 0;
+
+        if (memcmp(type, "iTXt", 4) == 0 && chunk > keyword + 2 &&
+            memcmp(text, XMP_PNG_KEYWORD, keyword) == 0) {
+            const guint8 *end = text + chunk;
+            const guint8 *p;
+
+            // compressed XMP cannot be parsed in place
+            if (text[keyword] != 0)
+                return 0;
+
+            // skip compression method, language tag and translated keyword
+            p = text + keyword + 2;
+            p = memchr(p, 0, end - p);
+            if (p == NULL)
+                return 0;
+            p = memchr(p + 1, 0, end - p - 1);
+            if (p == NULL)
+                return 0;
+            p++;
+
+            *offset = p - data;
+            *xmp_length = end - p;
+            return 1;
+        }
+
+        if (memcmp(type, "IEND", 4) == 0)
+            return 0;
+
+        pos += 12 + chunk;
+    }
+
+    return 0;
+}
+
+/*
+ * TIFF (and TIFF-based raw formats): look up tag 700 in the first IFD.
+ */
+static int
+locate_tiff(const guint8 *data, size_t length, size_t *offset, size_t *xmp_length)
+{
+    int little = data[0] == 'I';
+    size_t ifd;
+    size_t count;
+    size_t i;
+
+    ifd = read_u32(data + 4, little);
+    if (ifd > length || length - ifd < 2)
+        return 0;
+
+    count = read_u16(data + ifd, little);
+    if (count > (length - ifd - 2) / 12)
+        return 0;
+
+    for (i = 0; i < count; i++) {
+        const guint8 *entry = data + ifd + 2 + i * 12;
+        guint16 type;
+        size_t size;
+        size_t value;
+
+        if (read_u16(entry, little) != XMP_TIFF_TAG)
+            continue;
+
+        // XMP is stored as BYTE or UNDEFINED
+        type = read_u16(entry + 2, little);
+        if (type != 1 && type != 7)
+            return 0;
+
+        size = read_u32(entry + 4, little);
+        value = size <= 4 ? (size_t) (entry + 8 - data) : read_u32(entry + 8, little);
+        if (value > length || size > length - value)
+            return 0;
+
+        *offset = value;
+        *xmp_length = size;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * ISO base media (MP4, MOV, 3GP, HEIF...): walk the box tree by box sizes,
+ * never reading mdat. XMP lives in a top-level uuid box or, in QuickTime
+ * files, in moov/udta/XMP_. Only that path is descended, so nested boxes
+ * cannot drive the recursion any deeper.
+ */
+static int
+locate_bmff_boxes(const guint8 *data, size_t start, size_t end, int depth,
+                  size_t *offset, size_t *xmp_length)
+{
+    size_t pos = start;
+
+    while (end - pos >= 8) {
+        guint64 size = read_u32(data + pos, 0);
+        const guint8 *type = data + pos + 4;
+        size_t header = 8;
+
+        if (size == 1) {
+            if (end - pos < 16)
+                return 0;
+            size = read_u64(data + pos + 8);
+            header = 16;
+        } else if (size == 0) {
+            size = end - pos;
+        }
+
+        if (size < header || size > end - pos)
+            return 0;
+
+        if (memcmp(type, "uuid", 4) == 0 && size >= header + 16 &&
+            memcmp(data + pos + header, xmp_bmff_uuid, 16) == 0) {
+            *offset = pos + header + 16;
+            *xmp_length = size - header - 16;
+            return 1;
+        }
+
+        if (memcmp(type, "XMP_", 4) == 0) {
+            *offset = pos + header;
+            *xmp_length = size - header;
+            return 1;
+        }
+
+        if (((depth == 0 && memcmp(type, "moov", 4) == 0) ||
+             (depth == 1 && memcmp(type, "udta", 4) == 0)) &&
+            locate_bmff_boxes(data, pos + header, pos + size, depth + 1, offset, xmp_length))
+            return 1;
+
+        pos += size;
+    }
+
+    return 0;
+}
+
+/*
+ * Find the next "<?xpacket" marker. With SSE2, sixteen candidate positions
+ * are tested at once against the first and last byte of the marker and
+ * only the hits are compared in full.
+ */
+static const guint8*
+find_xpacket(const guint8 *data, size_t length)
+{
+    static const char marker[] = "<?xpacket";
+    const size_t n = sizeof(marker) - 1;
+    size_t i = 0;
+
+    if (length < n)
+        return NULL;
+
+#ifdef __SSE2__
+    {
+        const __m128i first = _mm_set1_epi8(marker[0]);
+        const __m128i last = _mm_set1_epi8(marker[n - 1]);
+
+        for (; i + n - 1 + 16 <= length; i += 16) {
+            __m128i block_first = _mm_loadu_si128((const __m128i *) (data + i));
+            __m128i block_last = _mm_loadu_si128((const __m128i *) (data + i + n - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+
+            while (mask != 0) {
+                unsigned bit = __builtin_ctz(mask);
+
+                if (memcmp(data + i + bit + 1, marker + 1, n - 2) == 0)
+                    return data + i + bit;
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+
+    for (; i + n <= length; i++) {
+        const guint8 *p = memchr(data + i, marker[0], length - n + 1 - i);
+
+        if (p == NULL)
+            return NULL;
+        if (memcmp(p, marker, n) == 0)
+            return p;
+        i = p - data;
+    }
+
+    return NULL;
+}
+
+/*
+ * Packet scanning as described by the XMP specification, used for PDF and
+ * unknown formats. The range spans from the packet header to the end of
+ * the trailer, padding included. For PDF, incremental updates append new
+ * metadata, so the last packet wins.
+ */
+static int
+locate_packet(const guint8 *data, size_t length, int last,
+              size_t *offset, size_t *xmp_length)
+{
+    const guint8 *end = data + length;
+    const guint8 *p = data;
+    int found = 0;
+
+    while ((p = find_xpacket(p, end - p)) != NULL) {
+        const guint8 *trailer;
+        const guint8 *close;
+
+        if (end - p < 16 || memcmp(p + 9, " begin", 6) != 0) {
+            p += 9;
+            continue;
+        }
+
+        trailer = find_xpacket(p + 9, end - p - 9);
+        if (trailer == NULL || end - trailer < 14 || memcmp(trailer + 9, " end", 4) != 0)
+            return found;
+
+        close = memmem(trailer, end - trailer, "?>", 2);
+        if (close == NULL)
+            return found;
+
+        *offset = p - data;
+        *xmp_length = close + 2 - p;
+        found = 1;
+
+        if (!last)
+            return found;
+        p = close + 2;
+    }
+
+    return found;
+}
+
+int
+recontext_locate_xmp(const void *buffer, size_t length, size_t *offset, size_t *xmp_length,
+                     recontext_media_type *type)
+{
+    const guint8 *data = buffer;
+    recontext_media_type media = RECONTEXT_MEDIA_UNKNOWN;
+    int found = 0;
+
+    if (length >= 4 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff) {
+        media = RECONTEXT_MEDIA_JPEG;
+        found = locate_jpeg(data, length, offset, xmp_length);
+    } else if (length >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        media = RECONTEXT_MEDIA_PNG;
+        found = locate_png(data, length, offset, xmp_length);
+    } else if (length >= 8 && (memcmp(data, "II*\0", 4) == 0 || memcmp(data, "MM\0*", 4) == 0)) {
+        media = RECONTEXT_MEDIA_TIFF;
+        found = locate_tiff(data, length, offset, xmp_length);
+    } else if (length >= 8 && (memcmp(data + 4, "ftyp", 4) == 0 ||
+                               memcmp(data + 4, "moov", 4) == 0 ||
+                               memcmp(data + 4, "wide", 4) == 0)) {
+        media = RECONTEXT_MEDIA_BMFF;
+        found = locate_bmff_boxes(data, 0, length, 0, offset, xmp_length);
+    } else if (length >= 5 && memcmp(data, "%PDF-", 5) == 0) {
+        media = RECONTEXT_MEDIA_PDF;
+        found = locate_packet(data, length, 1, offset, xmp_length);
+    } else {
+        found = locate_packet(data, length, 0, offset, xmp_length);
+    }
+
+    if (type != NULL)
+        *type = media;
+
+    return found;
+}
+
+recontext*
+recontext_new_from_media_buffer(const void *data, size_t length, const char *base_uri)
+{
+    size_t offset;
+    size_t xmp_length;
+
+    if (!recontext_locate_xmp(data, length, &offset, &xmp_length, NULL))
+        return NULL;
+
+    return recontext_new_from_xmp_counted((const char *) data + offset, xmp_length, base_uri);
+}
+
+/*
+ * The file is mapped rather than read, so only the pages holding the
+ * container headers and the XMP payload are ever faulted in.
+ */
+recontext*
+recontext_new_from_media_file(const char *filename, const char *base_uri)
+{
+    GMappedFile *mapped;
+    recontext   *rc;
+
+    mapped = g_mapped_file_new(filename, FALSE, NULL);
+    if (mapped == NULL)
+        return NULL;
+
+    rc = recontext_new_from_media_buffer(g_mapped_file_get_contents(mapped),
+                                         g_mapped_file_get_length(mapped), base_uri);
+
+    g_mapped_file_unref(mapped);
+    return rc;
+}
+
+/* start of the PNG chunk whose data holds the given offset */
+static size_t
+png_chunk_start(const guint8 *data, size_t length, size_t offset)
+{
+    size_t pos = 8;
+
+    while (pos + 12 <= length) {
+        size_t chunk = read_u32(data + pos, 0);
+
+        if (offset >= pos + 8 && offset < pos + 8 + chunk)
+            return pos;
+
+        pos += 12 + chunk;
+    }
+
+    return 0;
+}
+
+static guint32
+png_crc(guint32 crc, const guint8 *data, size_t length)
+{
+    size_t i;
+    int k;
+
+    for (i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? 0xedb88320u ^ (crc >> 1) : crc >> 1;
+    }
+
+    return crc;
+}
+
+/* packets marked read-only in their trailer must not be rewritten */
+static int
+packet_writable(const guint8 *packet, size_t length)
+{
+    size_t tail = MIN(length, 64);
+    const guint8 *p = packet + length - tail;
+
+    return memmem(p, tail, "end=\"r\"", 7) == NULL && memmem(p, tail, "end='r'", 7) == NULL;
+}
+
+static int
+write_all_at(int fd, const char *data, size_t length, off_t offset)
+{
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+
+        data += written;
+        length -= written;
+        offset += written;
+    }
+
+    return 0;
+}
+
+#define XMP_TRAILER_START "<?xpacket end="
+
+/*
+ * Copy an XMP packet, with its old padding dropped and fresh padding put
+ * in front of the trailer, so it is exactly size bytes long. Returns NULL
+ * when the packet has no trailer or does not fit.
+ */
+static char*
+packet_pad(const char *packet, size_t length, size_t size)
+{
+    const char *trailer = NULL;
+    const char *p = packet;
+    size_t body;
+    size_t padding;
+    size_t i;
+    char *padded;
+
+    while ((p = memmem(p, length - (p - packet), XMP_TRAILER_START,
+                       strlen(XMP_TRAILER_START))) != NULL)
+        trailer = p++;
+
+    if (trailer == NULL)
+        return NULL;
+
+    for (body = trailer - packet; body > 0; body--) {
+        char c = packet[body - 1];
+
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+            break;
+    }
+
+    if (body + 1 + (length - (trailer - packet)) > size)
+        return NULL;
+    padding = size - body - (length - (trailer - packet));
+
+    padded = g_malloc(size);
+    memcpy(padded, packet, body);
+
+    // whitespace, broken into lines as other writers do
+    for (i = 0; i < padding; i++)
+        padded[body + i] = i % 100 == 0 || i == padding - 1 ? '\n' : ' ';
+
+    memcpy(padded + body + padding, trailer, length - (trailer - packet));
+    return padded;
+}
+
+/*
+ * The new packet is padded to exactly the size of the old one and goes
+ * out in a single write, followed by the chunk checksum for PNG, so the
+ * cost does not depend on the size of the file.
+ */
+int
+recontext_write_xmp_packet_in_place(const char *filename, const char *packet, size_t length)
+{
+    GMappedFile          *mapped;
+    const guint8         *data;
+    recontext_media_type  type;
+    size_t                file_length;
+    size_t                offset;
+    size_t                xmp_length;
+    size_t                write_length;
+    char                 *padded;
+    int                   fd;
+    int                   error;
+
+    mapped = g_mapped_file_new(filename, FALSE, NULL);
+    if (mapped == NULL)
+        return 1;
+
+    data = (const guint8 *) g_mapped_file_get_contents(mapped);
+    file_length = g_mapped_file_get_length(mapped);
+
+    if (!recontext_locate_xmp(data, file_length, &offset, &xmp_length, &type) ||
+        !packet_writable(data + offset, xmp_length)) {
+        g_mapped_file_unref(mapped);
+        return 1;
+    }
+
+    padded = packet_pad(packet, length, xmp_length);
+    if (padded == NULL) {
+        g_mapped_file_unref(mapped);
+        return 1;
+    }
+    write_length = xmp_length;
+
+    // the checksum covers the chunk type, the iTXt header and the text
+    if (type == RECONTEXT_MEDIA_PNG) {
+        size_t chunk = png_chunk_start(data, file_length, offset);
+        guint32 crc;
+
+        crc = png_crc(0xffffffffu, data + chunk + 4, offset - chunk - 4);
+        crc = png_crc(crc, (const guint8 *) padded, xmp_length) ^ 0xffffffffu;
+
+        padded = g_realloc(padded, xmp_length + 4);
+        padded[xmp_length] = crc >> 24;
+        padded[xmp_length + 1] = crc >> 16;
+        padded[xmp_length + 2] = crc >> 8;
+        padded[xmp_length + 3] = crc;
+        write_length += 4;
+    }
+
+    g_mapped_file_unref(mapped);
+
+    fd = open(filename, O_WRONLY);
+    if (fd < 0) {
+        g_free(padded);
+        return 1;
+    }
+
+    error = write_all_at(fd, padded, write_length, offset);
+    if (!error)
+        error = fsync(fd) != 0;
+    error = close(fd) != 0 || error;
+
+    g_free(padded);
+    return error;
+}
+
+int
+recontext_write_xmp_in_place(recontext *rc, const char *filename)
+{
+    char   *packet;
+    size_t  length;
+    int     error;
+
+    packet = recontext_to_xmp_packet(rc, 0, &length);
+    if (packet == NULL)
+        return 1;
+
+    error = recontext_write_xmp_packet_in_place(filename, packet, length);
+    g_free(packet);
+
+    return error;
+}
@@ -0,0 +1,54 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __RECONTEXT_MEDIA_H__
+#define __RECONTEXT_MEDIA_H__
+
+#include "recontext.h"
+
+typedef enum {
+    RECONTEXT_MEDIA_UNKNOWN,
+    RECONTEXT_MEDIA_JPEG,
+    RECONTEXT_MEDIA_PNG,
+    RECONTEXT_MEDIA_TIFF,
+    RECONTEXT_MEDIA_BMFF,
+    RECONTEXT_MEDIA_PDF
+} recontext_media_type;
+
+/*
+ * Find the XMP payload of a media file without touching its pixel data.
+ * On success, returns non-zero and stores the payload's byte range; the
+ * range covers the whole space the container reserves for XMP.
+ */
+int             recontext_locate_xmp(const void *data, size_t length,
+                                     size_t *offset, size_t *xmp_length,
+                                     recontext_media_type *type);
+
+recontext*      recontext_new_from_media_buffer(const void *data, size_t length,
+                                                const char *base_uri);
+recontext*      recontext_new_from_media_file(const char *filename, const char *base_uri);
+
+/*
+ * Overwrite the XMP packet of a media file in place with the given one,
+ * padded to the old size. Works when the existing packet is writable and
+ * large enough to take the new one; otherwise returns non-zero and leaves
+ * the file untouched, and the caller has to rewrite the file in full.
+ */
+int             recontext_write_xmp_packet_in_place(const char *filename,
+                                                    const char *packet, size_t length);
+
+/*
+ * Replace the XMP packet of a media file with recontext_to_xmp_packet()
+ * output, in place and under the same conditions. The old packet is
+ * dropped whole, properties the graph lacks included; use
+ * recontext_save_xmp() to merge into it instead.
+ */
+int             recontext_write_xmp_in_place(recontext *rc, const char *filename);
+
+#endif /* __RECONTEXT_MEDIA_H__ */
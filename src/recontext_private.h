@@ -0,0 +1,157 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __RECONTEXT_PRIVATE_H__
+#define __RECONTEXT_PRIVATE_H__
+
+#include <glib.h>
+
+#include "recontext.h"
+
+/*
+ * Per-thread library context shared by the recontext objects of that
+ * thread. Owns the librdf world, pools of idle parsers and serializers
+ * keyed by syntax name and the compiled queries keyed by query name.
+ */
+struct recontext_ctx_s {
+    int              refcount;
+    int              held;
+    GThread         *owner;         /* NULL for private contexts */
+    librdf_world    *world;
+
+    GHashTable      *parsers;
+    GHashTable      *serializers;
+    GHashTable      *queries;
+    GQueue           query_lru;     /* most recently used first */
+    guint            errors;        /* errors logged by the world so far */
+};
+
+/*
+ * Private part of a recontext, allocated in the same block. Strings owned
+ * by the recontext live in one string chunk and go away with it in a
+ * single step; the base URI is interned once instead of per operation.
+ */
+struct recontext_priv_s {
+    GStringChunk    *strings;
+    librdf_uri      *base_uri;
+    recontext_storage storage;      /* the kind of store actually in use */
+
+    size_t           budget;
+    size_t           usage;
+
+    /*
+     * Every change bumps the generation and records it against the
+     * predicates it touched, so consumers can tell what changed since
+     * they last looked. Changes to unknown predicates are recorded in
+     * all_changed, changes to container members in containers_changed.
+     */
+    guint64          serial;        /* tells recontexts apart in sync records */
+    gsize            generation;
+    gsize            all_changed;
+    gsize            containers_changed;
+    GHashTable      *changed;       /* predicate URI -> generation */
+
+    /* serialized output per format, valid while its generation is current */
+    char            *cache[RECONTEXT_FORMAT_TURTLE + 1];
+    size_t           cache_length[RECONTEXT_FORMAT_TURTLE + 1];
+    gsize            cache_generation[RECONTEXT_FORMAT_TURTLE + 1];
+};
+
+int                 recontext_charge(recontext *rc, librdf_statement *statement);
+
+gsize               recontext_changed(recontext *rc, const char *predicate);
+void                recontext_changed_model(recontext *rc, recontext *source);
+gboolean            recontext_changed_since(recontext *rc, const char *predicate, gsize since);
+
+/*
+ * Operations are bracketed with RECONTEXT_OP_BEGIN/END. While neither stats
+ * nor a trace hook are enabled this is a single predictable branch, and the
+ * arguments of RECONTEXT_OP_END are not even evaluated.
+ */
+extern int recontext_instrumented;
+
+guint64             recontext_op_begin(recontext_op op);
+void                recontext_op_end(recontext_op op, guint64 start,
+                                     size_t statements, size_t bytes);
+size_t              recontext_model_size(librdf_model *model);
+
+#define RECONTEXT_OP_BEGIN(op) \
+    (G_UNLIKELY(recontext_instrumented) ? recontext_op_begin(op) : 0)
+
+#define RECONTEXT_OP_END(op, start, statements, bytes) G_STMT_START { \
+    if (G_UNLIKELY(start != 0))                                        \
+        recontext_op_end(op, start, statements, bytes);                \
+} G_STMT_END
+
+/*
+ * Jobs run on worker threads are bracketed with begin_job/end_job, and the
+ * counts they return are added to the thread collecting the result.
+ */
+void                recontext_stats_begin_job(recontext_stats *saved);
+void                recontext_stats_end_job(recontext_stats *saved, recontext_stats *job);
+void                recontext_stats_add(const recontext_stats *job);
+
+recontext_ctx*      recontext_ctx_ref(void);
+void                recontext_ctx_unref(recontext_ctx *ctx);
+recontext_ctx*      recontext_ctx_new_private(void);
+void                recontext_ctx_enter(recontext_ctx *ctx);
+
+recontext*          recontext_new_in_ctx(recontext_ctx *ctx, const char *subject,
+                                         recontext_storage storage);
+recontext*          recontext_copy_to_ctx(recontext *rc, recontext_ctx *ctx);
+gboolean            recontext_cache_valid(recontext *rc, recontext_format format);
+
+librdf_parser*      recontext_ctx_acquire_parser(recontext_ctx *ctx, const char *name);
+void                recontext_ctx_release_parser(recontext_ctx *ctx, const char *name,
+                                                 librdf_parser *parser);
+
+librdf_serializer*  recontext_ctx_acquire_serializer(recontext_ctx *ctx, const char *name);
+void                recontext_ctx_release_serializer(recontext_ctx *ctx, const char *name,
+                                                     librdf_serializer *serializer);
+
+librdf_query*       recontext_ctx_lookup_query(recontext_ctx *ctx, const char *name);
+librdf_query*       recontext_ctx_add_query(recontext_ctx *ctx, const char *name,
+                                            const char *query_string);
+
+recontext_format    recontext_guess_format(recontext_ctx *ctx, const char *data, size_t length,
+                                           const char *filename);
+
+/* deduplicating merge and comparable node keys, see recontext_provenance.c */
+GPtrArray*          recontext_merge_dedup(recontext *rc, recontext *other);
+gchar*              recontext_node_key(librdf_node *node);
+
+/* native compact store, registered as a Redland storage module per world */
+#define RECONTEXT_COMPACT_STORAGE "recontext-compact"
+
+typedef struct recontext_compact_s recontext_compact_store;
+
+int                 recontext_compact_register(librdf_world *world);
+recontext_compact_store* recontext_compact_get(librdf_storage *storage);
+void                recontext_compact_copy(recontext_compact_store *to,
+                                           recontext_compact_store *from, librdf_node *subject);
+void                recontext_compact_remove_subject(recontext_compact_store *store,
+                                                     librdf_node *subject);
+void                recontext_compact_foreach_predicate(recontext_compact_store *store,
+                                                        GFunc func, gpointer user_data);
+
+guint64             recontext_hash64(const void *data, size_t length, guint64 seed);
+recontext*          recontext_cache_load(const char *rdf, size_t length, const char *base_uri);
+void                recontext_cache_save(recontext *rc, const char *rdf, size_t length,
+                                         const char *base_uri);
+
+/* initialize gexiv2 once before using it from worker threads */
+void                recontext_gexiv2_init(void);
+
+void                recontext_add_value(GPtrArray *values, librdf_node *node);
+void                recontext_add_container_values(recontext *rc, librdf_node *container,
+                                                   GPtrArray *values);
+void                recontext_add_container_members(recontext *rc, librdf_node *container,
+                                                    gboolean alternatives, GPtrArray *nodes);
+
+#endif /* __RECONTEXT_PRIVATE_H__ */
@@ -0,0 +1,551 @@
+/*
+ * librecontext - a lightweight metadata handling library
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Authors: Artem Popov <artfwo@commonsmachinery.se>
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "recontext.h"
+#include "recontext_private.h"
+
+/*
+ * Keeping merged provenance small. Repeated merges of the same ancestry
+ * bring along fresh copies of its blank nodes each time, since blank
+ * nodes are local to the document they were parsed from; a deduplicating
+ * merge maps them onto equal blank nodes already present instead. Deep
+ * ancestries are cut back by recontext_compact().
+ *
+ * Nodes are handled as keys: length-prefixed strings that tell resources,
+ * literals and blank nodes apart and compare equal exactly when the nodes
+ * do.
+ */
+
+static const char *ancestry_predicates[] = {
+    "http://purl.org/dc/elements/1.1/source",
+    "http://purl.org/dc/terms/source",
+    "http://www.w3.org/ns/prov#wasDerivedFrom",
+    NULL
+};
+
+gchar*
+recontext_node_key(librdf_node *node)
+{
+    size_t length = 0;
+
+    if (librdf_node_is_resource(node)) {
+        const unsigned char *uri = librdf_uri_as_counted_string(librdf_node_get_uri(node), &length);
+
+        return g_strdup_printf("U%zu:%s", length, uri);
+    }
+
+    if (librdf_node_is_literal(node)) {
+        const unsigned char *value = librdf_node_get_literal_value_as_counted_string(node, &length);
+        const char *language = librdf_node_get_literal_value_language(node);
+        librdf_uri *datatype = librdf_node_get_literal_value_datatype_uri(node);
+        const char *type = datatype ? (const char *) librdf_uri_as_string(datatype) : "";
+
+        language = language ? language : "";
+        return g_strdup_printf("L%zu:%s%zu:%s%zu:%s", length, value,
+                               strlen(language), language, strlen(type), type);
+    }
+
+    return g_strdup_printf("B%s", librdf_node_get_blank_identifier(node));
+}
+
+/* the statements of a graph grouped by subject key */
+static GHashTable*
+recontext_arcs_new(recontext *rc)
+{
+    GHashTable *arcs;
+    librdf_stream *stream;
+
+    arcs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                 (GDestroyNotify) g_ptr_array_unref);
+
+    stream = librdf_model_as_stream(rc->model);
+    while (!librdf_stream_end(stream)) {
+        librdf_statement *statement = librdf_stream_get_object(stream);
+        gchar *key = recontext_node_key(librdf_statement_get_subject(statement));
+        GPtrArray *statements = g_hash_table_lookup(arcs, key);
+
+        if (statements == NULL) {
+            statements = g_ptr_array_new_with_free_func((GDestroyNotify) librdf_free_statement);
+            g_hash_table_insert(arcs, key, statements);
+        } else {
+            g_free(key);
+        }
+
+        g_ptr_array_add(statements, librdf_new_statement_from_statement(statement));
+        librdf_stream_next(stream);
+    }
+    librdf_free_stream(stream);
+
+    return arcs;
+}
+
+/*
+ * Canonical forms of blank nodes: the sorted list of their arcs, with
+ * blank objects replaced by their own forms. Blank nodes on a cycle have
+ * no form and are never considered equal to anything.
+ */
+typedef struct {
+    GHashTable *arcs;
+    GHashTable *forms;          /* blank key -> form, NULL on cycles */
+    GHashTable *visiting;
+} recontext_canon;
+
+static void
+recontext_canon_init(recontext_canon *canon, recontext *rc)
+{
+    canon->arcs = recontext_arcs_new(rc);
+    canon->forms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    canon->visiting = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void
+recontext_canon_clear(recontext_canon *canon)
+{
+    g_hash_table_destroy(canon->visiting);
+    g_hash_table_destroy(canon->forms);
+    g_hash_table_destroy(canon->arcs);
+}
+
+static gint
+recontext_compare_strings(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+/*
+ * Form of a blank node whose blank objects all have their forms by now,
+ * or are still being visited, which makes it part of a cycle.
+ */
+static void
+recontext_blank_form_finish(recontext_canon *canon, const gchar *key)
+{
+    GPtrArray *statements;
+    GPtrArray *parts;
+    GString   *form;
+    gpointer   known;
+    gboolean   cyclic = FALSE;
+    guint      i;
+
+    statements = g_hash_table_lookup(canon->arcs, key);
+    parts = g_ptr_array_new_with_free_func(g_free);
+
+    for (i = 0; statements != NULL && i < statements->len && !cyclic; i++) {
+        librdf_statement *statement = g_ptr_array_index(statements, i);
+        gchar *predicate = recontext_node_key(librdf_statement_get_predicate(statement));
+        gchar *object = recontext_node_key(librdf_statement_get_object(statement));
+        const gchar *value = object;
+
+        if (object[0] == 'B') {
+            cyclic = !g_hash_table_lookup_extended(canon->forms, object, NULL, &known) ||
+                     known == NULL;
+            value = known;
+        }
+
+        if (!cyclic)
+            g_ptr_array_add(parts, g_strconcat(predicate, " ", value, NULL));
+
+        g_free(predicate);
+        g_free(object);
+    }
+
+    if (cyclic) {
+        g_hash_table_insert(canon->forms, g_strdup(key), NULL);
+        g_ptr_array_unref(parts);
+        return;
+    }
+
+    g_ptr_array_sort(parts, recontext_compare_strings);
+
+    form = g_string_new("[");
+    for (i = 0; i < parts->len; i++) {
+        if (i > 0)
+            g_string_append_c(form, ';');
+        g_string_append(form, g_ptr_array_index(parts, i));
+    }
+    g_string_append_c(form, ']');
+    g_ptr_array_unref(parts);
+
+    g_hash_table_insert(canon->forms, g_strdup(key), g_string_free(form, FALSE));
+}
+
+typedef struct {
+    gchar *key;
+    guint  next;                /* next statement to look at */
+} recontext_canon_frame;
+
+/*
+ * Blank chains come from untrusted input and can be arbitrarily deep, so
+ * the depth-first walk keeps its own stack instead of recursing.
+ */
+static const gchar*
+recontext_blank_form(recontext_canon *canon, const gchar *key)
+{
+    GArray   *stack;
+    gpointer  known;
+    recontext_canon_frame frame;
+
+    if (g_hash_table_lookup_extended(canon->forms, key, NULL, &known))
+        return known;
+
+    stack = g_array_new(FALSE, FALSE, sizeof(recontext_canon_frame));
+    frame.key = g_strdup(key);
+    frame.next = 0;
+    g_array_append_val(stack, frame);
+    g_hash_table_add(canon->visiting, frame.key);
+
+    while (stack->len > 0) {
+        recontext_canon_frame *top = &g_array_index(stack, recontext_canon_frame, stack->len - 1);
+        GPtrArray *statements = g_hash_table_lookup(canon->arcs, top->key);
+        gchar *child = NULL;
+
+        while (statements != NULL && top->next < statements->len && child == NULL) {
+            librdf_statement *statement = g_ptr_array_index(statements, top->next++);
+
+            child = recontext_node_key(librdf_statement_get_object(statement));
+            if (child[0] != 'B' || g_hash_table_contains(canon->forms, child) ||
+                g_hash_table_contains(canon->visiting, child)) {
+                g_free(child);
+                child = NULL;
+            }
+        }
+
+        if (child != NULL) {
+            frame.key = child;
+            frame.next = 0;
+            g_array_append_val(stack, frame);
+            g_hash_table_add(canon->visiting, child);
+            continue;
+        }
+
+        recontext_blank_form_finish(canon, top->key);
+        g_hash_table_remove(canon->visiting, top->key);
+        g_free(top->key);
+        g_array_set_size(stack, stack->len - 1);
+    }
+
+    g_array_free(stack, TRUE);
+    return g_hash_table_lookup(canon->forms, key);
+}
+
+typedef struct {
+    recontext      *rc;
+    recontext_canon theirs;
+    GHashTable     *by_form;    /* form -> blank identifier in rc */
+    GHashTable     *mapping;    /* blank key in other -> identifier in rc */
+    GHashTable     *existing;   /* blank keys in other mapped onto existing nodes */
+} recontext_dedup;
+
+/*
+ * The node to use in rc for a node of other. Blank nodes equal to one
+ * already present, or already copied during this merge, map onto it.
+ */
+static librdf_node*
+recontext_dedup_node(recontext_dedup *dedup, librdf_node *node, gboolean *existing)
+{
+    const gchar *id;
+    gchar *key;
+
+    *existing = FALSE;
+
+    if (!librdf_node_is_blank(node))
+        return librdf_new_node_from_node(node);
+
+    key = recontext_node_key(node);
+    id = g_hash_table_lookup(dedup->mapping, key);
+
+    if (id == NULL) {
+        const gchar *form = recontext_blank_form(&dedup->theirs, key);
+
+        id = form ? g_hash_table_lookup(dedup->by_form, form) : NULL;
+
+        if (id != NULL) {
+            g_hash_table_add(dedup->existing, g_strdup(key));
+        } else {
+            id = key + 1;
+            if (form != NULL)
+                g_hash_table_insert(dedup->by_form, g_strdup(form), g_strdup(id));
+        }
+
+        id = g_strdup(id);
+        g_hash_table_insert(dedup->mapping, g_strdup(key), (gpointer) id);
+    }
+
+    *existing = g_hash_table_contains(dedup->existing, key);
+    g_free(key);
+
+    return librdf_new_node_from_blank_identifier(dedup->rc->world, (const unsigned char *) id);
+}
+
+/*
+ * The statements of other to copy into rc, with blank nodes mapped onto
+ * equal ones of rc. Statements about blank nodes that map onto existing
+ * ones are left out outright; other duplicates may remain for the store
+ * to drop.
+ */
+GPtrArray*
+recontext_merge_dedup(recontext *rc, recontext *other)
+{
+    recontext_dedup  dedup;
+    recontext_canon  mine;
+    librdf_stream   *stream;
+    GHashTableIter   iter;
+    GPtrArray       *batch;
+    gpointer         key;
+
+    dedup.rc = rc;
+    dedup.by_form = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    dedup.mapping = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    dedup.existing = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    recontext_canon_init(&mine, rc);
+    g_hash_table_iter_init(&iter, mine.arcs);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        const gchar *form;
+
+        if (((const gchar *) key)[0] != 'B')
+            continue;
+
+        form = recontext_blank_form(&mine, key);
+        if (form != NULL && !g_hash_table_contains(dedup.by_form, form))
+            g_hash_table_insert(dedup.by_form, g_strdup(form), g_strdup((const gchar *) key + 1));
+    }
+    recontext_canon_clear(&mine);
+
+    recontext_canon_init(&dedup.theirs, other);
+    batch = g_ptr_array_new_with_free_func((GDestroyNotify) librdf_free_statement);
+
+    stream = librdf_model_as_stream(other->model);
+    while (!librdf_stream_end(stream)) {
+        librdf_statement *statement = librdf_stream_get_object(stream);
+        librdf_statement *copy;
+        librdf_node *subject;
+        librdf_node *object;
+        gboolean existing;
+        gboolean unused;
+
+        subject = recontext_dedup_node(&dedup, librdf_statement_get_subject(statement), &existing);
+        if (existing) {
+            librdf_free_node(subject);
+            librdf_stream_next(stream);
+            continue;
+        }
+
+        object = recontext_dedup_node(&dedup, librdf_statement_get_object(statement), &unused);
+        copy = librdf_new_statement_from_nodes(rc->world, subject,
+            librdf_new_node_from_node(librdf_statement_get_predicate(statement)), object);
+
+        g_ptr_array_add(batch, copy);
+        librdf_stream_next(stream);
+    }
+    librdf_free_stream(stream);
+
+    recontext_canon_clear(&dedup.theirs);
+    g_hash_table_destroy(dedup.existing);
+    g_hash_table_destroy(dedup.mapping);
+    g_hash_table_destroy(dedup.by_form);
+
+    return batch;
+}
+
+static gboolean
+recontext_is_ancestry(librdf_node *predicate)
+{
+    const char *uri = (const char *) librdf_uri_as_string(librdf_node_get_uri(predicate));
+    int i;
+
+    for (i = 0; ancestry_predicates[i] != NULL; i++) {
+        if (strcmp(uri, ancestry_predicates[i]) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* link distance of every ancestor from the main subject, plus one */
+static GHashTable*
+recontext_ancestry_depths(recontext *rc, GHashTable *arcs, int *deepest)
+{
+    GHashTable *depths;
+    GQueue      queue = G_QUEUE_INIT;
+    librdf_node *main_subject;
+    gchar       *key;
+
+    depths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    *deepest = 0;
+
+    main_subject = librdf_new_node_from_uri(rc->world, rc->priv->base_uri);
+    key = recontext_node_key(main_subject);
+    librdf_free_node(main_subject);
+
+    g_hash_table_insert(depths, key, GINT_TO_POINTER(1));
+    g_queue_push_tail(&queue, key);
+
+    while ((key = g_queue_pop_head(&queue)) != NULL) {
+        GPtrArray *statements = g_hash_table_lookup(arcs, key);
+        int depth = GPOINTER_TO_INT(g_hash_table_lookup(depths, key));
+        guint i;
+
+        for (i = 0; statements != NULL && i < statements->len; i++) {
+            librdf_statement *statement = g_ptr_array_index(statements, i);
+            librdf_node *object = librdf_statement_get_object(statement);
+            gchar *source;
+
+            if (!librdf_node_is_resource(object) ||
+                !recontext_is_ancestry(librdf_statement_get_predicate(statement)))
+                continue;
+
+            source = recontext_node_key(object);
+            if (g_hash_table_contains(depths, source)) {
+                g_free(source);
+                continue;
+            }
+
+            g_hash_table_insert(depths, source, GINT_TO_POINTER(depth + 1));
+            g_queue_push_tail(&queue, source);
+            *deepest = MAX(*deepest, depth);
+        }
+    }
+
+    return depths;
+}
+
+/* mark the blank nodes reachable from statements, without recursing */
+static void
+recontext_keep_blanks(GHashTable *arcs, GHashTable *kept, GPtrArray *statements)
+{
+    GPtrArray *pending;
+    guint i;
+
+    pending = g_ptr_array_new();
+    g_ptr_array_add(pending, statements);
+
+    while (pending->len > 0) {
+        statements = g_ptr_array_index(pending, pending->len - 1);
+        g_ptr_array_remove_index_fast(pending, pending->len - 1);
+
+        for (i = 0; i < statements->len; i++) {
+            librdf_node *object = librdf_statement_get_object(g_ptr_array_index(statements, i));
+            GPtrArray *next;
+            gchar *key;
+
+            if (!librdf_node_is_blank(object))
+                continue;
+
+            key = recontext_node_key(object);
+            if (g_hash_table_contains(kept, key)) {
+                g_free(key);
+                continue;
+            }
+
+            g_hash_table_add(kept, key);
+            next = g_hash_table_lookup(arcs, key);
+            if (next != NULL)
+                g_ptr_array_add(pending, next);
+        }
+    }
+
+    g_ptr_array_free(pending, TRUE);
+}
+
+/*
+ * Whether a named subject survives a cut at depth. The main subject is at
+ * depth 0 and its direct sources at depth 1; subjects outside the
+ * ancestry are not pruned.
+ */
+static gboolean
+recontext_within(GHashTable *depths, const gchar *key, int depth)
+{
+    int distance = GPOINTER_TO_INT(g_hash_table_lookup(depths, key));
+
+    return distance == 0 || distance - 1 <= depth;
+}
+
+/*
+ * The statements to drop when cutting the ancestry at depth: those about
+ * ancestors further away, and about blank nodes only they lead to.
+ */
+static GPtrArray*
+recontext_prune(GHashTable *arcs, GHashTable *depths, int depth)
+{
+    GHashTable     *kept;
+    GPtrArray      *removed;
+    GHashTableIter  iter;
+    gpointer        key;
+    gpointer        value;
+
+    kept = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    g_hash_table_iter_init(&iter, arcs);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (((const gchar *) key)[0] != 'B' && recontext_within(depths, key, depth))
+            recontext_keep_blanks(arcs, kept, value);
+    }
+
+    removed = g_ptr_array_new();
+
+    g_hash_table_iter_init(&iter, arcs);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        GPtrArray *statements = value;
+        guint i;
+
+        if (((const gchar *) key)[0] == 'B' ? g_hash_table_contains(kept, key)
+                                            : recontext_within(depths, key, depth))
+            continue;
+
+        for (i = 0; i < statements->len; i++)
+            g_ptr_array_add(removed, g_ptr_array_index(statements, i));
+    }
+
+    g_hash_table_destroy(kept);
+    return removed;
+}
+
+size_t
+recontext_compact(recontext *rc, int max_depth, size_t max_statements)
+{
+    GHashTable *arcs;
+    GHashTable *depths;
+    GPtrArray  *removed;
+    size_t      total;
+    int         deepest;
+    int         depth;
+    guint       i;
+
+    arcs = recontext_arcs_new(rc);
+    depths = recontext_ancestry_depths(rc, arcs, &deepest);
+    total = recontext_model_size(rc->model);
+
+    // without a depth limit nothing is pruned unless the size calls for it
+    depth = max_depth < 0 ? deepest : MIN(max_depth, deepest);
+    removed = max_depth < 0 ? g_ptr_array_new() : recontext_prune(arcs, depths, depth);
+
+    // give up the furthest ancestors first until the graph fits
+    while (max_statements != 0 && total - removed->len > max_statements && depth > 0) {
+        g_ptr_array_unref(removed);
+        removed = recontext_prune(arcs, depths, --depth);
+    }
+
+    for (i = 0; i < removed->len; i++)
+        librdf_model_remove_statement(rc->model, g_ptr_array_index(removed, i));
+
+    if (removed->len > 0)
+        recontext_changed(rc, NULL);
+
+    total = removed->len;
+    g_ptr_array_unref(removed);
+    g_hash_table_destroy(depths);
+    g_hash_table_destroy(arcs);
+
+    return total;
+}
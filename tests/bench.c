@@ -0,0 +1,634 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <recontext.h>
+#include <recontext_gexiv2.h>
+
+/*
+ * Allocations made by the program and the libraries it links go through
+ * these wrappers, so per-operation allocation counts can be reported
+ * without any help from the library. Every call to malloc(), calloc(),
+ * realloc() and the aligned family (posix_memalign(), aligned_alloc(),
+ * memalign(), valloc(), pvalloc()) counts as one allocation, whatever its
+ * size; frees are not counted. Calls from inside libc itself, such as
+ * strdup(), are not seen.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+static guint64 alloc_count;
+
+void*
+malloc(size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void*
+realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void*
+memalign(size_t alignment, size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+void*
+aligned_alloc(size_t alignment, size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    // memalign() rounds bad alignments up, posix_memalign() must refuse them
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0)
+        return EINVAL;
+
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    ptr = __libc_memalign(alignment, size);
+    if (ptr == NULL)
+        return ENOMEM;
+
+    *memptr = ptr;
+    return 0;
+}
+
+void*
+valloc(size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_valloc(size);
+}
+
+void*
+pvalloc(size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_pvalloc(size);
+}
+#else
+static guint64 alloc_count;
+#endif
+
+#define BENCH_SUBJECT "http://example.org/asset/0"
+
+typedef enum {
+    OUTPUT_TEXT,
+    OUTPUT_CSV,
+    OUTPUT_JSON
+} bench_output;
+
+static gint          rounds = 50;
+static gchar        *sizes = "100,1000,10000";
+static gchar        *output_name = "text";
+static bench_output  output = OUTPUT_TEXT;
+static int           reported = 0;
+
+static GOptionEntry entries[] = {
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &rounds,
+      "Operations measured per case (default: 50)", "N" },
+    { "sizes", 's', 0, G_OPTION_ARG_STRING, &sizes,
+      "Comma-separated corpus sizes in subjects (default: 100,1000,10000)", "LIST" },
+    { "output", 'o', 0, G_OPTION_ARG_STRING, &output_name,
+      "Report format: text, csv or json", "FORMAT" },
+    { NULL }
+};
+
+static const struct {
+    const char       *name;
+    recontext_format  format;
+} formats[] = {
+    { "rdfxml",   RECONTEXT_FORMAT_RDFXML   },
+    { "ntriples", RECONTEXT_FORMAT_NTRIPLES },
+    { "turtle",   RECONTEXT_FORMAT_TURTLE   },
+};
+
+static const struct {
+    const char        *name;
+    recontext_storage  storage;
+} storages[] = {
+    { "memory",  RECONTEXT_STORAGE_MEMORY  },
+    { "indexed", RECONTEXT_STORAGE_INDEXED },
+    { "compact", RECONTEXT_STORAGE_COMPACT },
+};
+
+/* smallest JPEG exiv2 accepts: SOI, a JFIF APP0 segment and EOI */
+static const guint8 bench_jpeg[] = {
+    0xff, 0xd8, 0xff, 0xe0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01,
+    0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0xff, 0xd9
+};
+
+/* one measured case: a sample per operation plus allocation totals */
+typedef struct {
+    const char  *name;
+    const char  *variant;
+    int          subjects;
+    size_t       bytes;
+    GArray      *samples;
+    guint64      allocs;
+    guint64      start;
+    guint64      start_allocs;
+} bench;
+
+static guint64
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bench*
+bench_new(const char *name, const char *variant, int subjects)
+{
+    bench *b = g_new0(bench, 1);
+
+    b->name = name;
+    b->variant = variant;
+    b->subjects = subjects;
+    b->samples = g_array_sized_new(FALSE, FALSE, sizeof(guint64), rounds);
+    return b;
+}
+
+static void
+bench_start(bench *b)
+{
+    b->start_allocs = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+    b->start = bench_now();
+}
+
+static void
+bench_stop(bench *b)
+{
+    guint64 elapsed = bench_now() - b->start;
+
+    b->allocs += __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - b->start_allocs;
+    g_array_append_val(b->samples, elapsed);
+}
+
+static gint
+bench_compare(gconstpointer a, gconstpointer b)
+{
+    guint64 x = *(const guint64 *) a;
+    guint64 y = *(const guint64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+bench_report(bench *b)
+{
+    struct rusage usage;
+    guint64 total = 0;
+    double ops_per_sec, p50, p99, allocs;
+    guint n = b->samples->len;
+    guint i;
+
+    g_array_sort(b->samples, bench_compare);
+    for (i = 0; i < n; i++)
+        total += g_array_index(b->samples, guint64, i);
+
+    ops_per_sec = total > 0 ? n / (total / 1e9) : 0;
+    p50 = n > 0 ? g_array_index(b->samples, guint64, (n - 1) * 50 / 100) / 1e3 : 0;
+    p99 = n > 0 ? g_array_index(b->samples, guint64, (n - 1) * 99 / 100) / 1e3 : 0;
+    allocs = n > 0 ? (double) b->allocs / n : 0;
+
+    // peak resident set of the whole process so far, in kilobytes
+    getrusage(RUSAGE_SELF, &usage);
+
+    switch (output) {
+    case OUTPUT_TEXT:
+        printf("%-16s %-9s subjects=%-6d bytes=%-9zu %11.0f ops/s  p50=%10.2f us"
+               "  p99=%10.2f us  allocs/op=%9.1f  rss=%ld KB\n",
+               b->name, b->variant, b->subjects, b->bytes, ops_per_sec, p50, p99,
+               allocs, usage.ru_maxrss);
+        break;
+    case OUTPUT_CSV:
+        if (!reported)
+            printf("name,variant,subjects,bytes,ops,ops_per_sec,p50_us,p99_us,"
+                   "allocs_per_op,peak_rss_kb\n");
+        printf("%s,%s,%d,%zu,%u,%.1f,%.3f,%.3f,%.1f,%ld\n",
+               b->name, b->variant, b->subjects, b->bytes, n, ops_per_sec, p50, p99,
+               allocs, usage.ru_maxrss);
+        break;
+    case OUTPUT_JSON:
+        printf("%s  {\"name\": \"%s\", \"variant\": \"%s\", \"subjects\": %d, \"bytes\": %zu, "
+               "\"ops\": %u, \"ops_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+               "\"allocs_per_op\": %.1f, \"peak_rss_kb\": %ld}",
+               reported ? ",\n" : "[\n", b->name, b->variant, b->subjects, b->bytes, n,
+               ops_per_sec, p50, p99, allocs, usage.ru_maxrss);
+        break;
+    }
+
+    reported = 1;
+    fflush(stdout);
+
+    g_array_free(b->samples, TRUE);
+    g_free(b);
+}
+
+/* n subjects, each with a title, a creator and a dc:source link */
+static recontext*
+bench_graph(int n, recontext_storage storage)
+{
+    recontext *rc;
+    int i;
+
+    rc = recontext_new_with_storage(BENCH_SUBJECT, storage);
+
+    for (i = 0; i < n; i++) {
+        gchar *subject = g_strdup_printf("http://example.org/asset/%d", i);
+        gchar *source = g_strdup_printf("http://example.org/asset/%d", i + 1);
+        gchar *title = g_strdup_printf("Asset number %d", i);
+
+        librdf_model_add(rc->model,
+            librdf_new_node_from_uri_string(rc->world, (const unsigned char *) subject),
+            librdf_new_node_from_uri_string(rc->world, (const unsigned char *) "http://purl.org/dc/elements/1.1/title"),
+            librdf_new_node_from_literal(rc->world, (const unsigned char *) title, NULL, 0));
+        librdf_model_add(rc->model,
+            librdf_new_node_from_uri_string(rc->world, (const unsigned char *) subject),
+            librdf_new_node_from_uri_string(rc->world, (const unsigned char *) "http://purl.org/dc/elements/1.1/creator"),
+            librdf_new_node_from_literal(rc->world, (const unsigned char *) "Example Creator", NULL, 0));
+        librdf_model_add(rc->model,
+            librdf_new_node_from_uri_string(rc->world, (const unsigned char *) subject),
+            librdf_new_node_from_uri_string(rc->world, (const unsigned char *) "http://purl.org/dc/elements/1.1/source"),
+            librdf_new_node_from_uri_string(rc->world, (const unsigned char *) source));
+
+        g_free(subject);
+        g_free(source);
+        g_free(title);
+    }
+
+    // the graph was built behind the library's back
+    recontext_touch(rc, NULL);
+    return rc;
+}
+
+/* the RDF/XML corpus wrapped in an XMP packet */
+static char*
+bench_xmp(const char *rdfxml)
+{
+    const char *rdf = strstr(rdfxml, "<rdf:RDF");
+
+    return g_strconcat("<?xpacket begin=\"\xef\xbb\xbf\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>\n"
+                       "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">\n",
+                       rdf != NULL ? rdf : rdfxml,
+                       "</x:xmpmeta>\n<?xpacket end=\"w\"?>", NULL);
+}
+
+static void
+bench_new_cases(int n, recontext *graph)
+{
+    bench *b;
+    char *corpus[G_N_ELEMENTS(formats)];
+    size_t length[G_N_ELEMENTS(formats)];
+    char *xmp;
+    gchar *filename;
+    guint i;
+    int fd, r;
+
+    b = bench_new("new", "-", n);
+    for (r = 0; r < rounds; r++) {
+        recontext *rc;
+
+        bench_start(b);
+        rc = recontext_new(BENCH_SUBJECT);
+        bench_stop(b);
+        recontext_destroy(rc);
+    }
+    bench_report(b);
+
+    // the cost per object before worlds were shared: a world of its own
+    b = bench_new("new", "own_world", n);
+    for (r = 0; r < rounds; r++) {
+        librdf_world *world;
+        recontext *rc;
+
+        bench_start(b);
+        world = librdf_new_world();
+        librdf_world_open(world);
+        rc = recontext_new(BENCH_SUBJECT);
+        bench_stop(b);
+        recontext_destroy(rc);
+        librdf_free_world(world);
+    }
+    bench_report(b);
+
+    for (i = 0; i < G_N_ELEMENTS(formats); i++) {
+        corpus[i] = recontext_serialize_fmt(graph, formats[i].format, &length[i]);
+
+        b = bench_new("new_from_string", formats[i].name, n);
+        b->bytes = length[i];
+        for (r = 0; r < rounds; r++) {
+            recontext *rc;
+
+            bench_start(b);
+            rc = recontext_new_from_string_fmt(corpus[i], BENCH_SUBJECT, formats[i].format);
+            bench_stop(b);
+            recontext_destroy(rc);
+        }
+        bench_report(b);
+    }
+
+    b = bench_new("new_focused", "rdfxml", n);
+    b->bytes = length[0];
+    for (r = 0; r < rounds; r++) {
+        recontext *rc;
+
+        bench_start(b);
+        rc = recontext_new_focused(corpus[0], length[0], BENCH_SUBJECT, RECONTEXT_FORMAT_RDFXML, NULL);
+        bench_stop(b);
+        recontext_destroy(rc);
+    }
+    bench_report(b);
+
+    xmp = bench_xmp(corpus[0]);
+    b = bench_new("new_from_xmp", "-", n);
+    b->bytes = strlen(xmp);
+    for (r = 0; r < rounds; r++) {
+        recontext *rc;
+
+        bench_start(b);
+        rc = recontext_new_from_xmp(xmp, BENCH_SUBJECT);
+        bench_stop(b);
+        recontext_destroy(rc);
+    }
+    bench_report(b);
+    g_free(xmp);
+
+    fd = g_file_open_tmp("bench_recontext-XXXXXX.rdf", &filename, NULL);
+    if (fd >= 0) {
+        close(fd);
+        g_file_set_contents(filename, corpus[0], length[0], NULL);
+
+        b = bench_new("new_from_file", "rdfxml", n);
+        b->bytes = length[0];
+        for (r = 0; r < rounds; r++) {
+            recontext *rc;
+
+            bench_start(b);
+            rc = recontext_new_from_file(filename, BENCH_SUBJECT);
+            bench_stop(b);
+            recontext_destroy(rc);
+        }
+        bench_report(b);
+
+        g_unlink(filename);
+        g_free(filename);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(formats); i++)
+        g_free(corpus[i]);
+}
+
+static void
+bench_extract_cases(int n)
+{
+    guint i;
+    int r;
+
+    for (i = 0; i < G_N_ELEMENTS(storages); i++) {
+        recontext *rc = bench_graph(n, storages[i].storage);
+        bench *b = bench_new("extract", storages[i].name, n);
+
+        for (r = 0; r < rounds; r++) {
+            gchar *subject = g_strdup_printf("http://example.org/asset/%d", (r * 7919) % n);
+            recontext *extracted;
+
+            bench_start(b);
+            extracted = recontext_extract(rc, subject, 0);
+            bench_stop(b);
+
+            recontext_destroy(extracted);
+            g_free(subject);
+        }
+
+        bench_report(b);
+        recontext_destroy(rc);
+    }
+}
+
+static void
+bench_merge_cases(int n, recontext *graph)
+{
+    bench *b = bench_new("merge", "-", n);
+    int r;
+
+    for (r = 0; r < rounds; r++) {
+        recontext *rc = recontext_new("http://example.org/collection");
+
+        bench_start(b);
+        recontext_merge(rc, graph, NULL);
+        bench_stop(b);
+        recontext_destroy(rc);
+    }
+
+    bench_report(b);
+}
+
+static void
+bench_serialize_cases(int n, recontext *graph)
+{
+    guint i;
+    int r;
+
+    for (i = 0; i < G_N_ELEMENTS(formats); i++) {
+        bench *b = bench_new("serialize", formats[i].name, n);
+
+        for (r = 0; r < rounds; r++) {
+            char *data;
+
+            // serialize for real every time, not from the cache
+            recontext_touch(graph, NULL);
+            bench_start(b);
+            data = recontext_serialize_fmt(graph, formats[i].format, &b->bytes);
+            bench_stop(b);
+            g_free(data);
+        }
+
+        bench_report(b);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(formats); i++) {
+        bench *b = bench_new("serialize_cached", formats[i].name, n);
+
+        for (r = 0; r < rounds; r++) {
+            char *data;
+
+            bench_start(b);
+            data = recontext_serialize_fmt(graph, formats[i].format, &b->bytes);
+            bench_stop(b);
+            g_free(data);
+        }
+
+        bench_report(b);
+    }
+}
+
+static void
+bench_diff_cases(int n, recontext *graph)
+{
+    recontext *copy;
+    bench *b;
+    char *data;
+    int r;
+
+    // an equal graph that does not share its nodes with the original
+    data = recontext_serialize_fmt(graph, RECONTEXT_FORMAT_NTRIPLES, NULL);
+    copy = recontext_new_from_string_fmt(data, BENCH_SUBJECT, RECONTEXT_FORMAT_NTRIPLES);
+    g_free(data);
+
+    b = bench_new("hash", "-", n);
+    for (r = 0; r < rounds; r++) {
+        char *digest;
+
+        bench_start(b);
+        digest = recontext_hash(graph);
+        bench_stop(b);
+        g_free(digest);
+    }
+    bench_report(b);
+
+    b = bench_new("diff", "-", n);
+    for (r = 0; r < rounds; r++) {
+        bench_start(b);
+        recontext_diff(graph, copy, NULL, NULL);
+        bench_stop(b);
+    }
+    bench_report(b);
+
+    recontext_destroy(copy);
+}
+
+static void
+bench_write_exiv2_cases(int n, recontext *graph)
+{
+    bench *b = bench_new("write_exiv2", "-", n);
+    GExiv2Metadata *metadata;
+    int r;
+
+    for (r = 0; r < rounds; r++) {
+        metadata = gexiv2_metadata_new();
+
+        if (!gexiv2_metadata_open_buf(metadata, bench_jpeg, sizeof(bench_jpeg), NULL)) {
+            g_object_unref(metadata);
+            break;
+        }
+
+        bench_start(b);
+        recontext_write_exiv2(graph, metadata);
+        bench_stop(b);
+        g_object_unref(metadata);
+    }
+
+    bench_report(b);
+
+    // an editor saving again after changing a single property
+    b = bench_new("write_exiv2_resave", "-", n);
+    metadata = gexiv2_metadata_new();
+
+    if (gexiv2_metadata_open_buf(metadata, bench_jpeg, sizeof(bench_jpeg), NULL)) {
+        recontext_write_exiv2(graph, metadata);
+
+        for (r = 0; r < rounds; r++) {
+            recontext_touch(graph, "http://purl.org/dc/elements/1.1/title");
+            bench_start(b);
+            recontext_write_exiv2(graph, metadata);
+            bench_stop(b);
+        }
+    }
+
+    g_object_unref(metadata);
+    bench_report(b);
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar **size_list;
+    guint i;
+
+    context = g_option_context_new(NULL);
+    g_option_context_set_summary(context, "Benchmark the public librecontext entry points.");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "bench_recontext: %s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (strcmp(output_name, "csv") == 0)
+        output = OUTPUT_CSV;
+    else if (strcmp(output_name, "json") == 0)
+        output = OUTPUT_JSON;
+    else if (strcmp(output_name, "text") != 0) {
+        fprintf(stderr, "bench_recontext: unknown output format %s\n", output_name);
+        return 1;
+    }
+
+    recontext_init();
+    gexiv2_initialize();
+
+    size_list = g_strsplit(sizes, ",", -1);
+    for (i = 0; size_list[i] != NULL; i++) {
+        int n = atoi(size_list[i]);
+        recontext *graph;
+
+        if (n <= 0)
+            continue;
+
+        graph = bench_graph(n, RECONTEXT_STORAGE_DEFAULT);
+
+        bench_new_cases(n, graph);
+        bench_extract_cases(n);
+        bench_merge_cases(n, graph);
+        bench_serialize_cases(n, graph);
+        bench_diff_cases(n, graph);
+        bench_write_exiv2_cases(n, graph);
+
+        recontext_destroy(graph);
+    }
+    g_strfreev(size_list);
+
+    if (output == OUTPUT_JSON)
+        printf(reported ? "\n]\n" : "[]\n");
+
+    recontext_cleanup();
+    return 0;
+}
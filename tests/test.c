@@ -1,12 +1,1710 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
 #include <recontext.h>
+#include <recontext_async.h>
+#include <recontext_batch.h>
+#include <recontext_gexiv2.h>
+#include <recontext_media.h>
+
+static const char *test_rdf =
+    "<?xml version='1.0'?>"
+    "<rdf:RDF xmlns:rdf='http://www.w3.org/1999/02/22-rdf-syntax-ns#'"
+    "         xmlns:dc='http://purl.org/dc/elements/1.1/'"
+    "         xmlns:dcterms='http://purl.org/dc/terms/'>"
+    "  <rdf:Description rdf:about='http://example.org/a'>"
+    "    <dc:source>literal source</dc:source>"
+    "    <dcterms:source rdf:resource='http://example.org/b'/>"
+    "    <dc:creator><rdf:Seq>"
+    "      <rdf:li>first</rdf:li><rdf:li>second</rdf:li><rdf:li>third</rdf:li>"
+    "      <rdf:li>4</rdf:li><rdf:li>5</rdf:li><rdf:li>6</rdf:li>"
+    "      <rdf:li>7</rdf:li><rdf:li>8</rdf:li><rdf:li>9</rdf:li>"
+    "      <rdf:li>tenth</rdf:li>"
+    "    </rdf:Seq></dc:creator>"
+    "  </rdf:Description>"
+    "  <rdf:Description rdf:about='http://example.org/b'>"
+    "    <dc:source><rdf:Alt>"
+    "      <rdf:li>alt one</rdf:li><rdf:li>alt two</rdf:li>"
+    "    </rdf:Alt></dc:source>"
+    "    <dcterms:creator><rdf:Bag>"
+    "      <rdf:li rdf:resource='http://example.org/c'/><rdf:li>bag two</rdf:li>"
+    "    </rdf:Bag></dcterms:creator>"
+    "  </rdf:Description>"
+    "</rdf:RDF>";
+
+static const char *source_predicates[] = {
+    "http://purl.org/dc/elements/1.1/source",
+    "http://purl.org/dc/terms/source",
+    NULL
+};
+
+static const char *creator_predicates[] = {
+    "http://purl.org/dc/elements/1.1/creator",
+    "http://purl.org/dc/terms/creator",
+    NULL
+};
+
+static int
+compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void
+assert_same_values(char **a, char **b)
+{
+    guint length = g_strv_length(a);
+    guint i;
+
+    assert(length == g_strv_length(b));
+
+    qsort(a, length, sizeof(char *), compare_strings);
+    qsort(b, length, sizeof(char *), compare_strings);
+
+    for (i = 0; i < length; i++)
+        assert(strcmp(a[i], b[i]) == 0);
+}
+
+static void
+test_new()
+{
+    recontext* rc;
+
+    rc = recontext_new(NULL);
+    assert(strncmp(recontext_get_main_subject(rc), "urn:uuid:", 9) == 0);
+    recontext_destroy(rc);
+}
+
+static void
+test_values()
+{
+    recontext* rc;
+    char **native;
+    char **sparql;
+    int i;
+
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+
+    // Seq members come back in rdf:_N order from the native path
+    native = recontext_get_values(rc, "http://example.org/a", creator_predicates);
+    assert(g_strv_length(native) == 10);
+    assert(strcmp(native[0], "first") == 0);
+    assert(strcmp(native[9], "tenth") == 0);
+    g_strfreev(native);
+
+    // Alt contributes its first member only
+    native = recontext_get_values(rc, "http://example.org/b", source_predicates);
+    assert(g_strv_length(native) == 1);
+    assert(strcmp(native[0], "alt one") == 0);
+    g_strfreev(native);
+
+    native = recontext_get_values(rc, NULL, source_predicates);
+    sparql = recontext_query_values(rc, NULL, source_predicates);
+    assert(g_strv_length(native) == 3);
+    assert_same_values(native, sparql);
+    g_strfreev(native);
+    g_strfreev(sparql);
+
+    native = recontext_get_values(rc, NULL, creator_predicates);
+    sparql = recontext_query_values(rc, NULL, creator_predicates);
+    assert(g_strv_length(native) == 12);
+    assert_same_values(native, sparql);
+    g_strfreev(native);
+    g_strfreev(sparql);
+
+    // more subjects than the query cache holds, then a query evicted early
+    for (i = 0; i < 100; i++) {
+        gchar *subject = g_strdup_printf("http://example.org/%d", i);
+
+        sparql = recontext_query_values(rc, subject, source_predicates);
+        assert(g_strv_length(sparql) == 0);
+        g_strfreev(sparql);
+        g_free(subject);
+    }
+
+    sparql = recontext_query_values(rc, NULL, source_predicates);
+    assert(g_strv_length(sparql) == 3);
+    g_strfreev(sparql);
+
+    recontext_destroy(rc);
+}
+
+static void
+test_serialize()
+{
+    recontext* rc;
+    char *output;
+    size_t length;
+    size_t size;
+
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+
+    output = recontext_serialize_counted(rc, &length);
+    assert(output != NULL);
+    assert(length == strlen(output));
+    assert(strstr(output, "rdf:RDF") != NULL);
+    size = recontext_serialize_size(rc);
+    assert(size == length);
+    g_free(output);
+
+    recontext_destroy(rc);
+}
+
+static void
+test_formats()
+{
+    recontext* rc;
+    recontext* copy;
+    char *output;
+    char **values;
+
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+
+    output = recontext_serialize_fmt(rc, RECONTEXT_FORMAT_NTRIPLES, NULL);
+    copy = recontext_new_from_string_fmt(output, "http://example.org/a", RECONTEXT_FORMAT_AUTO);
+    assert(librdf_model_size(copy->model) == librdf_model_size(rc->model));
+    recontext_destroy(copy);
+    g_free(output);
+
+    // Turtle keeps absolute IRIs, so reading it back needs no base
+    output = recontext_serialize_fmt(rc, RECONTEXT_FORMAT_TURTLE, NULL);
+    assert(strstr(output, "<http://example.org/a>") != NULL);
+    copy = recontext_new_from_string_fmt(output, "http://example.org/other",
+                                         RECONTEXT_FORMAT_TURTLE);
+    values = recontext_get_values(copy, "http://example.org/a", creator_predicates);
+    assert(g_strv_length(values) == 10);
+    g_strfreev(values);
+    recontext_destroy(copy);
+    g_free(output);
+
+    recontext_destroy(rc);
+}
+
+static void
+test_file()
+{
+    recontext* rc;
+    recontext* loaded;
+    gchar *filename;
+    gboolean written;
+
+    loaded = recontext_new_from_file("/nonexistent/file.rdf", NULL);
+    assert(loaded == NULL);
+
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+    filename = g_build_filename(g_get_tmp_dir(), "test_recontext.rdf", NULL);
+    written = g_file_set_contents(filename, test_rdf, -1, NULL);
+    assert(written);
+
+    loaded = recontext_new_from_file(filename, "http://example.org/a");
+    assert(loaded != NULL);
+    assert(librdf_model_size(loaded->model) == librdf_model_size(rc->model));
+
+    recontext_destroy(loaded);
+    recontext_destroy(rc);
+    g_unlink(filename);
+    g_free(filename);
+}
+
+/* a minimal JPEG: SOI, XMP in APP1, then start of scan */
+static GByteArray*
+test_jpeg(const char *packet, size_t packet_length)
+{
+    static const char app1_signature[] = "http://ns.adobe.com/xap/1.0/";
+    static const unsigned char soi[] = { 0xff, 0xd8, 0xff, 0xe1 };
+    static const unsigned char sos[] = { 0xff, 0xda, 0x00, 0x02, 0x00, 0xff, 0xd9 };
+    GByteArray *jpeg;
+    size_t segment;
+    guint8 length[2];
+
+    segment = 2 + sizeof(app1_signature) + packet_length;
+    length[0] = segment >> 8;
+    length[1] = segment & 0xff;
+
+    jpeg = g_byte_array_new();
+    g_byte_array_append(jpeg, soi, sizeof(soi));
+    g_byte_array_append(jpeg, length, 2);
+    g_byte_array_append(jpeg, (const guint8 *) app1_signature, sizeof(app1_signature));
+    g_byte_array_append(jpeg, (const guint8 *) packet, packet_length);
+    g_byte_array_append(jpeg, sos, sizeof(sos));
+
+    return jpeg;
+}
+
+static void
+test_media()
+{
+    GByteArray *jpeg;
+    GString *packet;
+    recontext *rc;
+    char **values;
+
+    rc = recontext_new_from_xmp("<x:xmpmeta/>", NULL);
+    assert(rc == NULL);
+
+    packet = g_string_new("<?xpacket begin='' id='W5M0MpCehiHzreSzNTczkc9d'?>");
+    g_string_append(packet, strstr(test_rdf, "<rdf:RDF"));
+    g_string_append(packet, "<?xpacket end='w'?>");
+
+    jpeg = test_jpeg(packet->str, packet->len);
+
+    rc = recontext_new_from_media_buffer(jpeg->data, jpeg->len, "http://example.org/a");
+    assert(rc != NULL);
+    values = recontext_get_values(rc, "http://example.org/a", creator_predicates);
+    assert(g_strv_length(values) == 10);
+    g_strfreev(values);
+    recontext_destroy(rc);
+
+    // unknown container, found by packet scanning
+    rc = recontext_new_from_media_buffer(packet->str, packet->len, "http://example.org/a");
+    assert(rc != NULL);
+    recontext_destroy(rc);
+
+    g_byte_array_free(jpeg, TRUE);
+    g_string_free(packet, TRUE);
+}
+
+static void
+test_append_u16(GByteArray *array, guint16 value, gboolean little)
+{
+    guint8 bytes[2];
+
+    bytes[little ? 0 : 1] = value & 0xff;
+    bytes[little ? 1 : 0] = value >> 8;
+    g_byte_array_append(array, bytes, 2);
+}
+
+static void
+test_append_u32(GByteArray *array, guint32 value, gboolean little)
+{
+    test_append_u16(array, little ? value & 0xffff : value >> 16, little);
+    test_append_u16(array, little ? value >> 16 : value & 0xffff, little);
+}
+
+static void
+test_patch_u32(GByteArray *array, size_t offset, guint32 value, gboolean little)
+{
+    GByteArray *bytes = g_byte_array_new();
+
+    test_append_u32(bytes, value, little);
+    memcpy(array->data + offset, bytes->data, 4);
+    g_byte_array_free(bytes, TRUE);
+}
+
+/* the located range of the first length bytes, or 0 when nothing is found */
+static int
+test_locate_range(GByteArray *file, size_t length, recontext_media_type expected,
+                  size_t *offset, size_t *xmp_length)
+{
+    recontext_media_type type;
+    int found;
+
+    found = recontext_locate_xmp(file->data, length, offset, xmp_length, &type);
+    assert(type == expected);
+    return found;
+}
+
+static void
+test_assert_located(GByteArray *file, recontext_media_type expected,
+                    size_t packet_offset, size_t packet_length)
+{
+    size_t offset;
+    size_t xmp_length;
+    int found;
+
+    found = test_locate_range(file, file->len, expected, &offset, &xmp_length);
+    assert(found);
+    assert(offset == packet_offset);
+    assert(xmp_length == packet_length);
+}
+
+static void
+test_assert_not_located(GByteArray *file, size_t length, recontext_media_type expected)
+{
+    size_t offset;
+    size_t xmp_length;
+    int found;
+
+    found = test_locate_range(file, length, expected, &offset, &xmp_length);
+    assert(!found);
+}
+
+static void
+test_locate_png(const char *packet, size_t packet_length)
+{
+    static const char signature[] = "\x89PNG\r\n\x1a\n";
+    static const char keyword[] = "XML:com.adobe.xmp";
+    static const guint8 itxt_flags[] = { 0, 0, 0, 0 };
+    static const guint8 ihdr[13] = { 0 };
+    static const guint8 crc[4] = { 0 };
+    GByteArray *png = g_byte_array_new();
+    size_t itxt;
+    size_t packet_offset;
+
+    g_byte_array_append(png, (const guint8 *) signature, 8);
+    test_append_u32(png, sizeof(ihdr), FALSE);
+    g_byte_array_append(png, (const guint8 *) "IHDR", 4);
+    g_byte_array_append(png, ihdr, sizeof(ihdr));
+    g_byte_array_append(png, crc, sizeof(crc));
+
+    // keyword, compression flag and method, empty language and translation
+    itxt = png->len;
+    test_append_u32(png, sizeof(keyword) + sizeof(itxt_flags) + packet_length, FALSE);
+    g_byte_array_append(png, (const guint8 *) "iTXt", 4);
+    g_byte_array_append(png, (const guint8 *) keyword, sizeof(keyword));
+    g_byte_array_append(png, itxt_flags, sizeof(itxt_flags));
+    packet_offset = png->len;
+    g_byte_array_append(png, (const guint8 *) packet, packet_length);
+    g_byte_array_append(png, crc, sizeof(crc));
+
+    test_append_u32(png, 0, FALSE);
+    g_byte_array_append(png, (const guint8 *) "IEND", 4);
+    g_byte_array_append(png, crc, sizeof(crc));
+
+    test_assert_located(png, RECONTEXT_MEDIA_PNG, packet_offset, packet_length);
+
+    // truncated inside the iTXt chunk, or before its CRC
+    test_assert_not_located(png, packet_offset + 10, RECONTEXT_MEDIA_PNG);
+    test_assert_not_located(png, packet_offset + packet_length, RECONTEXT_MEDIA_PNG);
+    test_assert_not_located(png, itxt + 6, RECONTEXT_MEDIA_PNG);
+
+    // compressed XMP is not located
+    png->data[itxt + 8 + sizeof(keyword)] = 1;
+    test_assert_not_located(png, png->len, RECONTEXT_MEDIA_PNG);
+    png->data[itxt + 8 + sizeof(keyword)] = 0;
+
+    // a chunk length past the end of the file
+    test_patch_u32(png, itxt, 0xfffffff0, FALSE);
+    test_assert_not_located(png, png->len, RECONTEXT_MEDIA_PNG);
+
+    g_byte_array_free(png, TRUE);
+}
+
+/* a TIFF header and a first IFD holding only tag 700 */
+static GByteArray*
+test_tiff(const guint8 *value, size_t value_length, gboolean little)
+{
+    GByteArray *tiff = g_byte_array_new();
+
+    g_byte_array_append(tiff, (const guint8 *) (little ? "II" : "MM"), 2);
+    test_append_u16(tiff, 42, little);
+    test_append_u32(tiff, 8, little);
+
+    test_append_u16(tiff, 1, little);
+    test_append_u16(tiff, 700, little);
+    test_append_u16(tiff, 7, little);
+    test_append_u32(tiff, value_length, little);
+    if (value_length <= 4) {
+        guint8 inline_value[4] = { 0 };
+
+        memcpy(inline_value, value, value_length);
+        g_byte_array_append(tiff, inline_value, 4);
+        test_append_u32(tiff, 0, little);
+    } else {
+        test_append_u32(tiff, 26, little);
+        test_append_u32(tiff, 0, little);
+        g_byte_array_append(tiff, value, value_length);
+    }
+
+    return tiff;
+}
+
+static void
+test_locate_tiff(const char *packet, size_t packet_length)
+{
+    gboolean little;
+    GByteArray *tiff;
+
+    for (little = FALSE; little <= TRUE; little++) {
+        tiff = test_tiff((const guint8 *) packet, packet_length, little);
+        test_assert_located(tiff, RECONTEXT_MEDIA_TIFF, 26, packet_length);
+
+        // truncated value, IFD and header
+        test_assert_not_located(tiff, tiff->len - 1, RECONTEXT_MEDIA_TIFF);
+        test_assert_not_located(tiff, 20, RECONTEXT_MEDIA_TIFF);
+        test_assert_not_located(tiff, 9, RECONTEXT_MEDIA_TIFF);
+
+        // value offset past the end of the file
+        test_patch_u32(tiff, 18, tiff->len, little);
+        test_assert_not_located(tiff, tiff->len, RECONTEXT_MEDIA_TIFF);
+        test_patch_u32(tiff, 18, 26, little);
+
+        // value length past the end of the file
+        test_patch_u32(tiff, 14, 0xfffffff0, little);
+        test_assert_not_located(tiff, tiff->len, RECONTEXT_MEDIA_TIFF);
+        test_patch_u32(tiff, 14, packet_length, little);
+
+        // IFD offset past the end of the file
+        test_patch_u32(tiff, 4, tiff->len, little);
+        test_assert_not_located(tiff, tiff->len, RECONTEXT_MEDIA_TIFF);
+        test_patch_u32(tiff, 4, 8, little);
+
+        // an entry count larger than the IFD
+        tiff->data[little ? 9 : 8] = 0xff;
+        test_assert_not_located(tiff, tiff->len, RECONTEXT_MEDIA_TIFF);
+        g_byte_array_free(tiff, TRUE);
+
+        // short values live in the entry itself
+        tiff = test_tiff((const guint8 *) "<x/>", 4, little);
+        test_assert_located(tiff, RECONTEXT_MEDIA_TIFF, 18, 4);
+        g_byte_array_free(tiff, TRUE);
+    }
+}
+
+static void
+test_append_box(GByteArray *array, const char *type, size_t size)
+{
+    test_append_u32(array, size, FALSE);
+    g_byte_array_append(array, (const guint8 *) type, 4);
+}
+
+static void
+test_locate_bmff(const char *packet, size_t packet_length)
+{
+    static const guint8 xmp_uuid[16] = {
+        0xbe, 0x7a, 0xcf, 0xcb, 0x97, 0xa9, 0x42, 0xe8,
+        0x9c, 0x71, 0x99, 0x94, 0x91, 0xe3, 0xaf, 0xac
+    };
+    GByteArray *mp4 = g_byte_array_new();
+    GByteArray *mov = g_byte_array_new();
+    size_t box;
+
+    test_append_box(mp4, "ftyp", 16);
+    g_byte_array_append(mp4, (const guint8 *) "isom", 4);
+    test_append_u32(mp4, 0, FALSE);
+    test_append_box(mp4, "free", 8);
+    box = mp4->len;
+    test_append_box(mp4, "uuid", 8 + 16 + packet_length);
+    g_byte_array_append(mp4, xmp_uuid, sizeof(xmp_uuid));
+    g_byte_array_append(mp4, (const guint8 *) packet, packet_length);
+
+    test_assert_located(mp4, RECONTEXT_MEDIA_BMFF, box + 24, packet_length);
+
+    // truncated inside the uuid box and inside its header
+    test_assert_not_located(mp4, mp4->len - 1, RECONTEXT_MEDIA_BMFF);
+    test_assert_not_located(mp4, box + 12, RECONTEXT_MEDIA_BMFF);
+
+    // a box extending to the end of the file
+    test_patch_u32(mp4, box, 0, FALSE);
+    test_assert_located(mp4, RECONTEXT_MEDIA_BMFF, box + 24, packet_length);
+
+    // box sizes smaller than the header or past the end of the file
+    test_patch_u32(mp4, box, 4, FALSE);
+    test_assert_not_located(mp4, mp4->len, RECONTEXT_MEDIA_BMFF);
+    test_patch_u32(mp4, box, mp4->len, FALSE);
+    test_assert_not_located(mp4, mp4->len, RECONTEXT_MEDIA_BMFF);
+
+    // a 64-bit size truncated to its first half
+    test_patch_u32(mp4, box, 1, FALSE);
+    test_assert_not_located(mp4, box + 12, RECONTEXT_MEDIA_BMFF);
+    g_byte_array_free(mp4, TRUE);
+
+    // QuickTime keeps XMP in moov/udta/XMP_
+    test_append_box(mov, "ftyp", 12);
+    g_byte_array_append(mov, (const guint8 *) "qt  ", 4);
+    test_append_box(mov, "moov", 8 + 8 + 8 + packet_length);
+    test_append_box(mov, "udta", 8 + 8 + packet_length);
+    box = mov->len;
+    test_append_box(mov, "XMP_", 8 + packet_length);
+    g_byte_array_append(mov, (const guint8 *) packet, packet_length);
+
+    test_assert_located(mov, RECONTEXT_MEDIA_BMFF, box + 8, packet_length);
+    test_assert_not_located(mov, mov->len - 1, RECONTEXT_MEDIA_BMFF);
+
+    // an XMP_ box larger than its parent
+    test_patch_u32(mov, box, 8 + packet_length + 1, FALSE);
+    test_assert_not_located(mov, mov->len, RECONTEXT_MEDIA_BMFF);
+    test_patch_u32(mov, box, 8 + packet_length, FALSE);
+
+    // udta is only searched directly below moov
+    memcpy(mov->data + 24, "moov", 4);
+    test_assert_not_located(mov, mov->len, RECONTEXT_MEDIA_BMFF);
+    g_byte_array_free(mov, TRUE);
+}
+
+static void
+test_locate_pdf(const char *packet, size_t packet_length)
+{
+    static const char update[] =
+        "<?xpacket begin='' id='W5M0MpCehiHzreSzNTczkc9d'?><x:xmpmeta xmlns:x='adobe:ns:meta/'/>"
+        "<?xpacket end='w'?>";
+    GByteArray *pdf = g_byte_array_new();
+    size_t first;
+    size_t last;
+
+    g_byte_array_append(pdf, (const guint8 *) "%PDF-1.4\n1 0 obj\n", 17);
+    first = pdf->len;
+    g_byte_array_append(pdf, (const guint8 *) packet, packet_length);
+    g_byte_array_append(pdf, (const guint8 *) "\nendobj\n2 0 obj\n", 16);
+    last = pdf->len;
+    g_byte_array_append(pdf, (const guint8 *) update, sizeof(update) - 1);
+    g_byte_array_append(pdf, (const guint8 *) "\nendobj\n%%EOF\n", 14);
+
+    // incremental updates append metadata, the last packet wins
+    test_assert_located(pdf, RECONTEXT_MEDIA_PDF, last, sizeof(update) - 1);
+
+    // an update cut before its trailer closes leaves the earlier packet
+    g_byte_array_set_size(pdf, last + sizeof(update) - 3);
+    test_assert_located(pdf, RECONTEXT_MEDIA_PDF, first, packet_length);
+
+    // a trailer that never closes is not located
+    g_byte_array_set_size(pdf, first + packet_length - 3);
+    test_assert_not_located(pdf, pdf->len, RECONTEXT_MEDIA_PDF);
+    g_byte_array_free(pdf, TRUE);
+}
+
+static void
+test_locate()
+{
+    GString *packet;
+    GByteArray *jpeg;
+
+    packet = g_string_new("<?xpacket begin='' id='W5M0MpCehiHzreSzNTczkc9d'?>");
+    g_string_append(packet, strstr(test_rdf, "<rdf:RDF"));
+    g_string_append(packet, "<?xpacket end='w'?>");
+
+    // APP1 is found from its segment length, which must fit in the file
+    jpeg = test_jpeg(packet->str, packet->len);
+    test_assert_located(jpeg, RECONTEXT_MEDIA_JPEG,
+                        4 + 2 + sizeof("http://ns.adobe.com/xap/1.0/"), packet->len);
+    test_assert_not_located(jpeg, 4 + 2 + packet->len, RECONTEXT_MEDIA_JPEG);
+    g_byte_array_free(jpeg, TRUE);
+
+    test_locate_png(packet->str, packet->len);
+    test_locate_tiff(packet->str, packet->len);
+    test_locate_bmff(packet->str, packet->len);
+    test_locate_pdf(packet->str, packet->len);
+
+    g_string_free(packet, TRUE);
+}
+
+static void
+test_xmp_in_place()
+{
+    static const char *title_predicates[] = { "http://purl.org/dc/elements/1.1/title", NULL };
+    GByteArray *jpeg;
+    recontext *rc;
+    char *packet;
+    char *contents;
+    gchar *filename;
+    size_t packet_length;
+    gsize length;
+    char **values;
+    gboolean ok;
+    int status;
+
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+    packet = recontext_to_xmp_packet(rc, 1024, &packet_length);
+    assert(g_str_has_prefix(packet, "<?xpacket begin="));
+    assert(g_str_has_suffix(packet, "<?xpacket end=\"w\"?>"));
+    assert(packet_length == strlen(packet));
+
+    jpeg = test_jpeg(packet, packet_length);
+    filename = g_build_filename(g_get_tmp_dir(), "test_recontext.jpg", NULL);
+    ok = g_file_set_contents(filename, (const gchar *) jpeg->data, jpeg->len, NULL);
+    assert(ok);
+    g_free(packet);
+
+    // the padding takes the new title, the file keeps its size
+    status = recontext_add(rc,
+        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) "http://example.org/a"),
+        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) title_predicates[0]),
+        librdf_new_node_from_literal(rc->world, (const unsigned char *) "in place", NULL, 0));
+    assert(status == 0);
+    status = recontext_write_xmp_in_place(rc, filename);
+    assert(status == 0);
+    recontext_destroy(rc);
+
+    ok = g_file_get_contents(filename, &contents, &length, NULL);
+    assert(ok);
+    assert(length == jpeg->len);
+    g_free(contents);
+
+    rc = recontext_new_from_media_file(filename, "http://example.org/a");
+    assert(rc != NULL);
+    values = recontext_get_values(rc, "http://example.org/a", title_predicates);
+    assert(g_strv_length(values) == 1);
+    assert(strcmp(values[0], "in place") == 0);
+    g_strfreev(values);
+    recontext_destroy(rc);
+
+    // a packet without room is left alone
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+    packet = recontext_to_xmp_packet(rc, 0, &packet_length);
+    g_byte_array_free(jpeg, TRUE);
+    jpeg = test_jpeg(packet, packet_length);
+    ok = g_file_set_contents(filename, (const gchar *) jpeg->data, jpeg->len, NULL);
+    assert(ok);
+    g_free(packet);
+
+    status = recontext_add(rc,
+        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) "http://example.org/a"),
+        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) title_predicates[0]),
+        librdf_new_node_from_literal(rc->world, (const unsigned char *) "no room", NULL, 0));
+    assert(status == 0);
+    status = recontext_write_xmp_in_place(rc, filename);
+    assert(status != 0);
+
+    ok = g_file_get_contents(filename, &contents, &length, NULL);
+    assert(ok);
+    assert(length == jpeg->len && memcmp(contents, jpeg->data, length) == 0);
+    g_free(contents);
+
+    recontext_destroy(rc);
+    g_byte_array_free(jpeg, TRUE);
+    g_unlink(filename);
+    g_free(filename);
+}
+
+static const char *test_xmp_creators =
+    "<?xpacket begin='' id='W5M0MpCehiHzreSzNTczkc9d'?>"
+    "<x:xmpmeta xmlns:x='adobe:ns:meta/'>"
+    "<rdf:RDF xmlns:rdf='http://www.w3.org/1999/02/22-rdf-syntax-ns#'"
+    "         xmlns:dc='http://purl.org/dc/elements/1.1/'>"
+    "  <rdf:Description rdf:about=''>"
+    "    <dc:creator><rdf:Seq><rdf:li>first</rdf:li><rdf:li>second</rdf:li></rdf:Seq></dc:creator>"
+    "  </rdf:Description>"
+    "</rdf:RDF></x:xmpmeta>"
+    "<?xpacket end='w'?>";
+
+static const char *test_sidecar =
+    "<rdf:RDF xmlns:rdf='http://www.w3.org/1999/02/22-rdf-syntax-ns#'"
+    "         xmlns:dc='http://purl.org/dc/elements/1.1/'>"
+    "  <rdf:Description rdf:about=''>"
+    "    <dc:creator><rdf:Seq>"
+    "      <rdf:li>sidecar one</rdf:li><rdf:li>sidecar two</rdf:li><rdf:li>sidecar three</rdf:li>"
+    "    </rdf:Seq></dc:creator>"
+    "  </rdf:Description>"
+    "</rdf:RDF>";
+
+static void
+test_batch()
+{
+    recontext_batch_options options = {
+        RECONTEXT_BATCH_WRITE_EXIV2, RECONTEXT_FORMAT_AUTO, 4, ".rdf"
+    };
+    gchar *filenames[8];
+    gchar *sidecar;
+    GByteArray *jpeg;
+    recontext_stats stats;
+    recontext *rc;
+    char **values;
+    size_t failed;
+    gboolean ok;
+    guint i;
+
+    jpeg = test_jpeg(test_xmp_creators, strlen(test_xmp_creators));
+
+    // the creators come from the sidecars, so the files must change
+    for (i = 0; i < G_N_ELEMENTS(filenames); i++) {
+        gchar *name = g_strdup_printf("test_recontext_batch_%u.jpg", i);
+
+        filenames[i] = g_build_filename(g_get_tmp_dir(), name, NULL);
+        sidecar = g_strconcat(filenames[i], ".rdf", NULL);
+        ok = g_file_set_contents(filenames[i], (const gchar *) jpeg->data, jpeg->len, NULL);
+        assert(ok);
+        ok = g_file_set_contents(sidecar, test_sidecar, -1, NULL);
+        assert(ok);
+        g_free(sidecar);
+        g_free(name);
+    }
+
+    // gexiv2 runs on four workers at once, counted in this thread
+    recontext_set_stats_enabled(1);
+    recontext_reset_stats();
+    failed = recontext_batch_run((const char * const *) filenames, G_N_ELEMENTS(filenames),
+                                 &options, NULL, NULL, NULL);
+    assert(failed == 0);
+    recontext_get_stats(&stats);
+    assert(stats.ops[RECONTEXT_OP_WRITE_EXIV2].calls == G_N_ELEMENTS(filenames));
+    recontext_set_stats_enabled(0);
+
+    for (i = 0; i < G_N_ELEMENTS(filenames); i++) {
+        rc = recontext_new_from_media_file(filenames[i], "http://example.org/a");
+        assert(rc != NULL);
+        values = recontext_get_values(rc, NULL, creator_predicates);
+        assert(g_strv_length(values) == 3);
+        assert(strcmp(values[0], "sidecar one") == 0);
+        g_strfreev(values);
+        recontext_destroy(rc);
+
+        sidecar = g_strconcat(filenames[i], ".rdf", NULL);
+        g_unlink(sidecar);
+        g_free(sidecar);
+        g_unlink(filenames[i]);
+        g_free(filenames[i]);
+    }
+
+    g_byte_array_free(jpeg, TRUE);
+}
+
+static const char *test_xmp_unrelated =
+    "<?xpacket begin='' id='W5M0MpCehiHzreSzNTczkc9d'?>"
+    "<x:xmpmeta xmlns:x='adobe:ns:meta/'>"
+    "<rdf:RDF xmlns:rdf='http://www.w3.org/1999/02/22-rdf-syntax-ns#'"
+    "         xmlns:dc='http://purl.org/dc/elements/1.1/'"
+    "         xmlns:xmp='http://ns.adobe.com/xap/1.0/'>"
+    "  <rdf:Description rdf:about=''>"
+    "    <xmp:CreatorTool>test tool</xmp:CreatorTool>"
+    "    <dc:rights><rdf:Alt><rdf:li xml:lang='x-default'>kept rights</rdf:li></rdf:Alt></dc:rights>"
+    "  </rdf:Description>"
+    "</rdf:RDF></x:xmpmeta>"
+    "<?xpacket end='w'?>";
+
+static const char *test_mapped_rdf =
+    "<?xml version='1.0'?>"
+    "<rdf:RDF xmlns:rdf='http://www.w3.org/1999/02/22-rdf-syntax-ns#'"
+    "         xmlns:dc='http://purl.org/dc/elements/1.1/'"
+    "         xmlns:dcterms='http://purl.org/dc/terms/'>"
+    "  <rdf:Description rdf:about='http://example.org/a'>"
+    "    <dc:title>untagged</dc:title>"
+    "    <dc:title xml:lang='en'>English title</dc:title>"
+    "    <dc:title><rdf:Alt>"
+    "      <rdf:li xml:lang='sv'>Svensk titel</rdf:li><rdf:li xml:lang='en'>Other title</rdf:li>"
+    "    </rdf:Alt></dc:title>"
+    "    <dc:creator><rdf:Seq><rdf:li>first</rdf:li><rdf:li>second</rdf:li></rdf:Seq></dc:creator>"
+    "    <dc:subject><rdf:Bag><rdf:li>one</rdf:li><rdf:li>two</rdf:li></rdf:Bag></dc:subject>"
+    "    <dc:source>literal source</dc:source>"
+    "    <dcterms:source rdf:resource='http://example.org/parent'/>"
+    "    <dc:identifier>id-b</dc:identifier>"
+    "    <dcterms:identifier>id-a</dcterms:identifier>"
+    "    <dc:format>image/png</dc:format>"
+    "    <dc:format>image/jpeg</dc:format>"
+    "  </rdf:Description>"
+    "  <rdf:Description rdf:about='http://example.org/parent'>"
+    "    <dc:rights>parent rights</dc:rights>"
+    "    <dc:title>parent title</dc:title>"
+    "  </rdf:Description>"
+    "</rdf:RDF>";
+
+static GExiv2Metadata*
+test_open_metadata(const char *packet)
+{
+    GExiv2Metadata *metadata;
+    GByteArray *jpeg;
+    gboolean opened;
+
+    jpeg = test_jpeg(packet, strlen(packet));
+    metadata = gexiv2_metadata_new();
+    opened = gexiv2_metadata_open_buf(metadata, jpeg->data, jpeg->len, NULL);
+    assert(opened);
+    g_byte_array_free(jpeg, TRUE);
 
-void main()
+    return metadata;
+}
+
+static void
+test_exiv2()
+{
+    GExiv2Metadata *metadata;
+    recontext *rc;
+    gchar **values;
+    gchar *value;
+    gchar *packet;
+
+    rc = recontext_new_from_string(test_mapped_rdf, "http://example.org/a");
+    assert(rc != NULL);
+    metadata = test_open_metadata(test_xmp_unrelated);
+    recontext_write_exiv2(rc, metadata);
+
+    // SEQ keeps its order, BAG keeps every value
+    values = gexiv2_metadata_get_tag_multiple(metadata, "Xmp.dc.creator");
+    assert(g_strv_length(values) == 2);
+    assert(strcmp(values[0], "first") == 0 && strcmp(values[1], "second") == 0);
+    g_strfreev(values);
+
+    values = gexiv2_metadata_get_tag_multiple(metadata, "Xmp.dc.subject");
+    assert(g_strv_length(values) == 2);
+    g_strfreev(values);
+
+    // TEXT takes the first predicate with values, then the first in order
+    value = gexiv2_metadata_get_tag_string(metadata, "Xmp.dc.identifier");
+    assert(strcmp(value, "id-b") == 0);
+    g_free(value);
+    value = gexiv2_metadata_get_tag_string(metadata, "Xmp.dc.format");
+    assert(strcmp(value, "image/jpeg") == 0);
+    g_free(value);
+
+    packet = gexiv2_metadata_get_xmp_packet(metadata);
+
+    // every source, though XMP holds dc:source as a simple property
+    assert(strstr(packet, "literal source") != NULL);
+    assert(strstr(packet, "http://example.org/parent") != NULL);
+
+    // one LANG_ALT entry per language, untagged values as x-default
+    assert(strstr(packet, "xml:lang=\"sv\">Svensk titel<") != NULL);
+    assert(strstr(packet, "xml:lang=\"en\">English title<") != NULL);
+    assert(strstr(packet, "xml:lang=\"x-default\">untagged<") != NULL);
+    assert(strstr(packet, "Other title") == NULL);
+
+    // neither the parent's statements nor a missing tag touch the file's own
+    assert(strstr(packet, "parent title") == NULL);
+    assert(strstr(packet, "parent rights") == NULL);
+    assert(strstr(packet, "kept rights") != NULL);
+    g_free(packet);
+
+    value = gexiv2_metadata_get_tag_string(metadata, "Xmp.xmp.CreatorTool");
+    assert(strcmp(value, "test tool") == 0);
+    g_free(value);
+
+    g_object_unref(metadata);
+    recontext_destroy(rc);
+}
+
+static void
+test_exiv2_sync()
+{
+    static const gchar *sentinel[] = { "sentinel", NULL };
+    recontext_stats stats;
+    GExiv2Metadata *metadata;
+    recontext *rc;
+    gchar **values;
+    gchar *value;
+    uint64_t scanned;
+    int status;
+
+    rc = recontext_new_from_string(test_mapped_rdf, "http://example.org/a");
+    metadata = test_open_metadata(test_xmp_unrelated);
+
+    recontext_set_stats_enabled(1);
+    recontext_reset_stats();
+
+    recontext_write_exiv2(rc, metadata);
+    recontext_get_stats(&stats);
+    scanned = stats.ops[RECONTEXT_OP_WRITE_EXIV2].statements;
+    assert(scanned > 0);
+
+    // nothing changed, so the second write does not even scan
+    recontext_write_exiv2(rc, metadata);
+    recontext_get_stats(&stats);
+    assert(stats.ops[RECONTEXT_OP_WRITE_EXIV2].calls == 2);
+    assert(stats.ops[RECONTEXT_OP_WRITE_EXIV2].statements == scanned);
+
+    // after a dc:format change only Xmp.dc.format is written again, the
+    // sentinel in a tag whose predicates did not change stays
+    gexiv2_metadata_set_tag_multiple(metadata, "Xmp.dc.subject", sentinel);
+    status = recontext_add(rc,
+        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) "http://example.org/a"),
+        librdf_new_node_from_uri_string(rc->world,
+                                        (const unsigned char *) "http://purl.org/dc/elements/1.1/format"),
+        librdf_new_node_from_literal(rc->world, (const unsigned char *) "image/aaa", NULL, 0));
+    assert(status == 0);
+    recontext_write_exiv2(rc, metadata);
+
+    recontext_get_stats(&stats);
+    assert(stats.ops[RECONTEXT_OP_WRITE_EXIV2].statements > scanned);
+    recontext_set_stats_enabled(0);
+
+    value = gexiv2_metadata_get_tag_string(metadata, "Xmp.dc.format");
+    assert(strcmp(value, "image/aaa") == 0);
+    g_free(value);
+
+    values = gexiv2_metadata_get_tag_multiple(metadata, "Xmp.dc.subject");
+    assert(g_strv_length(values) == 1 && strcmp(values[0], "sentinel") == 0);
+    g_strfreev(values);
+
+    // touching a predicate rewrites its tag even without a new value
+    recontext_touch(rc, "http://purl.org/dc/elements/1.1/subject");
+    recontext_write_exiv2(rc, metadata);
+    values = gexiv2_metadata_get_tag_multiple(metadata, "Xmp.dc.subject");
+    assert(g_strv_length(values) == 2);
+    g_strfreev(values);
+
+    g_object_unref(metadata);
+    recontext_destroy(rc);
+}
+
+/* save into a JPEG whose packet has the given padding, then check it */
+static void
+test_save_xmp_padded(recontext *rc, const char *filename, size_t padding, gboolean in_place)
+{
+    GExiv2Metadata *metadata;
+    GByteArray *jpeg;
+    GString *packet;
+    const char *trailer;
+    gchar *contents;
+    gchar *value;
+    gchar **values;
+    gsize length;
+    gboolean ok;
+    int error;
+
+    trailer = strstr(test_xmp_unrelated, "<?xpacket end");
+    packet = g_string_new_len(test_xmp_unrelated, trailer - test_xmp_unrelated);
+    while (padding-- > 0)
+        g_string_append_c(packet, ' ');
+    g_string_append(packet, trailer);
+
+    jpeg = test_jpeg(packet->str, packet->len);
+    ok = g_file_set_contents(filename, (const gchar *) jpeg->data, jpeg->len, NULL);
+    assert(ok);
+
+    error = recontext_save_xmp(rc, filename);
+    assert(error == 0);
+
+    // in place, the file keeps its size
+    ok = g_file_get_contents(filename, &contents, &length, NULL);
+    assert(ok);
+    assert(!in_place || length == jpeg->len);
+    g_free(contents);
+
+    metadata = gexiv2_metadata_new();
+    ok = gexiv2_metadata_open_path(metadata, filename, NULL);
+    assert(ok);
+
+    value = gexiv2_metadata_get_tag_string(metadata, "Xmp.xmp.CreatorTool");
+    assert(strcmp(value, "test tool") == 0);
+    g_free(value);
+
+    values = gexiv2_metadata_get_tag_multiple(metadata, "Xmp.dc.creator");
+    assert(g_strv_length(values) == 2);
+    g_strfreev(values);
+
+    g_object_unref(metadata);
+    g_byte_array_free(jpeg, TRUE);
+    g_string_free(packet, TRUE);
+}
+
+static void
+test_save_xmp()
+{
+    recontext *rc;
+    gchar *filename;
+
+    rc = recontext_new_from_string(test_mapped_rdf, "http://example.org/a");
+    filename = g_build_filename(g_get_tmp_dir(), "test_recontext_save.jpg", NULL);
+
+    // the merged packet goes in place when there is room and exiv2
+    // rewrites the file when not, both keeping the file's other properties
+    test_save_xmp_padded(rc, filename, 4096, TRUE);
+    test_save_xmp_padded(rc, filename, 0, FALSE);
+
+    g_unlink(filename);
+    g_free(filename);
+    recontext_destroy(rc);
+}
+
+static void
+test_focused()
+{
+    recontext* rc;
+    char **values;
+    gchar *truncated;
+
+    // without an allow-list the whole description of the subject is kept
+    rc = recontext_new_focused(test_rdf, strlen(test_rdf), "http://example.org/a",
+                               RECONTEXT_FORMAT_RDFXML, NULL);
+    values = recontext_get_values(rc, NULL, source_predicates);
+    assert(g_strv_length(values) == 2);
+    g_strfreev(values);
+    values = recontext_get_values(rc, NULL, creator_predicates);
+    assert(g_strv_length(values) == 10);
+    g_strfreev(values);
+    recontext_destroy(rc);
+
+    rc = recontext_new_focused(test_rdf, strlen(test_rdf), "http://example.org/a",
+                               RECONTEXT_FORMAT_RDFXML, creator_predicates);
+    values = recontext_get_values(rc, NULL, source_predicates);
+    assert(g_strv_length(values) == 0);
+    g_strfreev(values);
+    values = recontext_get_values(rc, "http://example.org/a", creator_predicates);
+    assert(g_strv_length(values) == 10);
+    assert(strcmp(values[9], "tenth") == 0);
+    g_strfreev(values);
+    recontext_destroy(rc);
+
+    // a truncated document is an error, not a shorter graph
+    rc = recontext_new_focused(test_rdf, strlen(test_rdf) / 2, "http://example.org/a",
+                               RECONTEXT_FORMAT_RDFXML, NULL);
+    assert(rc == NULL);
+
+    truncated = g_strndup(test_rdf, strlen(test_rdf) / 2);
+    rc = recontext_new_from_string(truncated, "http://example.org/a");
+    assert(rc == NULL);
+    g_free(truncated);
+}
+
+static void
+test_trace(recontext_op op, int begin, void *user_data)
+{
+    int *depth = user_data;
+
+    *depth += begin ? 1 : -1;
+    assert(*depth >= 0);
+}
+
+static void
+test_stats()
+{
+    recontext_stats stats;
+    recontext* rc;
+    char *data;
+    size_t length;
+    int depth = 0;
+
+    recontext_set_stats_enabled(1);
+    recontext_set_trace_func(test_trace, &depth);
+    recontext_reset_stats();
+
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+    data = recontext_serialize_fmt(rc, RECONTEXT_FORMAT_NTRIPLES, &length);
+
+    recontext_get_stats(&stats);
+    assert(stats.ops[RECONTEXT_OP_PARSE].calls == 1);
+    assert(stats.ops[RECONTEXT_OP_PARSE].bytes == strlen(test_rdf));
+    assert(stats.ops[RECONTEXT_OP_PARSE].statements > 0);
+    assert(stats.ops[RECONTEXT_OP_SERIALIZE].calls == 1);
+    assert(stats.ops[RECONTEXT_OP_SERIALIZE].bytes == length);
+    assert(stats.ops[RECONTEXT_OP_MERGE].calls == 0);
+    assert(depth == 0);
+    assert(strcmp(recontext_op_name(RECONTEXT_OP_SERIALIZE), "serialize") == 0);
+
+    // nothing is recorded once instrumentation is off again
+    recontext_set_trace_func(NULL, NULL);
+    recontext_set_stats_enabled(0);
+    recontext_destroy(recontext_extract(rc, "http://example.org/a", 0));
+    recontext_get_stats(&stats);
+    assert(stats.ops[RECONTEXT_OP_EXTRACT].calls == 0);
+
+    g_free(data);
+    recontext_destroy(rc);
+}
+
+static void
+test_budget()
+{
+    recontext* rc;
+    recontext* target;
+    recontext* fresh;
+    size_t usage;
+    int merged;
+
+    // the fixture needs well over a few hundred bytes
+    recontext_set_default_budget(300);
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+    assert(rc == NULL);
+    rc = recontext_new_focused(test_rdf, strlen(test_rdf), "http://example.org/a",
+                               RECONTEXT_FORMAT_RDFXML, NULL);
+    assert(rc == NULL);
+
+    // a focused parse keeps a part of the graph and is charged at most
+    // once per statement, held back or not
+    recontext_set_default_budget(1 << 20);
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+    target = recontext_new_focused(test_rdf, strlen(test_rdf), "http://example.org/a",
+                                   RECONTEXT_FORMAT_RDFXML, NULL);
+    assert(recontext_get_usage(target) > 0);
+    assert(recontext_get_usage(target) <= recontext_get_usage(rc));
+    recontext_destroy(target);
+    recontext_destroy(rc);
+    recontext_set_default_budget(0);
+
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+    assert(rc != NULL);
+    assert(recontext_get_usage(rc) == 0);
+
+    // a merge that does not fit leaves the target untouched
+    target = recontext_new("http://example.org/collection");
+    recontext_set_budget(target, 300);
+    merged = recontext_merge(target, rc, NULL);
+    assert(merged != 0);
+    assert(recontext_get_usage(target) == 0);
+    assert(librdf_model_size(target->model) == 0);
+
+    recontext_set_budget(target, 1 << 20);
+    merged = recontext_merge(target, rc, NULL);
+    assert(merged == 0);
+    assert(recontext_get_usage(target) > 300);
+
+    // only what is added is charged: nothing the second time, and the
+    // first merge fits a budget of exactly what it was charged
+    usage = recontext_get_usage(target);
+    merged = recontext_merge(target, rc, NULL);
+    assert(merged == 0);
+    assert(recontext_get_usage(target) == usage);
+
+    fresh = recontext_new("http://example.org/collection");
+    recontext_set_budget(fresh, usage - 1);
+    merged = recontext_merge(fresh, rc, NULL);
+    assert(merged != 0);
+    recontext_set_budget(fresh, usage);
+    merged = recontext_merge(fresh, rc, NULL);
+    assert(merged == 0);
+    assert(recontext_get_usage(fresh) == usage);
+    recontext_destroy(fresh);
+
+    // neither is an add that does not fit
+    usage = recontext_get_usage(target);
+    recontext_set_budget(target, usage);
+    merged = recontext_add(target,
+        librdf_new_node_from_uri_string(target->world, (const unsigned char *) "http://example.org/a"),
+        librdf_new_node_from_uri_string(target->world, (const unsigned char *) source_predicates[0]),
+        librdf_new_node_from_literal(target->world, (const unsigned char *) "no room", NULL, 0));
+    assert(merged != 0);
+    assert(recontext_get_usage(target) == usage);
+
+    recontext_destroy(target);
+    recontext_destroy(rc);
+}
+
+static void
+test_compact()
+{
+    recontext* rc;
+    recontext* extracted;
+    recontext* merged;
+    char **values;
+    int status;
+    int size;
+    int i;
+
+    recontext_set_default_storage(RECONTEXT_STORAGE_COMPACT);
+
+    // the compact store must give the same answers, SPARQL included
+    test_values();
+
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+    size = librdf_model_size(rc->model);
+
+    extracted = recontext_extract(rc, "http://example.org/b", 1);
+    assert(librdf_model_size(extracted->model) == 2);
+    assert(librdf_model_size(rc->model) == size - 2);
+
+    // merging twice adds nothing the second time
+    merged = recontext_new("http://example.org/collection");
+    status = recontext_merge(merged, rc, NULL);
+    assert(status == 0);
+    status = recontext_merge(merged, rc, NULL);
+    assert(status == 0);
+    assert(librdf_model_size(merged->model) == size - 2 + 1);
+
+    values = recontext_get_values(merged, "http://example.org/a", creator_predicates);
+    assert(g_strv_length(values) == 10);
+    assert(strcmp(values[9], "tenth") == 0);
+    g_strfreev(values);
+
+    // statements added between reads merge into the sorted ones
+    size = librdf_model_size(merged->model);
+    for (i = 0; i < 40; i++) {
+        librdf_statement *statement;
+        char title[16];
+        int contained;
+
+        g_snprintf(title, sizeof(title), "added %d", (39 - i) / 2);
+        statement = librdf_new_statement_from_nodes(merged->world,
+            librdf_new_node_from_uri_string(merged->world, (const unsigned char *)
+                (i % 3 == 0 ? "http://example.org/z" : "http://example.org/a")),
+            librdf_new_node_from_uri_string(merged->world, (const unsigned char *) creator_predicates[0]),
+            librdf_new_node_from_literal(merged->world, (const unsigned char *) title, NULL, 0));
+        librdf_model_add_statement(merged->model, statement);
+        contained = librdf_model_contains_statement(merged->model, statement);
+        assert(contained);
+        librdf_free_statement(statement);
+    }
+    assert(librdf_model_size(merged->model) == size + 34);
+
+    values = recontext_get_values(merged, "http://example.org/a", creator_predicates);
+    assert(g_strv_length(values) == 10 + 20);
+    g_strfreev(values);
+
+    recontext_destroy(merged);
+    recontext_destroy(extracted);
+    recontext_destroy(rc);
+
+    recontext_set_default_storage(RECONTEXT_STORAGE_MEMORY);
+}
+
+static const char *test_ancestry =
+    "@prefix dc: <http://purl.org/dc/elements/1.1/> .\n"
+    "<http://example.org/a> dc:title \"a\" ; dc:source <http://example.org/b> .\n"
+    "<http://example.org/b> dc:title \"b\" ; dc:source <http://example.org/c> .\n"
+    "<http://example.org/c> dc:title \"c\" ; dc:source <http://example.org/d> ;\n"
+    "    dc:creator [ dc:title \"someone\" ] .\n"
+    "<http://example.org/d> dc:title \"d\" .\n";
+
+static void
+test_provenance()
 {
     recontext* rc;
+    recontext* copy;
+    recontext* merged;
+    int status;
+
+    rc = recontext_new_from_string_fmt(test_ancestry, "http://example.org/a",
+                                       RECONTEXT_FORMAT_TURTLE);
+    assert(librdf_model_size(rc->model) == 9);
+
+    // a second parse brings new blank nodes, which map onto the first ones
+    copy = recontext_new_from_string_fmt(test_ancestry, "http://example.org/a",
+                                         RECONTEXT_FORMAT_TURTLE);
+    merged = recontext_new("http://example.org/collection");
+    status = recontext_merge_with_flags(merged, rc, NULL, RECONTEXT_MERGE_DEDUP);
+    assert(status == 0);
+    status = recontext_merge_with_flags(merged, copy, NULL, RECONTEXT_MERGE_DEDUP);
+    assert(status == 0);
+    assert(librdf_model_size(merged->model) == 9 + 1);
+    recontext_destroy(merged);
+
+    // b is a direct source and stays described, c and d are two and three
+    // links away; the blank node goes with c
+    status = recontext_compact(rc, 1, 0);
+    assert(status == 5);
+    assert(librdf_model_size(rc->model) == 4);
+    status = recontext_compact(rc, 1, 0);
+    assert(status == 0);
+
+    // a budget of two statements leaves the main subject alone
+    status = recontext_compact(copy, -1, 2);
+    assert(status == 7);
+    assert(librdf_model_size(copy->model) == 2);
+
+    recontext_destroy(copy);
+    recontext_destroy(rc);
+
+    // no limits keep everything, blank nodes nothing leads to included
+    rc = recontext_new_from_string_fmt("@prefix dc: <http://purl.org/dc/elements/1.1/> .\n"
+                                       "<http://example.org/a> dc:title \"a\" .\n"
+                                       "[] dc:title \"orphan\" .\n",
+                                       "http://example.org/a", RECONTEXT_FORMAT_TURTLE);
+    status = recontext_compact(rc, -1, 0);
+    assert(status == 0);
+    assert(librdf_model_size(rc->model) == 2);
+    recontext_destroy(rc);
+}
+
+/* a blank chain far deeper than the stack would take recursively, closed into a cycle */
+static void
+test_provenance_deep()
+{
+    GString *turtle;
+    recontext *rc;
+    recontext *merged;
+    size_t removed;
+    int status;
+    guint i;
+
+    turtle = g_string_new("@prefix dc: <http://purl.org/dc/elements/1.1/> .\n"
+                          "<http://example.org/a> dc:creator _:b0 ;\n"
+                          "    dc:source <http://example.org/b> .\n"
+                          "<http://example.org/b> dc:creator _:c0 .\n");
+    for (i = 0; i < 200000; i++) {
+        g_string_append_printf(turtle, "_:b%u dc:relation _:b%u .\n", i, i + 1);
+        g_string_append_printf(turtle, "_:c%u dc:relation _:c%u .\n", i, i + 1);
+    }
+    g_string_append_printf(turtle, "_:b%u dc:relation _:b0 .\n", i);
+
+    rc = recontext_new_from_string_fmt(turtle->str, "http://example.org/a",
+                                       RECONTEXT_FORMAT_TURTLE);
+    assert(rc != NULL);
+    g_string_free(turtle, TRUE);
+
+    merged = recontext_new("http://example.org/collection");
+    status = recontext_merge_with_flags(merged, rc, NULL, RECONTEXT_MERGE_DEDUP);
+    assert(status == 0);
+    recontext_destroy(merged);
+
+    // b goes at depth 0, and its chain with it
+    removed = recontext_compact(rc, 0, 0);
+    assert(removed == 200000 + 1);
+    recontext_destroy(rc);
+}
+
+static void
+test_diff()
+{
+    recontext* rc;
+    recontext* copy;
+    recontext* added;
+    recontext* removed;
+    char *first;
+    char *second;
+    char *output;
+    int status;
+
+    // blank node labels and statement order differ between the parses
+    rc = recontext_new_from_string_fmt(test_ancestry, "http://example.org/a",
+                                       RECONTEXT_FORMAT_TURTLE);
+    output = recontext_serialize_fmt(rc, RECONTEXT_FORMAT_NTRIPLES, NULL);
+    copy = recontext_new_from_string_fmt(output, "http://example.org/a",
+                                         RECONTEXT_FORMAT_NTRIPLES);
+    g_free(output);
+
+    first = recontext_hash(rc);
+    second = recontext_hash(copy);
+    assert(strlen(first) == 64);
+    assert(strcmp(first, second) == 0);
+    status = recontext_diff(rc, copy, NULL, NULL);
+    assert(status == 0);
+    g_free(second);
+
+    status = recontext_add(copy,
+        librdf_new_node_from_uri_string(copy->world, (const unsigned char *) "http://example.org/d"),
+        librdf_new_node_from_uri_string(copy->world,
+                                        (const unsigned char *) "http://purl.org/dc/elements/1.1/source"),
+        librdf_new_node_from_uri_string(copy->world, (const unsigned char *) "http://example.org/e"));
+    assert(status == 0);
+
+    second = recontext_hash(copy);
+    assert(strcmp(first, second) != 0);
+    g_free(second);
+
+    status = recontext_diff(rc, copy, &added, &removed);
+    assert(status == 1);
+    assert(librdf_model_size(added->model) == 1);
+    assert(librdf_model_size(removed->model) == 0);
+    recontext_destroy(added);
+    recontext_destroy(removed);
+
+    status = recontext_diff(copy, rc, NULL, NULL);
+    assert(status == 1);
+
+    g_free(first);
+    recontext_destroy(copy);
+    recontext_destroy(rc);
+}
+
+static void
+test_changes()
+{
+    recontext* rc;
+    recontext* extracted;
+    uint64_t generation;
+    char *first;
+    char *second;
+    size_t length;
+    size_t size;
+    int status;
+
+    rc = recontext_new_from_string(test_rdf, "http://example.org/a");
+    generation = recontext_get_generation(rc);
+    assert(generation > 0);
+
+    // unchanged graphs serialize to the same output from the cache
+    first = recontext_serialize(rc);
+    second = recontext_serialize_counted(rc, &length);
+    assert(first != second);
+    assert(strcmp(first, second) == 0);
+    assert(length == strlen(first));
+    size = recontext_serialize_size(rc);
+    assert(size == length);
+    g_free(second);
+
+    status = recontext_add(rc,
+        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) "http://example.org/a"),
+        librdf_new_node_from_uri_string(rc->world, (const unsigned char *) "http://purl.org/dc/elements/1.1/title"),
+        librdf_new_node_from_literal(rc->world, (const unsigned char *) "added title", NULL, 0));
+    assert(status == 0);
+    assert(recontext_get_generation(rc) > generation);
+
+    second = recontext_serialize(rc);
+    assert(strstr(first, "added title") == NULL);
+    assert(strstr(second, "added title") != NULL);
+    g_free(second);
+    g_free(first);
+
+    // removing statements is a change, copying them out is not
+    generation = recontext_get_generation(rc);
+    extracted = recontext_extract(rc, "http://example.org/b", 0);
+    assert(recontext_get_generation(rc) == generation);
+    recontext_destroy(extracted);
+
+    extracted = recontext_extract(rc, "http://example.org/b", 1);
+    assert(recontext_get_generation(rc) > generation);
+    recontext_destroy(extracted);
+
+    generation = recontext_get_generation(rc);
+    recontext_touch(rc, NULL);
+    assert(recontext_get_generation(rc) > generation);
+
+    recontext_destroy(rc);
+}
+
+/* the one entry file in the cache directory */
+static gchar*
+test_cache_entry(const char *directory)
+{
+    GDir *dir = g_dir_open(directory, 0, NULL);
+    const gchar *name;
+    gchar *path = NULL;
+
+    assert(dir != NULL);
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        assert(path == NULL);
+        path = g_build_filename(directory, name, NULL);
+    }
+    g_dir_close(dir);
 
+    return path;
+}
+
+static void
+test_cache()
+{
+    GString *packet;
+    recontext *parsed;
+    recontext *cached;
+    recontext *merged;
+    recontext *second;
+    gboolean written;
+    int status;
+    int size;
+    gchar *directory;
+    gchar *entry;
+    char *expected;
+    char *data;
+
+    packet = g_string_new("<?xpacket begin='' id='W5M0MpCehiHzreSzNTczkc9d'?>");
+    g_string_append(packet, strstr(test_rdf, "<rdf:RDF"));
+    g_string_append(packet, "<?xpacket end='w'?>");
+
+    directory = g_build_filename(g_get_tmp_dir(), "test_recontext_cache", NULL);
+    status = recontext_cache_open(directory, 1 << 20, 1 << 20);
+    assert(status == 0);
+
+    parsed = recontext_new_from_xmp(packet->str, "http://example.org/a");
+    assert(parsed != NULL);
+    expected = recontext_hash(parsed);
+    entry = test_cache_entry(directory);
+    assert(entry != NULL);
+
+    // from memory, then from disk; blank labels are new on every load, so
+    // the graphs are compared by their canonical hashes
+    cached = recontext_new_from_xmp(packet->str, "http://example.org/a");
+    data = recontext_hash(cached);
+    assert(strcmp(data, expected) == 0);
+    g_free(data);
+    recontext_destroy(cached);
+
+    recontext_cache_close();
+    status = recontext_cache_open(directory, 1 << 20, 1 << 20);
+    assert(status == 0);
+
+    cached = recontext_new_from_xmp(packet->str, "http://example.org/a");
+    data = recontext_hash(cached);
+    assert(strcmp(data, expected) == 0);
+    g_free(data);
+    recontext_destroy(cached);
+
+    // two loads never share blank nodes, just like two parses
+    merged = recontext_new("http://example.org/collection");
+    second = recontext_new_from_xmp(packet->str, "http://example.org/a");
+    status = recontext_merge(merged, second, NULL);
+    assert(status == 0);
+    recontext_destroy(second);
+    second = recontext_new_from_xmp(packet->str, "http://example.org/a");
+    status = recontext_merge(merged, second, NULL);
+    assert(status == 0);
+    recontext_destroy(second);
+    size = librdf_model_size(merged->model);
+    recontext_destroy(merged);
+
+    recontext_cache_close();
+    merged = recontext_new("http://example.org/collection");
+    status = recontext_merge(merged, parsed, NULL);
+    assert(status == 0);
+    second = recontext_new_from_xmp(packet->str, "http://example.org/a");
+    status = recontext_merge(merged, second, NULL);
+    assert(status == 0);
+    recontext_destroy(second);
+    assert(librdf_model_size(merged->model) == size);
+    recontext_destroy(merged);
+    status = recontext_cache_open(directory, 1 << 20, 1 << 20);
+    assert(status == 0);
+
+    // running out of budget fails the load but keeps the entry
+    recontext_set_default_budget(300);
+    cached = recontext_new_from_xmp(packet->str, "http://example.org/a");
+    assert(cached == NULL);
+    recontext_set_default_budget(0);
+    data = test_cache_entry(directory);
+    assert(data != NULL && strcmp(data, entry) == 0);
+    g_free(data);
+
+    // a damaged entry is dropped and the packet parsed again
+    recontext_cache_close();
+    written = g_file_set_contents(entry, "RCX1 damaged", -1, NULL);
+    assert(written);
+    status = recontext_cache_open(directory, 1 << 20, 1 << 20);
+    assert(status == 0);
+
+    cached = recontext_new_from_xmp(packet->str, "http://example.org/a");
+    assert(cached != NULL);
+    data = recontext_hash(cached);
+    assert(strcmp(data, expected) == 0);
+    g_free(data);
+    recontext_destroy(cached);
+
+    // entries larger than the disk limit are evicted
+    recontext_cache_close();
+    status = recontext_cache_open(directory, 16, 0);
+    assert(status == 0);
+    data = test_cache_entry(directory);
+    assert(data == NULL);
+    recontext_cache_close();
+
+    g_rmdir(directory);
+    g_free(directory);
+    g_free(entry);
+    g_free(expected);
+    recontext_destroy(parsed);
+    g_string_free(packet, TRUE);
+}
+
+static void
+test_async_done(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    *(GAsyncResult **) user_data = g_object_ref(result);
+}
+
+/* run the main loop until the callback has stored the result */
+static GAsyncResult*
+test_async_wait(GAsyncResult **result)
+{
+    while (*result == NULL)
+        g_main_context_iteration(NULL, TRUE);
+
+    return *result;
+}
+
+static void
+test_async()
+{
+    GAsyncResult *result = NULL;
+    GCancellable *cancellable;
+    GError *error = NULL;
+    recontext *rc;
+    recontext *local;
+    char **values;
+    char *data;
+    char *expected;
+    gchar *filename;
+    gboolean written;
+    recontext_stats stats;
+    size_t length;
+    int status;
+    int size;
+
+    recontext_set_stats_enabled(1);
+    recontext_reset_stats();
+
+    recontext_new_from_string_async(test_rdf, "http://example.org/a", RECONTEXT_FORMAT_RDFXML,
+                                    NULL, test_async_done, &result);
+    rc = recontext_new_finish(test_async_wait(&result), &error);
+    g_clear_object(&result);
+    assert(rc != NULL && error == NULL);
+
+    // the parse ran on a worker, its counts land in this thread
+    recontext_get_stats(&stats);
+    assert(stats.ops[RECONTEXT_OP_PARSE].calls == 1);
+    assert(stats.ops[RECONTEXT_OP_PARSE].bytes == strlen(test_rdf));
+    recontext_set_stats_enabled(0);
+
+    values = recontext_get_values(rc, "http://example.org/a", creator_predicates);
+    assert(g_strv_length(values) == 10);
+    g_strfreev(values);
+
+    // in the background for both, same output
+    local = recontext_new_from_string(test_rdf, "http://example.org/a");
+    expected = recontext_serialize_fmt(local, RECONTEXT_FORMAT_NTRIPLES, NULL);
+
+    recontext_serialize_async(rc, RECONTEXT_FORMAT_NTRIPLES, NULL, test_async_done, &result);
+    data = recontext_serialize_finish(test_async_wait(&result), &length, &error);
+    g_clear_object(&result);
+    assert(data != NULL && length == strlen(data));
+    assert(strcmp(data, expected) == 0);
+    g_free(data);
+
+    // the job works on a snapshot, local may change meanwhile; the merge
+    // also copies the statements of rc over from its own world
+    recontext_touch(local, NULL);
+    size = librdf_model_size(local->model);
+    recontext_serialize_async(local, RECONTEXT_FORMAT_NTRIPLES, NULL, test_async_done, &result);
+    status = recontext_merge(local, rc, NULL);
+    assert(status == 0);
+    recontext_destroy(rc);
+
+    data = recontext_serialize_finish(test_async_wait(&result), &length, &error);
+    g_clear_object(&result);
+    assert(data != NULL && strcmp(data, expected) == 0);
+    g_free(data);
+
+    assert(librdf_model_size(local->model) > size);
+
+    g_free(expected);
+    recontext_destroy(local);
+
+    recontext_new_from_file_async("/nonexistent/file.rdf", NULL, NULL, test_async_done, &result);
+    rc = recontext_new_finish(test_async_wait(&result), &error);
+    assert(rc == NULL);
+    g_clear_object(&result);
+    assert(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND));
+    g_clear_error(&error);
+
+    recontext_new_from_media_file_async("/nonexistent/file.jpg", NULL, NULL, test_async_done, &result);
+    rc = recontext_new_finish(test_async_wait(&result), &error);
+    assert(rc == NULL);
+    g_clear_object(&result);
+    assert(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND));
+    g_clear_error(&error);
+
+    // a readable file without metadata is invalid data, not an I/O error
+    filename = g_build_filename(g_get_tmp_dir(), "test_recontext_async.jpg", NULL);
+    written = g_file_set_contents(filename, "no metadata here", -1, NULL);
+    assert(written);
+    recontext_new_from_media_file_async(filename, NULL, NULL, test_async_done, &result);
+    rc = recontext_new_finish(test_async_wait(&result), &error);
+    assert(rc == NULL);
+    g_clear_object(&result);
+    assert(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA));
+    g_clear_error(&error);
+    g_unlink(filename);
+    g_free(filename);
+
+    cancellable = g_cancellable_new();
+    g_cancellable_cancel(cancellable);
+
+    recontext_new_from_string_async(test_rdf, "http://example.org/a", RECONTEXT_FORMAT_RDFXML,
+                                    cancellable, test_async_done, &result);
+    rc = recontext_new_finish(test_async_wait(&result), &error);
+    assert(rc == NULL);
+    g_clear_object(&result);
+    assert(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED));
+    g_clear_error(&error);
+
+    g_object_unref(cancellable);
+}
+
+int main()
+{
     recontext_init();
 
-    rc = recontext_new();
+    test_new();
+    test_values();
+    test_serialize();
+    test_formats();
+    test_file();
+    test_media();
+    test_locate();
+    test_xmp_in_place();
+    test_batch();
+    test_exiv2();
+    test_exiv2_sync();
+    test_save_xmp();
+    test_focused();
+    test_stats();
+    test_budget();
+    test_compact();
+    test_changes();
+    test_provenance();
+    test_provenance_deep();
+    test_diff();
+    test_async();
+    test_cache();
 
     recontext_cleanup();
+    return 0;
 }
@@ -0,0 +1,244 @@
+/*
+ * recontext-batch - process many assets' metadata in parallel
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ *
+ * Distributed under the MIT license, please see LICENSE in the top dir.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <recontext.h>
+#include <recontext_batch.h>
+
+static gint     threads = 0;
+static gchar   *mode_name = "serialize";
+static gchar   *format_name = "rdfxml";
+static gchar   *sidecar_suffix = NULL;
+static gchar   *list_file = NULL;
+static gchar   *output_file = NULL;
+static gchar   *output_dir = NULL;
+static gchar   *merge_subject = "urn:recontext:batch";
+
+static GOptionEntry entries[] = {
+    { "threads", 'j', 0, G_OPTION_ARG_INT, &threads,
+      "Number of worker threads (default: one per core)", "N" },
+    { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode_name,
+      "serialize, extract, merge or write", "MODE" },
+    { "format", 'f', 0, G_OPTION_ARG_STRING, &format_name,
+      "Output format: rdfxml, ntriples or turtle", "FORMAT" },
+    { "sidecar", 's', 0, G_OPTION_ARG_STRING, &sidecar_suffix,
+      "Read metadata from FILE + SUFFIX instead of the asset", "SUFFIX" },
+    { "list", 'l', 0, G_OPTION_ARG_FILENAME, &list_file,
+      "Read file names from LIST, one per line (- for stdin)", "LIST" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_file,
+      "Write output to FILE instead of stdout", "FILE" },
+    { "output-dir", 'd', 0, G_OPTION_ARG_FILENAME, &output_dir,
+      "Write one output file per asset into DIR", "DIR" },
+    { "subject", 0, 0, G_OPTION_ARG_STRING, &merge_subject,
+      "Main subject of the merged graph", "URI" },
+    { NULL }
+};
+
+static const struct {
+    const char            *name;
+    recontext_batch_mode   mode;
+} modes[] = {
+    { "serialize", RECONTEXT_BATCH_SERIALIZE   },
+    { "extract",   RECONTEXT_BATCH_EXTRACT     },
+    { "merge",     RECONTEXT_BATCH_MERGE       },
+    { "write",     RECONTEXT_BATCH_WRITE_EXIV2 },
+};
+
+static const struct {
+    const char        *name;
+    const char        *extension;
+    recontext_format   format;
+} formats[] = {
+    { "rdfxml",   ".rdf", RECONTEXT_FORMAT_RDFXML   },
+    { "ntriples", ".nt",  RECONTEXT_FORMAT_NTRIPLES },
+    { "turtle",   ".ttl", RECONTEXT_FORMAT_TURTLE   },
+};
+
+typedef struct {
+    FILE         *out;
+    const char   *extension;
+    int           per_asset;
+} batch_output;
+
+static void
+read_list(const char *filename, GPtrArray *files)
+{
+    FILE *fh;
+    char *line = NULL;
+    size_t size = 0;
+
+    fh = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "recontext-batch: cannot open %s\n", filename);
+        exit(1);
+    }
+
+    // lines of any length, paths are not cut at a fixed buffer size
+    while (getline(&line, &size, fh) != -1) {
+        g_strchomp(line);
+        if (line[0] != '\0')
+            g_ptr_array_add(files, g_strdup(line));
+    }
+
+    if (ferror(fh)) {
+        fprintf(stderr, "recontext-batch: cannot read %s\n", filename);
+        exit(1);
+    }
+
+    free(line);
+    if (fh != stdin)
+        fclose(fh);
+}
+
+static void
+write_result(const recontext_batch_result *result, void *user_data)
+{
+    batch_output *output = user_data;
+
+    if (result->error) {
+        fprintf(stderr, "recontext-batch: %s: failed\n", result->filename);
+        return;
+    }
+
+    if (!output->per_asset || result->output == NULL)
+        return;
+
+    if (output_dir != NULL) {
+        gchar *basename = g_path_get_basename(result->filename);
+        gchar *name = g_strconcat(basename, output->extension, NULL);
+        gchar *path = g_build_filename(output_dir, name, NULL);
+
+        if (!g_file_set_contents(path, result->output, result->length, NULL))
+            fprintf(stderr, "recontext-batch: cannot write %s\n", path);
+
+        g_free(path);
+        g_free(name);
+        g_free(basename);
+    } else if (output->out != NULL) {
+        fwrite(result->output, 1, result->length, output->out);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext          *context;
+    GError                  *error = NULL;
+    GPtrArray               *files;
+    recontext_batch_options  options;
+    batch_output             output;
+    recontext               *merged = NULL;
+    FILE                    *out = NULL;
+    gint64                   start;
+    double                   elapsed;
+    size_t                   failed;
+    guint                    i;
+    int                      found;
+
+    context = g_option_context_new("[FILE...]");
+    g_option_context_set_summary(context, "Process the metadata of many assets in parallel.");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "recontext-batch: %s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    memset(&options, 0, sizeof(options));
+    memset(&output, 0, sizeof(output));
+
+    found = 0;
+    for (i = 0; i < G_N_ELEMENTS(modes); i++) {
+        if (strcmp(mode_name, modes[i].name) == 0) {
+            options.mode = modes[i].mode;
+            found = 1;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "recontext-batch: unknown mode %s\n", mode_name);
+        return 1;
+    }
+
+    found = 0;
+    for (i = 0; i < G_N_ELEMENTS(formats); i++) {
+        if (strcmp(format_name, formats[i].name) == 0) {
+            options.format = formats[i].format;
+            output.extension = formats[i].extension;
+            found = 1;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "recontext-batch: unknown format %s\n", format_name);
+        return 1;
+    }
+
+    options.threads = threads;
+    options.sidecar_suffix = sidecar_suffix;
+
+    files = g_ptr_array_new_with_free_func(g_free);
+    for (i = 1; i < (guint) argc; i++)
+        g_ptr_array_add(files, g_strdup(argv[i]));
+    if (list_file != NULL)
+        read_list(list_file, files);
+
+    if (files->len == 0) {
+        fprintf(stderr, "recontext-batch: no input files\n");
+        return 1;
+    }
+
+    if (options.mode != RECONTEXT_BATCH_WRITE_EXIV2) {
+        out = output_file != NULL ? fopen(output_file, "wb") : stdout;
+        if (out == NULL) {
+            fprintf(stderr, "recontext-batch: cannot open %s\n", output_file);
+            return 1;
+        }
+    }
+
+    recontext_init();
+
+    // merged output is written once at the end, per-asset output as it arrives
+    if (options.mode == RECONTEXT_BATCH_MERGE)
+        merged = recontext_new(merge_subject);
+    else
+        output.per_asset = 1;
+    output.out = out;
+
+    start = g_get_monotonic_time();
+    failed = recontext_batch_run((const char * const *) files->pdata, files->len, &options,
+                                 write_result, &output, merged);
+
+    if (merged != NULL) {
+        size_t length = 0;
+        char *data = recontext_serialize_fmt(merged, options.format, &length);
+
+        if (data != NULL)
+            fwrite(data, 1, length, out);
+
+        g_free(data);
+        recontext_destroy(merged);
+    }
+    elapsed = (g_get_monotonic_time() - start) / (double) G_USEC_PER_SEC;
+
+    fprintf(stderr, "recontext-batch: %u assets in %.2f s (%.0f assets/s), %zu failed\n",
+            files->len, elapsed, files->len / elapsed, failed);
+
+    if (out != NULL && out != stdout)
+        fclose(out);
+
+    recontext_cleanup();
+    g_ptr_array_free(files, TRUE);
+
+    return failed > 0;
+}